@@ -0,0 +1,632 @@
+// Copyright 2018 Adam Robinson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy of 
+// this software and associated documentation files (the "Software"), to deal in the 
+// Software without restriction, including without limitation the rights to use, copy, 
+// modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, 
+// and to permit persons to whom the Software is furnished to do so, subject to the 
+// following conditions:
+
+// The above copyright notice and this permission notice shall be included in all 
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF 
+// CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE 
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Latency and throughput benchmark. Sweeps message sizes and measures
+// one way streaming, ping-pong round trips and traffic in both
+// directions at once. By default the peer is a forked copy of this
+// program, so no MPI installation is needed; with -m the peer is
+// started through mpirun instead. The copy test runs on its own and
+// compares memcpy with the streaming copy used for large payloads: 
+// how fast each copies, and how long it takes afterwards to read a
+// working set that was in the cache before the copy.
+//
+// Usage: ./bench.o [options]
+//     -c rendezvous|ring|socket  channel mode (default rendezvous); 
+//                         socket goes over TCP on the loopback
+//     -r bytes            ring capacity in ring mode (default 16M)
+//     -w block|spin|spinblock  wait strategy of both sides (default block)
+//     -s bytes            smallest message size (default 8)
+//     -S bytes            largest message size (default 256M)
+//     -t stream,pingpong,bidir,copy  tests to run (default all)
+//     -T bytes|off        streaming copy threshold of both sides 
+//                         (default MSG_STREAMING_COPY_THRESHOLD)
+//     -W bytes            working set of the copy test (default 1M)
+//     -b bytes            bytes to move per size and test (default 1G)
+//     -n count            maximum iterations per size (default 100000)
+//     -z                  zero copy receive, don't copy messages out
+//     -m "mpirun args"    start the peer with mpirun, e.g. -m "-n 1"
+// Sizes accept K, M and G suffixes.
+
+#include "mpi_controller.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define BENCH_CMD_STREAM   1
+#define BENCH_CMD_PINGPONG 2
+#define BENCH_CMD_BIDIR    3
+#define BENCH_CMD_DONE     4
+#define BENCH_CMD_QUIT     5
+
+// Number of iterations at the start of every run that aren't measured.
+// They take care of page faults and growing the payload areas.
+#define BENCH_WARMUP 3
+
+// The copy test copies each size at most this many times.
+#define BENCH_COPY_ITERATIONS 200
+
+// Sent to the peer before every run.
+struct BenchCommand {
+	int64_t size;
+	int64_t iterations;
+	int32_t copyOut;
+	int32_t pad;
+};
+
+struct BenchSettings {
+	char    name[64];
+	char *  mpiArguments;  // NULL to fork the peer.
+	int     channelMode;
+	size_t  ringCapacity;
+	int     waitStrategy;
+	size_t  minSize;
+	size_t  maxSize;
+	int64_t targetBytes;
+	int64_t maxIterations;
+	bool    zeroCopy;
+	bool    runStream;
+	bool    runPingPong;
+	bool    runBidir;
+	bool    runCopy;
+	size_t  copyThreshold;
+	size_t  workingSet;
+};
+
+// State shared with the thread that receives during the bidirectional test.
+struct BenchReceiver {
+	struct MPIController * instance;
+	char *  buffer;
+	int64_t iterations;
+	bool    copyOut;
+};
+
+uint64_t nowNanoseconds() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+int compareSamples(const void * a, const void * b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Parses sizes like 64, 8K, 16M or 1G.
+size_t parseSize(const char * text) {
+	char * end;
+	double value = strtod(text, &end);
+
+	switch (*end) {
+		case 'k': case 'K': value *= 1024.0; break;
+		case 'm': case 'M': value *= 1024.0 * 1024.0; break;
+		case 'g': case 'G': value *= 1024.0 * 1024.0 * 1024.0; break;
+	}
+
+	return (size_t)value;
+}
+
+void formatSize(char * buffer, size_t size) {
+	if (size >= (1 << 20)) {
+		sprintf(buffer, "%zu MB", size >> 20);
+	} else if (size >= (1 << 10)) {
+		sprintf(buffer, "%zu KB", size >> 10);
+	} else {
+		sprintf(buffer, "%zu B", size);
+	}
+}
+
+// Receives one message. Unless copyOut is false it's copied into
+// buffer, which is what most real consumers end up doing.
+void receiveInto(struct MPIController * instance, char * buffer, bool copyOut) {
+	int code;
+	int length;
+	int type;
+	const void * view = recvMessageView(instance, &code, &length, &type);
+
+	if (copyOut) {
+		memcpy(buffer, view, length);
+	}
+
+	releaseMessage(instance);
+}
+
+void * receiverThread(void * argument) {
+	struct BenchReceiver * receiver = (struct BenchReceiver *)argument;
+
+	for (int64_t i = 0; i < receiver->iterations; ++i) {
+		receiveInto(receiver->instance, receiver->buffer, receiver->copyOut);
+	}
+
+	return NULL;
+}
+
+// Sends iterations messages of the given size while another thread
+// receives the same number from the other side.
+void sendWhileReceiving(struct MPIController * instance, char * sendBuffer, char * recvBuffer,
+	int64_t size, int64_t iterations, bool copyOut) {
+	struct BenchReceiver receiver;
+	receiver.instance   = instance;
+	receiver.buffer     = recvBuffer;
+	receiver.iterations = iterations;
+	receiver.copyOut    = copyOut;
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, receiverThread, &receiver);
+
+	for (int64_t i = 0; i < iterations; ++i) {
+		sendMessage(instance, sendBuffer, 0, size, MSG_TYPE_STRING);
+	}
+
+	pthread_join(thread, NULL);
+}
+
+// The peer side. Runs whatever the controller asks for until it's
+// told to quit.
+void runPeer(struct MPIController * instance, size_t maxSize) {
+	char * sendBuffer = malloc(maxSize);
+	char * recvBuffer = malloc(maxSize);
+	memset(sendBuffer, 1, maxSize);
+
+	while (true) {
+		int code;
+		int length;
+		int type;
+		struct BenchCommand * command = recvMessage(instance, &code, &length, &type);
+		int64_t size       = command->size;
+		int64_t iterations = command->iterations;
+		bool    copyOut    = command->copyOut;
+		free(command);
+
+		if (code == BENCH_CMD_QUIT) {
+			break;
+		}
+
+		if (code == BENCH_CMD_STREAM) {
+			for (int64_t i = 0; i < iterations; ++i) {
+				receiveInto(instance, recvBuffer, copyOut);
+			}
+			sendMessage(instance, NULL, BENCH_CMD_DONE, 0, MSG_TYPE_INT);
+		} else if (code == BENCH_CMD_PINGPONG) {
+			for (int64_t i = 0; i < iterations; ++i) {
+				receiveInto(instance, recvBuffer, copyOut);
+				sendMessage(instance, sendBuffer, 0, size, MSG_TYPE_STRING);
+			}
+		} else if (code == BENCH_CMD_BIDIR) {
+			sendWhileReceiving(instance, sendBuffer, recvBuffer, size, iterations, copyOut);
+		}
+	}
+
+	free(sendBuffer);
+	free(recvBuffer);
+}
+
+void sendCommand(struct MPIController * instance, int code, int64_t size, int64_t iterations, bool copyOut) {
+	struct BenchCommand command;
+	command.size       = size;
+	command.iterations = iterations;
+	command.copyOut    = copyOut;
+	command.pad        = 0;
+	sendMessage(instance, &command, code, sizeof(command), MSG_TYPE_INT);
+}
+
+// Prints one line of results. samples may be NULL for tests that
+// don't measure individual operations.
+void printResult(const char * test, size_t size, int64_t iterations, uint64_t * samples,
+	uint64_t elapsed, double bytesMoved) {
+	char sizeText[32];
+	formatSize(sizeText, size);
+
+	printf("%-10s %10s %10lld", test, sizeText, (long long)iterations);
+
+	if (samples != NULL) {
+		qsort(samples, iterations, sizeof(uint64_t), compareSamples);
+		double p50  = samples[(int64_t)(iterations * 0.5)] / 1000.0;
+		double p99  = samples[(int64_t)(iterations * 0.99)] / 1000.0;
+		double p999 = samples[(int64_t)(iterations * 0.999)] / 1000.0;
+		printf(" %12.3f %12.3f %12.3f", p50, p99, p999);
+	} else {
+		printf(" %12s %12s %12s", "-", "-", "-");
+	}
+
+	double seconds = elapsed / 1e9;
+	printf(" %10.3f %14.0f\n", bytesMoved / seconds / 1e9, iterations / seconds);
+	fflush(stdout);
+}
+
+// One way: the controller sends, the peer receives. Samples are the
+// time each send takes. The clock stops once the peer has received
+// everything.
+void benchStream(struct MPIController * instance, struct BenchSettings * settings,
+	char * sendBuffer, size_t size, int64_t iterations, uint64_t * samples) {
+	sendCommand(instance, BENCH_CMD_STREAM, size, iterations + BENCH_WARMUP, !settings->zeroCopy);
+
+	for (int i = 0; i < BENCH_WARMUP; ++i) {
+		sendMessage(instance, sendBuffer, 0, size, MSG_TYPE_STRING);
+	}
+
+	uint64_t start = nowNanoseconds();
+	for (int64_t i = 0; i < iterations; ++i) {
+		uint64_t before = nowNanoseconds();
+		sendMessage(instance, sendBuffer, 0, size, MSG_TYPE_STRING);
+		samples[i] = nowNanoseconds() - before;
+	}
+
+	int code;
+	int length;
+	int type;
+	free(recvMessage(instance, &code, &length, &type));
+	uint64_t elapsed = nowNanoseconds() - start;
+
+	printResult("stream", size, iterations, samples, elapsed, (double)size * iterations);
+}
+
+// Round trips: the controller sends, the peer sends the same amount
+// back. Samples are full round trip times.
+void benchPingPong(struct MPIController * instance, struct BenchSettings * settings,
+	char * sendBuffer, char * recvBuffer, size_t size, int64_t iterations, uint64_t * samples) {
+	bool copyOut = !settings->zeroCopy;
+	sendCommand(instance, BENCH_CMD_PINGPONG, size, iterations + BENCH_WARMUP, copyOut);
+
+	for (int i = 0; i < BENCH_WARMUP; ++i) {
+		sendMessage(instance, sendBuffer, 0, size, MSG_TYPE_STRING);
+		receiveInto(instance, recvBuffer, copyOut);
+	}
+
+	uint64_t start = nowNanoseconds();
+	for (int64_t i = 0; i < iterations; ++i) {
+		uint64_t before = nowNanoseconds();
+		sendMessage(instance, sendBuffer, 0, size, MSG_TYPE_STRING);
+		receiveInto(instance, recvBuffer, copyOut);
+		samples[i] = nowNanoseconds() - before;
+	}
+	uint64_t elapsed = nowNanoseconds() - start;
+
+	printResult("pingpong", size, iterations, samples, elapsed, 2.0 * size * iterations);
+}
+
+// Both sides send and receive at the same time. Only throughput is
+// reported.
+void benchBidir(struct MPIController * instance, struct BenchSettings * settings,
+	char * sendBuffer, char * recvBuffer, size_t size, int64_t iterations) {
+	bool copyOut = !settings->zeroCopy;
+	sendCommand(instance, BENCH_CMD_BIDIR, size, iterations, copyOut);
+
+	uint64_t start = nowNanoseconds();
+	sendWhileReceiving(instance, sendBuffer, recvBuffer, size, iterations, copyOut);
+	uint64_t elapsed = nowNanoseconds() - start;
+
+	printResult("bidir", size, iterations, NULL, elapsed, 2.0 * size * iterations);
+}
+
+// Reads every cache line of the working set, so that it's as cached
+// as it can be, and returns the time that took.
+uint64_t touchWorkingSet(volatile char * workingSet, size_t size) {
+	uint64_t start = nowNanoseconds();
+	for (size_t i = 0; i < size; i += MSG_CACHE_LINE) {
+		(void)workingSet[i];
+	}
+	return nowNanoseconds() - start;
+}
+
+// Copies size bytes with memcpy or streamingCopy, each time right 
+// after the working set has been read, and measures the copy and how
+// long the working set then takes to read again. Returns the medians.
+void measureCopy(char * destination, char * source, size_t size, char * workingSet, size_t workingSetSize,
+	bool streaming, int iterations, uint64_t * copySamples, uint64_t * touchSamples, 
+	uint64_t * copyTime, uint64_t * touchTime) {
+	for (int i = 0; i < iterations; ++i) {
+		touchWorkingSet(workingSet, workingSetSize);
+
+		uint64_t start = nowNanoseconds();
+		if (streaming) {
+			streamingCopy(destination, source, size);
+		} else {
+			memcpy(destination, source, size);
+		}
+		copySamples[i] = nowNanoseconds() - start;
+
+		touchSamples[i] = touchWorkingSet(workingSet, workingSetSize);
+	}
+
+	qsort(copySamples, iterations, sizeof(uint64_t), compareSamples);
+	qsort(touchSamples, iterations, sizeof(uint64_t), compareSamples);
+	*copyTime  = copySamples[iterations / 2];
+	*touchTime = touchSamples[iterations / 2];
+}
+
+// Sweeps the sizes with both copies. Past the crossover, the time the
+// streaming copy loses (if any) is made up by the working set staying
+// in the cache.
+void benchCopy(struct BenchSettings * settings) {
+	char * source      = malloc(settings->maxSize);
+	char * destination = malloc(settings->maxSize);
+	char * workingSet  = malloc(settings->workingSet);
+	uint64_t * copySamples  = malloc(sizeof(uint64_t) * BENCH_COPY_ITERATIONS);
+	uint64_t * touchSamples = malloc(sizeof(uint64_t) * BENCH_COPY_ITERATIONS);
+	memset(source, 1, settings->maxSize);
+	memset(destination, 0, settings->maxSize);
+	memset(workingSet, 2, settings->workingSet);
+
+	const char * strategies[] = { "memcpy", "sse2", "avx2", "avx512" };
+	char workingSetText[32];
+	formatSize(workingSetText, settings->workingSet);
+	printf("copy test: streaming stores use %s, working set %s, times are medians\n", 
+		strategies[copyStrategy()], workingSetText);
+	printf("%-10s %10s %10s %12s %12s %12s %12s %8s\n", "test", "size", "iters",
+		"memcpy GB/s", "stream GB/s", "ws after mc", "ws after st", "faster");
+
+	for (size_t size = settings->minSize; size <= settings->maxSize; size *= 2) {
+		int64_t iterations = settings->targetBytes / size;
+		if (iterations > BENCH_COPY_ITERATIONS) {
+			iterations = BENCH_COPY_ITERATIONS;
+		}
+		if (iterations < 5) {
+			iterations = 5;
+		}
+
+		uint64_t memcpyTime, memcpyTouch, streamTime, streamTouch;
+		measureCopy(destination, source, size, workingSet, settings->workingSet, false, iterations,
+			copySamples, touchSamples, &memcpyTime, &memcpyTouch);
+		measureCopy(destination, source, size, workingSet, settings->workingSet, true, iterations,
+			copySamples, touchSamples, &streamTime, &streamTouch);
+
+		char sizeText[32];
+		formatSize(sizeText, size);
+
+		// Working set read times are shown in microseconds.
+		printf("%-10s %10s %10lld %12.3f %12.3f %12.1f %12.1f %8s\n", "copy", sizeText, 
+			(long long)iterations,
+			memcpyTime > 0 ? size / (double)memcpyTime : 0.0,
+			streamTime > 0 ? size / (double)streamTime : 0.0,
+			memcpyTouch / 1000.0, streamTouch / 1000.0,
+			streamTime + streamTouch < memcpyTime + memcpyTouch ? "stream" : "memcpy");
+		fflush(stdout);
+	}
+
+	printf("\n");
+
+	free(source);
+	free(destination);
+	free(workingSet);
+	free(copySamples);
+	free(touchSamples);
+}
+
+void runController(struct MPIController * instance, struct BenchSettings * settings) {
+	char * sendBuffer = malloc(settings->maxSize);
+	char * recvBuffer = malloc(settings->maxSize);
+	uint64_t * samples = malloc(sizeof(uint64_t) * settings->maxIterations);
+	memset(sendBuffer, 1, settings->maxSize);
+	memset(recvBuffer, 0, settings->maxSize);
+
+	printf("%-10s %10s %10s %12s %12s %12s %10s %14s\n", "test", "size", "iters",
+		"p50 (us)", "p99 (us)", "p99.9 (us)", "GB/s", "msgs/s");
+
+	for (size_t size = settings->minSize; size <= settings->maxSize; size *= 2) {
+		// In ring mode a message has to fit in the ring.
+		if (settings->channelMode == MSG_CHANNEL_RING && recordSize(size) > instance->ringCapacity) {
+			char sizeText[32];
+			formatSize(sizeText, size);
+			printf("%-10s %10s  skipped, larger than the ring\n", "-", sizeText);
+			continue;
+		}
+
+		int64_t iterations = settings->targetBytes / size;
+		if (iterations > settings->maxIterations) {
+			iterations = settings->maxIterations;
+		}
+		if (iterations < 10) {
+			iterations = 10;
+		}
+		if (iterations > settings->maxIterations) {
+			iterations = settings->maxIterations;
+		}
+
+		if (settings->runStream) {
+			benchStream(instance, settings, sendBuffer, size, iterations, samples);
+		}
+		if (settings->runPingPong) {
+			benchPingPong(instance, settings, sendBuffer, recvBuffer, size, iterations, samples);
+		}
+		if (settings->runBidir) {
+			benchBidir(instance, settings, sendBuffer, recvBuffer, size, iterations);
+		}
+	}
+
+	sendCommand(instance, BENCH_CMD_QUIT, 0, 0, false);
+
+	free(sendBuffer);
+	free(recvBuffer);
+	free(samples);
+}
+
+int parseWaitStrategy(const char * text) {
+	if (strcmp(text, "spin") == 0) {
+		return MSG_WAIT_SPIN;
+	} else if (strcmp(text, "spinblock") == 0) {
+		return MSG_WAIT_SPIN_THEN_BLOCK;
+	}
+	return MSG_WAIT_BLOCK;
+}
+
+const char * waitStrategyName(int strategy) {
+	if (strategy == MSG_WAIT_SPIN) {
+		return "spin";
+	} else if (strategy == MSG_WAIT_SPIN_THEN_BLOCK) {
+		return "spinblock";
+	}
+	return "block";
+}
+
+int main(int argc, char ** argv) {
+	struct BenchSettings settings;
+	snprintf(settings.name, sizeof(settings.name), "bench_%d", getpid());
+	settings.mpiArguments  = NULL;
+	settings.channelMode   = MSG_CHANNEL_RENDEZVOUS;
+	settings.ringCapacity  = 16 << 20;
+	settings.waitStrategy  = MSG_WAIT_BLOCK;
+	settings.minSize       = 8;
+	settings.maxSize       = 256 << 20;
+	settings.targetBytes   = 1ll << 30;
+	settings.maxIterations = 100000;
+	settings.zeroCopy      = false;
+	settings.runStream     = true;
+	settings.runPingPong   = true;
+	settings.runBidir      = true;
+	settings.runCopy       = true;
+	settings.copyThreshold = MSG_STREAMING_COPY_THRESHOLD;
+	settings.workingSet    = 1 << 20;
+
+	char * peerName = NULL;
+
+	for (int i = 1; i < argc; ++i) {
+		char * option = argv[i];
+		char * value  = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (strcmp(option, "-z") == 0) {
+			settings.zeroCopy = true;
+			continue;
+		}
+
+		if (value == NULL) {
+			printf("missing value for %s\n", option);
+			return 1;
+		}
+		++i;
+
+		if (strcmp(option, "--peer") == 0) {
+			peerName = value;
+		} else if (strcmp(option, "-c") == 0) {
+			settings.channelMode = strcmp(value, "ring") == 0 ? MSG_CHANNEL_RING : 
+				strcmp(value, "socket") == 0 ? MSG_CHANNEL_SOCKET : MSG_CHANNEL_RENDEZVOUS;
+		} else if (strcmp(option, "-r") == 0) {
+			settings.ringCapacity = parseSize(value);
+		} else if (strcmp(option, "-w") == 0) {
+			settings.waitStrategy = parseWaitStrategy(value);
+		} else if (strcmp(option, "-s") == 0) {
+			settings.minSize = parseSize(value);
+		} else if (strcmp(option, "-S") == 0) {
+			settings.maxSize = parseSize(value);
+		} else if (strcmp(option, "-b") == 0) {
+			settings.targetBytes = parseSize(value);
+		} else if (strcmp(option, "-n") == 0) {
+			settings.maxIterations = atoll(value);
+		} else if (strcmp(option, "-m") == 0) {
+			settings.mpiArguments = value;
+		} else if (strcmp(option, "-t") == 0) {
+			settings.runStream   = strstr(value, "stream") != NULL;
+			settings.runPingPong = strstr(value, "pingpong") != NULL;
+			settings.runBidir    = strstr(value, "bidir") != NULL;
+			settings.runCopy     = strstr(value, "copy") != NULL;
+		} else if (strcmp(option, "-T") == 0) {
+			settings.copyThreshold = strcmp(value, "off") == 0 ? 0 : parseSize(value);
+		} else if (strcmp(option, "-W") == 0) {
+			settings.workingSet = parseSize(value);
+		} else {
+			printf("unknown option %s\n", option);
+			return 1;
+		}
+	}
+
+	if (settings.minSize < 1) {
+		settings.minSize = 1;
+	}
+
+	// The socket is picked by the name, on a port of its own per run.
+	if (settings.channelMode == MSG_CHANNEL_SOCKET) {
+		snprintf(settings.name, sizeof(settings.name), "%s127.0.0.1:%d", 
+			MSG_SOCKET_PREFIX, 20000 + getpid() % 20000);
+	}
+
+	// Started by mpirun on behalf of a controller.
+	if (peerName != NULL) {
+		struct MPIController * instance = createChildInstance(peerName);
+		if (instance == NULL) {
+			return 1;
+		}
+		setWaitStrategy(instance, settings.waitStrategy, 0);
+		setCopyThreshold(instance, settings.copyThreshold);
+		runPeer(instance, settings.maxSize);
+		return 0;
+	}
+
+	if (settings.runCopy) {
+		benchCopy(&settings);
+	}
+
+	if (!settings.runStream && !settings.runPingPong && !settings.runBidir) {
+		return 0;
+	}
+
+	struct MPIControllerOptions options;
+	initControllerOptions(&options);
+	options.channelMode  = settings.channelMode;
+	options.ringCapacity = settings.ringCapacity;
+
+	printf("channel: %s, wait strategy: %s, peer: %s\n",
+		settings.channelMode == MSG_CHANNEL_RING ? "ring" : 
+			settings.channelMode == MSG_CHANNEL_SOCKET ? "socket" : "rendezvous",
+		waitStrategyName(settings.waitStrategy),
+		settings.mpiArguments != NULL ? "mpirun" : "fork");
+	fflush(stdout);
+
+	struct MPIController * instance;
+	pid_t peer = -1;
+
+	if (settings.mpiArguments != NULL) {
+		char arguments[1024];
+		snprintf(arguments, sizeof(arguments), "%s %s --peer %s -w %s -S %zu -T %zu",
+			settings.mpiArguments, argv[0], settings.name,
+			waitStrategyName(settings.waitStrategy), settings.maxSize, settings.copyThreshold);
+		instance = createControllerInstanceWithOptions(settings.name, arguments, &options);
+	} else {
+		peer = fork();
+
+		if (peer == 0) {
+			struct MPIController * child = createChildInstance(settings.name);
+			if (child == NULL) {
+				exit(1);
+			}
+			setWaitStrategy(child, settings.waitStrategy, 0);
+			setCopyThreshold(child, settings.copyThreshold);
+			runPeer(child, settings.maxSize);
+			exit(0);
+		}
+
+		instance = createControllerInstanceWithOptions(settings.name, NULL, &options);
+	}
+
+	if (instance == NULL) {
+		return 1;
+	}
+
+	setWaitStrategy(instance, settings.waitStrategy, 0);
+	setCopyThreshold(instance, settings.copyThreshold);
+	runController(instance, &settings);
+
+	if (peer > 0) {
+		waitpid(peer, NULL, 0);
+	}
+
+	destroyInstance(instance);
+	return 0;
+}
@@ -1,2 +1,6 @@
 gcc -o controller.o controller.c -lpthread -lrt
-mpicc -o primary_slave.o primary_slave.c -lpthread -lrt
\ No newline at end of file
+mpicc -o primary_slave.o primary_slave.c -lpthread -lrt
+gcc -O2 -o bench.o bench.c -lpthread -lrt
+gcc -o mpi_stats.o mpi_stats.c -lrt
+gcc -o mpi_pool.o mpi_pool.c -lpthread -lrt
+gcc -O2 -o mpi_replay.o mpi_replay.c -lrt
\ No newline at end of file
@@ -30,6 +30,11 @@
 int main(int argc, char ** argv) {
 	struct MPIController * inst = createControllerInstance("test_controller", "-n 4 ./primary_slave.o");
 
+	if (inst == NULL) {
+		printf("Failed to start the MPI world\n");
+		return 1;
+	}
+
 	printf("Controller Process Started\n");
 	printf("Beginning Benchmark\n");
 
@@ -37,17 +42,24 @@ int main(int argc, char ** argv) {
 	memset(message, 1, sizeof(char) * MSG_LENGTH);
 
 
-	time_t start = time(NULL);
+	// time() only has one second resolution, which made the numbers
+	// below meaningless for short runs.
+	struct timespec start;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	for (int i = 0; i < MSG_COUNT; ++i) {
 		sendMessage(inst, message, 0, sizeof(char) * MSG_LENGTH, MSG_TYPE_STRING);
 	}
-	time_t end = time(NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
 
 	printf("Summary:\n");
-	printf("\tSent %d messages of length %d in %ld seconds\n", MSG_COUNT, MSG_LENGTH, end - start);
-	printf("\tData transfer rate: %f Mb/Sec\n", ((MSG_COUNT * 2.0) / (float)(end - start)) / 1000.0);
-	printf("\tCall rate: %f calls/Sec\n", MSG_COUNT / (float)(end - start));
-	printf("\tCall Latency: %f ms\n", 1000.0 / (MSG_COUNT / (float)(end - start)));
+	printf("\tSent %d messages of length %d in %f seconds\n", MSG_COUNT, MSG_LENGTH, seconds);
+	printf("\tData transfer rate: %f MB/Sec\n", ((double)MSG_COUNT * MSG_LENGTH / seconds) / 1e6);
+	printf("\tCall rate: %f calls/Sec\n", MSG_COUNT / seconds);
+	printf("\tCall Latency: %f us\n", 1e6 * seconds / MSG_COUNT);
+	printf("\tSee bench.o for latency percentiles and a sweep over message sizes\n");
 	
 
 	sleep(5);
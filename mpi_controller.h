@@ -14,9 +14,13 @@
 // CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE 
 // OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
+// sched_setaffinity and the CPU_* macros are GNU extensions.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
-#include <semaphore.h>
 #include <malloc.h>
 #include <fcntl.h>
 #include <string.h>
@@ -26,49 +30,1007 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// The functions are defined here, so a C program includes this header
+// in one file only. In C++ they are inline and any number of files can
+// include it.
+#ifdef __cplusplus
+#define MSG_API inline
+#else
+#define MSG_API
+#endif
 
 #define MSG_TYPE_INT    1
 #define MSG_TYPE_FLOAT  2
 #define MSG_TYPE_DOUBLE 3
 #define MSG_TYPE_STRING 4
 
+// Reserved for internal use. Marks a rendezvous message that carries
+// several framed records sent with sendBatch.
+#define MSG_TYPE_BATCH -1
+
+// Reserved. Marks the message that announces a stream started with
+// sendStreamBegin. Its payload is a struct MPIStreamHeader.
+#define MSG_TYPE_STREAM -2
+
+// Reserved. Received by the child of a persistent world when its 
+// controller detaches (or exits without detaching). The message is
+// empty. The child should finish the session and call waitForController.
+#define MSG_TYPE_DETACH -3
+
+// Reserved. Marks a message whose payload is one or more struct 
+// MPIHandle that refer to ranges of shared arrays. See resolveHandle.
+#define MSG_TYPE_HANDLE -4
+
+// Reserved. Mark the calls and replies of the RPC layer (see callAsync).
+// Their payload starts with a struct MPICallHeader.
+#define MSG_TYPE_CALL  -5
+#define MSG_TYPE_REPLY -6
+
+// The message region is mapped once when an instance is created and
+// only grows (by doubling) when a message larger than the current
+// capacity is sent. This is the size it starts out with.
+#define MSG_INITIAL_CAPACITY 65536
+
+// Channel modes. In rendezvous mode (the default) every sendMessage
+// waits for the receiver to copy the message out before returning, so
+// exactly one message is in flight per instance. In ring mode each 
+// direction gets a single-producer/single-consumer ring buffer in
+// shared memory and senders only block when the ring is full. 
+// Instances named tcp://host:port use a socket instead (see 
+// isSocketName), whatever mode was asked for.
+#define MSG_CHANNEL_RENDEZVOUS 0
+#define MSG_CHANNEL_RING       1
+#define MSG_CHANNEL_SOCKET     2
+
+// Names that start with this are socket instances.
+#define MSG_SOCKET_PREFIX "tcp://"
+
+// Identifies the handshake of a socket instance and the version of
+// what is sent over the connection.
+#define MSG_SOCKET_MAGIC   0x4d505443
+#define MSG_SOCKET_VERSION 2
+
+// Flags the controller of a socket instance passes to the child.
+#define MSG_SOCKET_NO_DELAY 1 // TCP_NODELAY on both ends.
+#define MSG_SOCKET_COALESCE 2 // Hold small messages back and send them
+                              // together (see socketCoalesce).
+
+// Default size of the read-ahead buffer of a socket instance, and the
+// smallest buffer used without read-ahead.
+#define MSG_SOCKET_DEFAULT_RECEIVE_BUFFER (256 << 10)
+#define MSG_SOCKET_MIN_BUFFER             4096
+
+// Size of the buffer small messages are coalesced in. It is written out
+// once it is half full.
+#define MSG_SOCKET_COALESCE_BYTES (64 << 10)
+
+// Default largest message a socket instance accepts. A header that 
+// announces more is taken for a broken or hostile peer.
+#define MSG_SOCKET_DEFAULT_MAX_MESSAGE (1 << 30)
+
+// Default size of each of the two ring buffers used in ring mode.
+// A single message (plus a 16 byte header) has to fit in the ring.
+#define MSG_RING_DEFAULT_CAPACITY (1 << 20)
+
+// The ring indices are kept on separate cache lines so that the
+// producer and consumer aren't constantly stealing the line from
+// each other.
+#define MSG_CACHE_LINE 64
+
+// How a process waits for its peer. Every instance picks its own 
+// strategy with setWaitStrategy; the two sides don't need to agree.
+//     MSG_WAIT_BLOCK:           sleep in the kernel right away (default).
+//     MSG_WAIT_SPIN:            never sleep, busy wait with pause 
+//                               instructions. Only sensible when both
+//                               processes have a core to themselves.
+//     MSG_WAIT_SPIN_THEN_BLOCK: busy wait for a bounded number of 
+//                               iterations, then sleep.
+#define MSG_WAIT_BLOCK           0
+#define MSG_WAIT_SPIN            1
+#define MSG_WAIT_SPIN_THEN_BLOCK 2
+
+// Default shape of the window that streams are moved through. Each
+// direction's window is allocated the first time that direction sends
+// a stream, and is reused by every stream after that.
+#define MSG_STREAM_DEFAULT_SLOTS     4
+#define MSG_STREAM_DEFAULT_SLOT_SIZE (1 << 20)
+
+// Length of the slot that marks a stream the writer ended before
+// writing everything it announced (see sendStreamEnd).
+#define MSG_STREAM_ABORTED UINT64_MAX
+
+// How long createChildInstance waits for the controller to set up the
+// shared memory, in milliseconds.
+#define MSG_ATTACH_TIMEOUT_MS 10000
+
+// Results of waitForChild.
+#define MSG_ATTACH_OK      0  // The child has attached.
+#define MSG_ATTACH_TIMEOUT 1  // It hasn't yet; try again later.
+#define MSG_ATTACH_FAILED  -1 // mpirun exited before the child attached.
+
+// How often the child of a persistent world that is waiting for a
+// message checks whether its controller is still alive, in milliseconds.
+#define MSG_LIVENESS_INTERVAL_MS 100
+
+// How long a controller that detaches from a persistent world waits 
+// for the child to take the MSG_TYPE_DETACH message, in milliseconds.
+// Only the child watches whether its peer is alive, so a controller 
+// would wait forever for one that died mid-session.
+#define MSG_DETACH_TIMEOUT_MS 1000
+
+// How long acquirePooledInstance waits for the child of a world it has
+// claimed to start the session before trying the next world, in 
+// milliseconds. Keeps one stuck world from using up the whole timeout.
+#define MSG_POOL_ATTACH_TIMEOUT_MS 1000
+
+// Environment variables the pool manager (mpi_pool.c) sets for the 
+// worlds it starts. See createChildInstanceFromEnvironment.
+#define MSG_ENV_NAME       "MPI_CONTROLLER_NAME"
+#define MSG_ENV_PERSISTENT "MPI_CONTROLLER_PERSISTENT"
+
+// Identifies an initialized pool segment. See MSG_CONTROL_MAGIC.
+#define MSG_POOL_MAGIC   0x4d50504c
+#define MSG_POOL_VERSION 1
+
+// Longest mpirun command line createControllerInstanceAsync accepts,
+// and the most arguments it can be split into.
+#define MSG_MAX_ARGUMENTS_LENGTH 2048
+#define MSG_MAX_ARGUMENTS        256
+
+// Messages at least this large are copied into and out of shared 
+// memory with non-temporal (streaming) stores, which bypass the cache
+// of the copying process instead of evicting its working set with data
+// it won't touch again. Smaller ones are cheaper to copy with memcpy,
+// and are likely to still be in the cache when the peer reads them.
+// The copy alone usually breaks even around the size of the L2 cache,
+// but a peer that reads a streamed message gets it from memory, so 
+// the default is higher. See setCopyThreshold and bench.c's copy test.
+#define MSG_STREAMING_COPY_THRESHOLD (4 << 20)
+
+// How streamingCopy moves data, picked once from what the CPU supports.
+#define MSG_COPY_MEMCPY 0 // No streaming stores on this architecture.
+#define MSG_COPY_SSE2   1
+#define MSG_COPY_AVX2   2
+#define MSG_COPY_AVX512 3
+
+// Operations of reduceMessages.
+#define MSG_REDUCE_SUM  1
+#define MSG_REDUCE_MIN  2
+#define MSG_REDUCE_MAX  3
+#define MSG_REDUCE_MEAN 4 // The sum divided by the number of ranks.
+
+// Special values of struct MPIControllerOptions.numaNode. 
+#define MSG_NUMA_ANY   -1 // Leave placement to the kernel (default).
+#define MSG_NUMA_LOCAL -2 // The node the process that creates the 
+                          // shared memory runs on, after pinning it.
+
+// Bits of the placement field of the control block.
+#define MSG_PLACE_PIN_NODE   1 // Keep both processes on the node's CPUs.
+#define MSG_PLACE_PREFAULT   2 // Fault the shared memory in when it's mapped.
+#define MSG_PLACE_HUGE_PAGES 4 // Ask for transparent huge pages.
+
+// Size of a transparent huge page. Payload areas at least this large
+// are aligned to it when huge pages are asked for.
+#define MSG_HUGE_PAGE_SIZE (2 << 20)
+
+// Not every system has numaif.h, so the mbind constants are defined 
+// here. They're part of the kernel ABI.
+#define MSG_MPOL_BIND    2
+#define MSG_MPOL_MF_MOVE (1 << 1)
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+// Identifies a capture log (see startCapture) and the version of its
+// layout.
+#define MSG_CAPTURE_MAGIC   0x4d504350
+#define MSG_CAPTURE_VERSION 1
+
+// A capture log grows by at least this much at a time.
+#define MSG_CAPTURE_CHUNK (64 << 20)
+
+// Default number of spin iterations for MSG_WAIT_SPIN_THEN_BLOCK.
+#define MSG_DEFAULT_SPIN_COUNT 4000
+
+// Identifies an initialized result queue. See MSG_CONTROL_MAGIC.
+#define MSG_RESULTS_MAGIC   0x4d505251
+#define MSG_RESULTS_VERSION 1
+
+// Default shape of a result queue. A result has to fit in one slot.
+#define MSG_RESULTS_DEFAULT_SLOTS     256
+#define MSG_RESULTS_DEFAULT_SLOT_SIZE 4096
+
+// Identifies an initialized shared array. See MSG_CONTROL_MAGIC.
+#define MSG_ARRAY_MAGIC 0x4d504152
+
+// Number of separate dirty ranges a shared array keeps track of before
+// it starts merging them.
+#define MSG_ARRAY_DIRTY_RANGES 16
+
+// Default number of calls that are expected to be in flight at once.
+// See createRpc.
+#define MSG_RPC_DEFAULT_SLOTS 256
+
+// Statuses of calls the RPC layer answers itself. Handlers return any
+// other value they like.
+#define MSG_RPC_NO_HANDLER INT_MIN       // Nothing is registered for the code.
+#define MSG_RPC_LOST       (INT_MIN + 1) // The peer went away.
+
+// Number of buckets in each histogram of struct MPIDirectionStats. 
+// Bucket 0 counts zeros, bucket i counts values in [2^(i-1), 2^i) and
+// the last bucket also counts everything larger.
+#define MSG_STATS_BUCKETS 32
+
+// Identifies an initialized statistics segment. See MSG_CONTROL_MAGIC.
+#define MSG_STATS_MAGIC   0x4d505354
+#define MSG_STATS_VERSION 2
+
+// Index of each process in the statistics segment.
+#define MSG_STATS_CONTROLLER 0
+#define MSG_STATS_CHILD      1
+
+// A counting semaphore that lives in shared memory and is built on
+// a futex. Posting is a single atomic add, and only makes a system
+// call when somebody is actually asleep on it. Waiting can spin on
+// the count without entering the kernel at all. Each one gets its 
+// own cache line.
+struct MPISemaphore {
+	uint32_t count;   // Number of posts that haven't been waited for.
+	uint32_t waiters; // Number of processes asleep in the kernel.
+	char     pad[MSG_CACHE_LINE - 2 * sizeof(uint32_t)];
+};
+
+// Identifies a control segment that has been fully initialized by a
+// controller. The version is bumped whenever the layout of the control
+// segment changes, so that a child built against a different version
+// of this file refuses to attach instead of misreading it.
+#define MSG_CONTROL_MAGIC   0x4d504943
+#define MSG_CONTROL_VERSION 8
+
+// Number of slots of each priority lane, and the largest message that
+// fits in one (see sendPriorityMessage).
+#define MSG_PRIORITY_SLOTS        16
+#define MSG_PRIORITY_MESSAGE_SIZE 240
+
+// Maximum length of the names of the shared memory objects used by 
+// an instance, including the leading slash and the terminator.
+#define MSG_MAX_NAME 128
+
+// Index of each direction in the control block.
+#define MSG_TO_CHILD      0
+#define MSG_TO_CONTROLLER 1
+
+// Everything one direction of the channel needs. The two directions 
+// are completely independent, so the controller and the child can 
+// both be in the middle of sending a message at the same time.
+struct MPIDirection {
+	int32_t  code;            // User defined code of the message.
+	int32_t  length;          // Length of the message in bytes.
+	int32_t  type;            // One of the MSG_TYPE_* values.
+	uint32_t generation;      // Incremented every time the payload area
+	                          // is moved, so the receiver knows to remap.
+	uint64_t payloadOffset;   // Offset of this direction's payload area.
+	uint64_t payloadCapacity; // Current size of the payload area.
+	uint32_t armed;           // Set by a receiver that polls getMessageFd
+	                          // once it has run out of messages. The 
+	                          // sender clears it and writes to the FIFO.
+	char     pad[MSG_CACHE_LINE - 5 * sizeof(int32_t) - 2 * sizeof(uint64_t)];
+
+	struct MPISemaphore sent;     // Posted by the sender when a message
+	                              // is ready. In ring mode, counts the 
+	                              // records that are ready.
+	struct MPISemaphore received; // Posted by the receiver once it is 
+	                              // done with the message. In ring mode,
+	                              // posted when space is freed while the
+	                              // producer is waiting for some.
+
+	uint64_t streamOffset;     // Offset of the stream window, 0 until
+	                           // the first stream is sent.
+	uint32_t streamGeneration; // Incremented when the window is allocated.
+	char     streamPad[MSG_CACHE_LINE - sizeof(uint64_t) - sizeof(uint32_t)];
+
+	struct MPISemaphore streamFilled; // Counts window slots that are ready
+	                                  // to be read.
+	struct MPISemaphore streamEmpty;  // Counts window slots that are free
+	                                  // to be written.
+};
+
+// Payload of the MSG_TYPE_STREAM message that announces a stream.
+struct MPIStreamHeader {
+	uint64_t totalLength; // Number of bytes that will follow.
+	int32_t  type;        // Type passed to sendStreamBegin.
+	int32_t  pad;
+};
+
+// Every slot of a stream window starts with this header. The data
+// follows on the next cache line.
+struct MPIStreamSlot {
+	uint64_t length; // Number of bytes of data in the slot.
+	char     pad[MSG_CACHE_LINE - sizeof(uint64_t)];
+};
+
+// One slot of a priority lane. The slot is four cache lines long.
+struct MPIPrioritySlot {
+	int32_t code;
+	int32_t length;
+	int32_t type;
+	int32_t pad;
+	char    data[MSG_PRIORITY_MESSAGE_SIZE];
+};
+
+// A small ring of fixed size slots that carries priority messages in 
+// one direction, next to the payload area and the ring, which it never
+// waits for. head and tail count slots and only ever increase.
+struct MPIPriorityLane {
+	uint64_t head;            // Only written by the sender.
+	char     headPad[MSG_CACHE_LINE - sizeof(uint64_t)];
+
+	uint64_t tail;            // Only written by the receiver.
+	char     tailPad[MSG_CACHE_LINE - sizeof(uint64_t)];
+
+	struct MPISemaphore free; // Counts the slots that can be written.
+
+	struct MPIPrioritySlot slots[MSG_PRIORITY_SLOTS];
+};
+
+// Everything the two processes share lives in a single shared memory
+// object. It starts with this header, followed by the two rings in
+// ring mode. The payload area of each direction comes after that,
+// starting at controlSize (page aligned). When a payload area has to
+// grow, a new one is allocated at the end of the object and the old
+// one is released, so the header and the rings never move. Every 
+// field that is written by a different party than its neighbours is
+// on its own cache line.
+struct MPIControlBlock {
+	uint32_t magic;           // MSG_CONTROL_MAGIC once the controller
+	                          // has finished setting everything up.
+	uint32_t version;         // MSG_CONTROL_VERSION of the controller.
+	int32_t  channelMode;     // MSG_CHANNEL_RENDEZVOUS or MSG_CHANNEL_RING
+	uint32_t growLock;        // Held while a payload area is allocated.
+	uint64_t controlSize;     // Size of everything in front of the payload
+	                          // areas (the part that is mapped once).
+	uint64_t segmentSize;     // Current size of the whole object.
+	uint64_t ringOffset;      // Offset of the first ring in ring mode.
+	uint64_t ringCapacity;    // Size of each ring's data area.
+	uint32_t streamSlots;     // Number of slots in each stream window.
+	uint32_t streamSlotSize;  // Size of the data in each slot.
+	uint32_t statistics;      // Nonzero if the statistics segment exists.
+	char     pad[MSG_CACHE_LINE - 7 * sizeof(uint32_t) - 4 * sizeof(uint64_t)];
+
+	struct MPISemaphore childAttached; // Posted by the child once it has
+	                                   // mapped everything. In a persistent
+	                                   // world, posted once per session.
+
+	// Only used by persistent worlds, where the child owns the shared 
+	// memory and controllers come and go.
+	uint32_t persistent;      // Nonzero if the child created this.
+	int32_t  controllerPid;   // PID of the attached controller, 0 if none.
+	uint32_t sessionEpoch;    // Incremented by every controller that attaches.
+	uint32_t acceptedEpoch;   // Last epoch the child has set up a session for.
+	char     sessionPad[MSG_CACHE_LINE - 4 * sizeof(uint32_t)];
+
+	struct MPISemaphore controllerAttached; // Posted by a controller once it
+	                                        // has claimed the world.
+
+	// Where the processes run and the shared memory lives. Every 
+	// process that maps the shared memory places itself accordingly.
+	int32_t  numaNode;        // Node the shared memory is bound to, or
+	                          // MSG_NUMA_ANY.
+	int32_t  controllerCpu;   // CPU to pin the controller to, -1 for none.
+	int32_t  childCpu;        // CPU to pin the child to, -1 for none.
+	uint32_t placement;       // MSG_PLACE_* bits.
+	char     placementPad[MSG_CACHE_LINE - 4 * sizeof(uint32_t)];
+
+	struct MPIDirection direction[2];
+
+	struct MPIPriorityLane priority[2]; // Indexed like direction.
+};
+
+// Header of one direction of the ring channel. The ring's data area
+// immediately follows it. head and tail are byte counters that only
+// ever increase; the position in the data area is the counter modulo
+// the capacity (which is always a power of two).
+struct MPIRing {
+	uint64_t head;            // Only written by the producer.
+	char     headPad[MSG_CACHE_LINE - sizeof(uint64_t)];
+
+	uint64_t tail;            // Only written by the consumer.
+	char     tailPad[MSG_CACHE_LINE - sizeof(uint64_t)];
+
+	uint32_t producerWaiting; // Set by the producer right before it 
+	                          // blocks on a full ring. The consumer only
+	                          // posts the space semaphore when it's set.
+	char     waitPad[MSG_CACHE_LINE - sizeof(uint32_t)];
+};
+
+// What one process has seen of one direction of the channel. Only the
+// thread that sends (or receives) in that direction writes to it, so
+// nothing here is atomic; a reader in another process may see values
+// that are a moment out of date, which is fine for statistics.
+struct MPIDirectionStats {
+	uint64_t messages;        // Messages sent/received.
+	uint64_t bytes;           // Payload bytes, including stream data.
+	uint64_t copyNanoseconds; // Time spent copying payloads into or out
+	                          // of shared memory.
+	uint64_t waits;           // Number of times the peer had to be waited for.
+	uint64_t waitNanoseconds; // Total time spent waiting for the peer.
+	uint64_t remaps;          // Number of times a payload area or stream
+	                          // window was (re)mapped.
+	uint64_t queueDepth;      // Sender only: messages posted but not yet 
+	                          // picked up, as of the last send.
+	uint64_t maxQueueDepth;   // Largest queueDepth seen.
+	uint64_t sizeHistogram[MSG_STATS_BUCKETS]; // Message lengths in bytes.
+	uint64_t waitHistogram[MSG_STATS_BUCKETS]; // Wait times in nanoseconds.
+};
+
+// Statistics of one of the two processes.
+struct MPIProcessStats {
+	int32_t  pid;      // 0 until the process has attached.
+	uint32_t timing;   // Nonzero if the timers are being updated.
+	int32_t  cpu;      // CPU the process was on when it attached.
+	int32_t  node;     // NUMA node of that CPU.
+	int32_t  pinned;   // CPU it's pinned to, -1 if it isn't pinned to
+	                   // a single one.
+	int32_t  cpus;     // Number of CPUs it's allowed to run on.
+	char     pad[MSG_CACHE_LINE - 6 * sizeof(uint32_t)];
+
+	struct MPIDirectionStats send;
+	struct MPIDirectionStats recv;
+};
+
+// Layout of the statistics segment, /<name>_stats. It's kept apart from
+// the control segment so that a monitor can map it read-only without
+// being able to disturb the channel.
+struct MPIStatsBlock {
+	uint32_t magic;      // MSG_STATS_MAGIC once initialized.
+	uint32_t version;    // MSG_STATS_VERSION.
+	int32_t  memoryNode; // NUMA node the shared memory is bound to, -1
+	                     // if it isn't bound.
+	uint32_t placement;  // MSG_PLACE_* bits the instance was created with.
+	char     pad[MSG_CACHE_LINE - 4 * sizeof(uint32_t)];
+
+	struct MPIProcessStats process[2]; // Indexed by MSG_STATS_CONTROLLER
+	                                   // and MSG_STATS_CHILD.
+};
+
+// Every message in a ring, and every message in a batch, is framed by
+// this header. Records are padded to a multiple of its size so that 
+// headers never straddle the end of a ring's data area. A record that
+// doesn't fit before the end of the data area is preceded by a padding
+// record that fills the remaining space.
+struct MPIRecord {
+	int32_t code;
+	int32_t type;
+	int32_t length;
+	int32_t flags;  // MSG_RECORD_PADDING for padding records.
+};
+
+#define MSG_RECORD_PADDING 1
+
+// One message of a batch passed to sendBatch.
+struct MPIMessage {
+	int    code;
+	int    type;
+	int    length;
+	void * data;
+};
+
+// Options that can be passed to createControllerInstanceWithOptions.
+// Call initControllerOptions to fill in the defaults before changing
+// anything.
+struct MPIControllerOptions {
+	int    channelMode;    // MSG_CHANNEL_RENDEZVOUS or MSG_CHANNEL_RING
+	size_t ringCapacity;   // Size of each ring in bytes. Rounded up to 
+	                       // a power of two.
+	int    streamSlots;    // Number of slots in each stream window. At
+	                       // least two, so that copying in and copying 
+	                       // out can overlap.
+	size_t streamSlotSize; // Size of each slot in bytes. Rounded up to
+	                       // a multiple of MSG_CACHE_LINE.
+	int    statistics;     // Publish counters and timers in the stats
+	                       // segment (see mpi_stats.c). Costs two clock
+	                       // reads per copy and per blocking wait.
+	int    controllerCpu;  // Pin the controller to this CPU, -1 (the 
+	                       // default) to leave it alone.
+	int    childCpu;       // Pin the child (rank 0) to this CPU once it
+	                       // attaches, overriding mpirun's binding. -1 
+	                       // (the default) to leave it alone.
+	int    numaNode;       // Bind the shared memory to this NUMA node,
+	                       // MSG_NUMA_LOCAL for the node of the process 
+	                       // that creates it, MSG_NUMA_ANY (default) to
+	                       // leave placement to the kernel.
+	bool   pinToNode;      // Keep a process that isn't pinned to a CPU 
+	                       // on the CPUs of numaNode.
+	bool   prefault;       // Fault the shared memory in when it's 
+	                       // mapped instead of on first use.
+	bool   hugePages;      // Back large payload areas with transparent
+	                       // huge pages. Needs shmem_enabled set to
+	                       // advise (or always) in /sys/kernel/mm/
+	                       // transparent_hugepage.
+	const char * capture;  // Path of a log to capture the traffic of the
+	                       // process that creates the instance in (see 
+	                       // startCapture), NULL (the default) for none.
+	                       // Groups add a suffix for each rank but 0 
+	                       // (see getRankCapturePath).
+
+	// Only used by socket instances, for both ends of the connection.
+	bool   socketNoDelay;  // Turn off Nagle's algorithm, so that every
+	                       // message goes out right away (default).
+	bool   socketCoalesce; // Hold small messages back until 32KB have 
+	                       // piled up, the process receives or the 
+	                       // instance is destroyed, and send them with 
+	                       // one call. Trades latency for throughput. 
+	                       // Sending and receiving then have to happen 
+	                       // on the same thread.
+	size_t socketReceiveBuffer; // Read as much as fits into a buffer of 
+	                            // this size with every call, so that a 
+	                            // burst of small messages takes one 
+	                            // system call. 0 reads every message 
+	                            // with two calls instead.
+	size_t socketMaxMessage;    // Largest message either end sends or
+	                            // accepts, at most INT_MAX. The receive
+	                            // buffer grows to hold a whole message,
+	                            // so a peer that announces a larger one
+	                            // is dropped as lost instead.
+};
+
+MSG_API void initControllerOptions(struct MPIControllerOptions * options) {
+	options->channelMode    = MSG_CHANNEL_RENDEZVOUS;
+	options->ringCapacity   = MSG_RING_DEFAULT_CAPACITY;
+	options->streamSlots    = MSG_STREAM_DEFAULT_SLOTS;
+	options->streamSlotSize = MSG_STREAM_DEFAULT_SLOT_SIZE;
+	options->statistics     = true;
+	options->controllerCpu  = -1;
+	options->childCpu       = -1;
+	options->numaNode       = MSG_NUMA_ANY;
+	options->pinToNode      = false;
+	options->prefault       = false;
+	options->hugePages      = false;
+	options->capture        = NULL;
+	options->socketNoDelay  = true;
+	options->socketCoalesce = false;
+	options->socketReceiveBuffer = MSG_SOCKET_DEFAULT_RECEIVE_BUFFER;
+	options->socketMaxMessage    = MSG_SOCKET_DEFAULT_MAX_MESSAGE;
+}
+
+// A capture log starts with this header, followed by the records. The
+// header is kept up to date after every record, so the log of a 
+// process that crashed can still be read.
+struct MPICaptureHeader {
+	uint32_t magic;       // MSG_CAPTURE_MAGIC.
+	uint32_t version;     // MSG_CAPTURE_VERSION.
+	int32_t  channelMode; // Channel mode of the captured instance.
+	uint32_t controller;  // Nonzero if the controller captured it.
+	uint64_t records;     // Number of records in the log.
+	uint64_t length;      // Bytes of records after the header.
+	uint64_t realtime;    // CLOCK_REALTIME of the start, in nanoseconds.
+	char     pad[MSG_CACHE_LINE - 4 * sizeof(uint32_t) - 3 * sizeof(uint64_t)];
+};
+
+// Every message in a capture log. The payload follows, padded to a
+// multiple of eight bytes.
+struct MPICaptureRecord {
+	uint64_t timestamp; // Nanoseconds since the capture started.
+	int32_t  direction; // MSG_TO_CHILD or MSG_TO_CONTROLLER.
+	int32_t  code;
+	int32_t  type;
+	int32_t  length;
+};
+
+// A process's capture log, mapped into memory.
+struct MPICapture {
+	int      fd;
+	char *   data;  // Mapping of the whole file.
+	size_t   size;  // Size of the file and the mapping.
+	uint64_t start; // monotonicNanoseconds when the capture started.
+};
+
+// Every message sent over a socket starts with this, in network byte
+// order.
+struct MPISocketHeader {
+	uint32_t code;
+	uint32_t length;
+	uint32_t type;
+	uint32_t pad;
+};
+
+// Sent by the controller of a socket instance once the child has 
+// connected, and sent back by the child.
+struct MPISocketHello {
+	uint32_t magic;         // MSG_SOCKET_MAGIC.
+	uint32_t version;       // MSG_SOCKET_VERSION.
+	uint32_t flags;         // MSG_SOCKET_* flags.
+	uint32_t receiveBuffer; // socketReceiveBuffer of both ends.
+	uint32_t maxMessage;    // socketMaxMessage of both ends.
+	uint32_t pad;
+};
+
+// What a socket instance has instead of a control block.
+struct MPISocket {
+	int    fd;            // Connection to the peer, -1 until it's up.
+	int    listenFd;      // Controller only: listening socket, -1 once
+	                      // the child has connected.
+	uint32_t flags;       // Controller only: MSG_SOCKET_* flags and
+	size_t receiveBuffer; // read-ahead to pass on to the child.
+	size_t maxMessage;    // Largest message sent or accepted.
+
+	bool   coalesce;      // Small messages are collected in out.
+	char * out;
+	size_t outLength;
+	size_t outCapacity;
+
+	size_t readAhead;     // 0 to only read what the next message needs.
+	char * in;            // Received data. The message being viewed
+	size_t inCapacity;    // starts at inStart.
+	size_t inStart;
+	size_t inEnd;
+	size_t viewLength;    // Bytes the viewed message takes up in in.
+};
+
+// A process's mapping of the payload area of one direction.
+struct MPIPayloadMapping {
+	void *   data;       // NULL until the area is first mapped.
+	size_t   size;       // Size of the mapping.
+	uint32_t generation; // Generation of the mapping. When this differs
+	                     // from the direction's generation the sender 
+	                     // has moved the area and it has to be remapped.
+};
+
+// A process's side of a stream, in either direction.
+struct MPIStream {
+	bool     active;    // TRUE between the begin and end calls.
+	uint64_t remaining; // Bytes of the stream not written/read yet.
+	uint64_t slot;      // Number of slots used so far. The current slot
+	                    // of the window is this modulo the slot count.
+	size_t   position;  // Bytes written to/read from the current slot.
+	size_t   available; // Reader only: bytes in the current slot, 0 if
+	                    // no slot is currently held.
+	bool     aborted;   // Reader only: TRUE once the writer has ended 
+	                    // the stream short.
+	struct MPIPayloadMapping window; // Mapping of the window.
+};
+
 // Stores all state information for communication between
 // a controller process and an MPI world.
 struct MPIController {
 	char * system_name; // Stores a name, specified when initializing 
 	                    // an instance. Should be unique. Used as the
-	                    // prefix to the names of the four semaphores
+	                    // prefix to the name of the shared memory
 	                    // used for communication.
 
 	bool is_controller;   // TRUE when initialized as controller,
 	                      // FALSE when initialized as child.
 
-	sem_t * controllerSent; // Waited on by the child and triggered 
-	                        // by the controller when a message is sent.
-	sem_t * childReceived;  // Waited on by the controller after a 
-	                        // message is sent. The child will trigger
-	                        // this when it receives the message.
-	                        // This is used so that the controller can
-	                        // wait for proper message receipt before
-	                        // continuing execution.
-
-	sem_t * childSent;      // Waited on by the parent to receive messages
-	                        // from the child.
-	sem_t * controllerReceived; // Waited on by the child to ensure that
-	                            // messages are received by the parent 
-	                            // before execution continues.
+	char segmentName[MSG_MAX_NAME]; // Name of the shared memory object.
 
 	int fd;            // File descriptor attached to the shared memory
-	                   // that is used to pass message contents.
+	                   // that holds the control block and the message
+	                   // contents.
+
+	struct MPIControlBlock * control; // Mapping of everything in the shared
+	                                  // memory in front of the payload area.
+	size_t controlSize;               // Size of the mapping above.
+
+	int waitStrategy; // One of the MSG_WAIT_* values.
+	int spinCount;    // Spin iterations for MSG_WAIT_SPIN_THEN_BLOCK.
+	size_t copyThreshold; // Smallest payload copied with streaming 
+	                      // stores, 0 to never use them.
+
+	struct MPIDirection * sendDirection; // State of messages this process sends.
+	struct MPIDirection * recvDirection; // State of messages this process receives.
+	struct MPIPriorityLane * sendLane;    // Priority lane of each of the two
+	struct MPIPriorityLane * recvLane;    // directions.
+
+	struct MPIPayloadMapping sendMapping; // This process's mapping of the payload
+	struct MPIPayloadMapping recvMapping; // area of each direction.
+
+	int channelMode;        // Copied from the control block.
+	size_t ringCapacity;    // Size of each ring's data area.
+	struct MPIRing * sendRing; // The ring this process produces into.
+	struct MPIRing * recvRing; // The ring this process consumes from.
+	uint64_t sendHead;         // Where the next record goes in sendRing.
+	                           // Runs ahead of sendRing->head while a 
+	                           // batch is being written.
+	int unpublished;           // Records written since sendRing->head 
+	                           // was last published.
+
+	bool sendPending;     // TRUE between acquireSendBuffer and commitSend.
+	bool deliveryPending; // Rendezvous mode: TRUE between postSend and 
+	                      // finishSend.
+	int sendLength;       // Length passed to acquireSendBuffer.
+
+	bool viewPending;     // TRUE between recvMessageView and releaseMessage.
+	bool viewPriority;    // TRUE if the message being viewed came from the
+	                      // priority lane.
+	bool viewHeld;        // TRUE if the message being viewed was put back
+	                      // with holdMessage. The next receive hands it
+	                      // out again, as held below.
+	const void * heldView;
+	int heldCode;
+	int heldLength;
+	int heldType;
+	uint64_t viewRelease; // Ring tail to publish when the view is released.
+
+	struct MPIStream sendStream; // State of the stream being sent, if any.
+	struct MPIStream recvStream; // State of the stream being read, if any.
+
+	int batchRemaining;   // Records of a received batch that haven't been
+	                      // handed out yet (rendezvous mode only).
+	size_t batchOffset;   // Offset of the next one in the payload area.
 
-	int * messageCode; // Stores the number used to identify the type
-	                   // of message being sent. Meaning is used defined.
+	char statsName[MSG_MAX_NAME]; // Name of the statistics segment.
+	struct MPIStatsBlock * statsBlock; // Mapping of the statistics segment,
+	                                   // or private memory when statistics
+	                                   // are turned off.
+	struct MPIProcessStats * stats;    // This process's part of it.
+	bool timing;                       // TRUE if copies and waits are timed.
 
-	int * messageSize; // This is populated with the size of the message 
-	                   // everytime a message is passed.
-	int * messageType; // This is populated with the message type every
-	                   // time a message is passed. See the #define 
-	                   // statements at the top of the file.
+	pid_t childPid;     // Controller only: PID of mpirun, -1 if this 
+	                    // instance didn't start anything or it has been
+	                    // reaped.
+	int childStatus;    // Exit status of mpirun once it has been reaped.
+	bool childAttached; // Controller only: TRUE once the child has attached.
+
+	bool persistent;       // TRUE if this instance belongs to a persistent
+	                       // world, on either side.
+	uint32_t sessionEpoch; // Epoch of the current session in a persistent
+	                       // world.
+	bool viewLost;         // TRUE while the message handed out by 
+	                       // recvMessageView is a made up MSG_TYPE_DETACH
+	                       // for a controller that exited.
+	bool peerLost;         // Child of a persistent world: TRUE once the
+	                       // controller of the session has exited.
+	char nameStorage[MSG_MAX_NAME]; // Copy of the name the instance was
+	                                // created with. system_name points here.
+
+	struct MPISocket * socket;   // Connection of a socket instance, NULL
+	                             // for one that uses shared memory.
+	const struct MPITransport * transport; // Backend the instance uses.
+
+	struct MPICapture * capture; // Log of the traffic of this process,
+	                             // NULL unless startCapture was called.
+	void * sendBuffer;           // Buffer returned by acquireSendBuffer.
+
+	int messageFd; // Read end of the FIFO returned by getMessageFd, -1
+	               // until it is first called.
+	int notifyFd;  // Write end of the peer's FIFO, -1 until the peer
+	               // first needs to be woken up through it.
+};
+
+// The operations that differ between shared memory and sockets. Every
+// instance points at the table of the backend it uses, and the public
+// calls below do what the two have in common and leave the rest to it.
+struct MPITransport {
+	// Returns room for a message of length bytes; see acquireSendBuffer.
+	void * (*acquire)(struct MPIController * instance, int length);
+	// Hands over the message in instance->sendBuffer; see postSend.
+	void (*post)(struct MPIController * instance, int code, int type);
+	bool (*canSend)(struct MPIController * instance, int length);
+	void (*sendv)(struct MPIController * instance, const struct iovec * iov, int iovcnt, int code, int type);
+	void (*sendBatch)(struct MPIController * instance, struct MPIMessage * messages, int count);
+	// Returns a view of the next message, or NULL after timeout 
+	// nanoseconds (-1 waits for good).
+	const void * (*recvView)(struct MPIController * instance, int * code, int * length, int * type, 
+		int64_t timeout);
+	void (*release)(struct MPIController * instance);
+	int (*messageFd)(struct MPIController * instance);
+	// Controller only: waits up to timeout nanoseconds for the child.
+	// Whatever follows its arrival has to be done by deadline, the 
+	// monotonicNanoseconds the caller gives up at (UINT64_MAX if never).
+	bool (*acceptChild)(struct MPIController * instance, uint64_t timeout, uint64_t deadline);
+	// Removes what the instance owns and closes it. The instance itself 
+	// is freed by the caller.
+	void (*destroy)(struct MPIController * instance);
+	// Closes the instance without removing anything.
+	void (*close)(struct MPIController * instance);
+	bool sharedMemory; // FALSE if the priority lane and streams, which 
+	                   // live in shared memory, aren't available.
+};
+
+// Channels to several ranks of the same world, created by 
+// createControllerGroup. Each rank has an ordinary instance of its own.
+struct MPIControllerGroup {
+	int size;                       // Number of ranks with a channel.
+	struct MPIController ** ranks;  // Instance of each rank. The instance
+	                                // of rank 0 started mpirun.
+};
+
+// Layout of a result queue, /<name>_results, that any number of 
+// processes send results to and the controller receives them from. 
+// It's an array of fixed size slots, each starting with a struct 
+// MPIResultSlot. A producer reserves a slot by advancing 
+// enqueuePosition with compare-and-swap and commits it by setting the
+// slot's sequence, so producers never wait for each other.
+struct MPIResultQueueBlock {
+	uint32_t magic;    // MSG_RESULTS_MAGIC once initialized.
+	uint32_t version;  // MSG_RESULTS_VERSION.
+	uint32_t slots;    // Number of slots, always a power of two.
+	uint32_t slotSize; // Size of each slot's data.
+	char     pad[MSG_CACHE_LINE - 4 * sizeof(uint32_t)];
+
+	uint64_t enqueuePosition;  // Next slot a producer will reserve.
+	char     enqueuePad[MSG_CACHE_LINE - sizeof(uint64_t)];
+
+	uint64_t dequeuePosition;  // Next slot the controller will receive.
+	                           // Only written by the controller.
+	char     dequeuePad[MSG_CACHE_LINE - sizeof(uint64_t)];
+
+	uint32_t producersWaiting; // Number of producers waiting for a free
+	                           // slot. Space is only posted when nonzero.
+	char     waitPad[MSG_CACHE_LINE - sizeof(uint32_t)];
+
+	struct MPISemaphore ready; // Counts committed slots.
+	struct MPISemaphore space; // Posted when slots are freed while 
+	                           // producers are waiting for one.
+};
+
+// Header of every slot of a result queue. The data follows on the next
+// cache line. A slot at position p is free when sequence is p and 
+// holds a result when it is p + 1.
+struct MPIResultSlot {
+	uint64_t sequence;
+	int32_t  rank;   // Rank that sent the result.
+	int32_t  code;
+	int32_t  type;
+	int32_t  length;
+	char     pad[MSG_CACHE_LINE - sizeof(uint64_t) - 4 * sizeof(int32_t)];
+};
+
+// A result received with drainResults.
+struct MPIResult {
+	int          rank;
+	int          code;
+	int          type;
+	int          length;
+	const void * data; // Points into the queue until releaseResults.
+};
+
+// One process's handle on a result queue.
+struct MPIResultQueue {
+	char   segmentName[MSG_MAX_NAME];
+	bool   owner;   // TRUE for the controller that created it.
+	size_t size;    // Size of the mapping.
+	int    pending; // Results returned by drainResults but not released.
+
+	struct MPIResultQueueBlock * block;
+	char *                       slots;
+	size_t                       stride; // Distance between two slots.
+};
+
+// Every shared array, /<registry>_array_<id>, starts with this header.
+// The data follows on the next cache line.
+struct MPISharedArrayBlock {
+	uint32_t magic;    // MSG_ARRAY_MAGIC once initialized.
+	uint32_t refcount; // Number of processes that have it mapped. The
+	                   // last one to release it removes it.
+	uint64_t length;   // Size of the data.
+	uint64_t version;  // Incremented every time a handle to it is sent.
+	                   // Starts at the time the array is created, so
+	                   // that it keeps growing when an array is 
+	                   // created again with the same id.
+	char     pad[MSG_CACHE_LINE - 2 * sizeof(uint32_t) - 2 * sizeof(uint64_t)];
+};
+
+// Payload of a MSG_TYPE_HANDLE message. Refers to length bytes of a
+// shared array, starting at offset, as of the given version.
+struct MPIHandle {
+	uint32_t id;
+	uint32_t pad;
+	uint64_t offset;
+	uint64_t length;
+	uint64_t version;
+};
+
+// A byte range of a shared array that has changed since its last send.
+struct MPIDirtyRange {
+	uint64_t offset;
+	uint64_t length;
+};
+
+// One process's mapping of a shared array.
+struct MPISharedArray {
+	uint32_t id;
+	size_t   length;
+	void *   data;  // Points into the mapping, right after the header.
+
+	struct MPISharedArrayBlock * block;
+	struct MPISharedArray *      next; // Next array of the registry.
+
+	int                  dirtyCount; // Ranges marked since the last send.
+	struct MPIDirtyRange dirty[MSG_ARRAY_DIRTY_RANGES];
+};
+
+// The shared arrays one process has mapped, found by id. Processes 
+// that open a registry with the same name share its arrays.
+struct MPIArrayRegistry {
+	char                    name[MSG_MAX_NAME];
+	struct MPISharedArray * arrays;
+};
+
+// Every call and reply starts with this header. The arguments (or the
+// result) follow it.
+struct MPICallHeader {
+	uint64_t id;     // Ticket of the call, copied into the reply.
+	int32_t  type;   // Type of the arguments or the result.
+	int32_t  status; // Replies only: what the handler returned.
+};
+
+// What a handler answers with. data must stay valid after the handler
+// returns, until the next call is served.
+struct MPIReply {
+	const void * data;
+	int          length;
+	int          type;
+};
+
+// Serves the calls with the code it was registered for. args points 
+// into shared memory and is only valid until the handler returns. The
+// return value is handed to the caller as the status of the call.
+typedef int (*MPICallHandler)(void * context, const void * args, int length, int type, 
+	struct MPIReply * reply);
+
+// A call made with callAsync, from the time it is sent until its 
+// result has been collected.
+struct MPICall {
+	uint64_t id;     // Ticket of the call, 0 if the slot is free.
+	bool     done;   // TRUE once the reply has arrived.
+	int      status;
+	int      length;
+	int      type;
+	void *   data;   // Copy of the reply.
+};
+
+struct MPICallRegistration {
+	int            code;
+	MPICallHandler handler;
+	void *         context;
+};
+
+// The RPC layer of one side of an instance. One side makes calls and
+// the other serves them.
+struct MPIRpc {
+	struct MPIController * instance;
+
+	uint64_t         nextId;   // Ticket of the next call.
+	int              slots;    // Size of calls, a power of two.
+	struct MPICall * calls;    // Calls whose results haven't been 
+	                           // collected, at id & (slots - 1).
+
+	int                          handlerCount;
+	struct MPICallRegistration * handlers;
+	bool                         detached; // Server only: TRUE once a 
+	                                       // MSG_TYPE_DETACH arrived.
+};
+
+// A pool of persistent worlds kept running by mpi_pool.c. Lives in 
+// /<pool>_pool. The worlds are named <pool>_0 to <pool>_<worlds - 1>.
+struct MPIPoolBlock {
+	uint32_t magic;      // MSG_POOL_MAGIC once initialized.
+	uint32_t version;    // MSG_POOL_VERSION.
+	uint32_t worlds;     // Number of worlds in the pool.
+	int32_t  managerPid; // PID of the pool manager.
 };
 
 // This function allocates shared memory of the specified
@@ -76,7 +1038,7 @@ struct MPIController {
 // needs to be called in other processes using the same name
 // to get access to the shared memory, a name paramter must 
 // be passed.
-void * mallocShared(size_t size, char * name) {
+MSG_API void * mallocShared(size_t size, char * name) {
 	// readable and writeable.
 	int protection = PROT_READ | PROT_WRITE;
 
@@ -118,408 +1080,5451 @@ void * mallocShared(size_t size, char * name) {
 	return result;
 }
 
-// Used to reallocate memory associated with the file
-// descriptor that is assigned to the instance. This
-// memory is used for passing messages between the 
-// controller and the child.
-void * reallocShared(size_t size, int fd) {
+// Tells the CPU that we're in a spin loop. Keeps a spinning process
+// from hogging the resources of a hyperthreaded sibling and from 
+// being penalized for a memory order violation when the loop exits.
+MSG_API void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
 
-	// Resize the fd
-	if (ftruncate(fd, size) == -1) {
-		printf("ftruncate failed\n");
-	}
+// Returns the MSG_COPY_* value streamingCopy uses on this CPU.
+MSG_API int copyStrategy() {
+#if defined(__x86_64__) || defined(__i386__)
+	static int strategy = -1;
 
-	// readable and writeable.
-	int protection = PROT_READ | PROT_WRITE;
+	if (strategy == -1) {
+		__builtin_cpu_init();
 
-	int visibility = MAP_SHARED;
+		if (__builtin_cpu_supports("avx512f")) {
+			strategy = MSG_COPY_AVX512;
+		} else if (__builtin_cpu_supports("avx2")) {
+			strategy = MSG_COPY_AVX2;
+		} else {
+			strategy = MSG_COPY_SSE2;
+		}
+	}
 
-	// reallocate the shared memory
-	void * result = mmap(NULL, size, protection, visibility, fd, 0);
+	return strategy;
+#else
+	return MSG_COPY_MEMCPY;
+#endif
+}
 
-	if (result == (void *)-1) {
-		printf("mmap failed\n");
-		printf("errno: %d\n", errno);
+#if defined(__x86_64__) || defined(__i386__)
+// The loops below copy whole cache lines to a destination aligned to
+// a cache line; streamingCopy takes care of the rest. Each is compiled
+// for its own instruction set so that nothing else needs to be.
+
+__attribute__((target("sse2")))
+MSG_API void streamLinesSSE2(char * destination, const char * source, size_t lines) {
+	for (size_t i = 0; i < lines; ++i, destination += 64, source += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)source);
+		__m128i b = _mm_loadu_si128((const __m128i *)(source + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(source + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *)(source + 48));
+		_mm_stream_si128((__m128i *)destination, a);
+		_mm_stream_si128((__m128i *)(destination + 16), b);
+		_mm_stream_si128((__m128i *)(destination + 32), c);
+		_mm_stream_si128((__m128i *)(destination + 48), d);
 	}
+}
 
-	return result;
+__attribute__((target("avx2")))
+MSG_API void streamLinesAVX2(char * destination, const char * source, size_t lines) {
+	for (size_t i = 0; i < lines; ++i, destination += 64, source += 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)source);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(source + 32));
+		_mm256_stream_si256((__m256i *)destination, a);
+		_mm256_stream_si256((__m256i *)(destination + 32), b);
+	}
 }
 
-// Constructs the name that should be used to identify
-// the file descriptor for the shared memory used as
-// a location for addresses being passed between 
-// processes.
-// YES, I know the name of this function is confusing.
-char * getMessageFDNameLocationFDName(char * base) {
-	char * addrFDName = malloc(sizeof(char) * 128);
-	memset(addrFDName, 0, sizeof(char) * 128);
-	strcat(addrFDName, "/");
-	strcat(addrFDName, base);
-	strcat(addrFDName, "_fd_message_fd_name");
-	return addrFDName;
-}
-
-// Constructs the name that should be used to identify
-// the file descriptor for the shared memory used as
-// a location for message size indicators being passed
-// between processes.
-char * getMessageSizeFDName(char * base) {
-	char * sizeFDName = malloc(sizeof(char) * 128);
-	memset(sizeFDName, 0, sizeof(char) * 128);
-	strcat(sizeFDName, "/");
-	strcat(sizeFDName, base);
-	strcat(sizeFDName, "_fd_message_size");
-	return sizeFDName;
-}
-
-// Constructs the name that should be used to identify
-// the file descriptor for the shared memory used as
-// a location for message code indicators being passed
-// between processes.
-char * getMessageCodeFDName(char * base) {
-	char * sizeFDName = malloc(sizeof(char) * 128);
-	memset(sizeFDName, 0, sizeof(char) * 128);
-	strcat(sizeFDName, "/");
-	strcat(sizeFDName, base);
-	strcat(sizeFDName, "_fd_message_code");
-	return sizeFDName;
-}
-
-// Constructs the name that should be used to identify
-// the file descriptor for the shared memory used as
-// a location for message type indicators being passed
-// between processes.
-char * getMessageTypeFDName(char * base) {
-	char * typeFDName = malloc(sizeof(char) * 128);
-	memset(typeFDName, 0, sizeof(char) * 128);
-	strcat(typeFDName, "/");
-	strcat(typeFDName, base);
-	strcat(typeFDName, "_fd_message_type");
-	return typeFDName;
+__attribute__((target("avx512f")))
+MSG_API void streamLinesAVX512(char * destination, const char * source, size_t lines) {
+	for (size_t i = 0; i < lines; ++i, destination += 64, source += 64) {
+		_mm512_stream_si512((__m512i *)destination, _mm512_loadu_si512((const void *)source));
+	}
 }
+#endif
 
-// ----------------------------------------------
-// Initialization functions
-// ----------------------------------------------
-// These two functions need to be called in the 
-// controller application and the Rank0 thread
-// of the MPI world.
-// CreateControllerInstance will call MPIEXEC with 
-// specified arguments. At this point
-// the Rank0 process should call createChildInstance.
-// Once called, it will be able to access
-// the shared memory for communication and the
-// semphores for synchronization. 
+// Same as memcpy, but writes the destination with non-temporal stores 
+// so that it doesn't end up in the cache. Only worth it for large 
+// copies whose destination isn't read again soon by this process.
+MSG_API void streamingCopy(void * destination, const void * source, size_t length) {
+	int strategy = copyStrategy();
 
+	if (strategy == MSG_COPY_MEMCPY || length < 2 * MSG_CACHE_LINE) {
+		memcpy(destination, source, length);
+		return;
+	}
 
-// Called in the controlling program (the one not started with MPIEXEC).
-// Will start an MPI world as a child process using MPIEXEC. Will then
-// wait for the child process to call createChildInstance with 
-// the same name argument. CreateChildInstance will trigger the
-// childReceived semaphore and the controller instance will 
-// know that the child has started.
-// 
-// parameters:
-//     - name: user defined unique string
-//             must be the same in both the controller and child processes
-//
-//     - MPIArguments: arguments to pass to MPIEXEC
-struct MPIController * createControllerInstance(char * name, char * MPIArguments) {
-	// We need to do the following:
-	//     1) create and instance of MPIController
-	//     2) initialize the named semaphores
-	//     3) create the shared memory
-	//     4) call MPIEXEC
-	//     5) wait for the child process to start up 
-	//        and trigger its own semaphore
-
-	
-	struct MPIController * instance = malloc(sizeof(struct MPIController));
-
-
-	
-	instance->is_controller = true;
-	instance->system_name   = name;
-
-	// initialize the semaphores
-	
-	char * conSentName = malloc(sizeof(char) * 128);
-	memset(conSentName, 0, sizeof(char) * 128);
-	strcat(conSentName, "/");
-	strcat(conSentName, name);
-	strcat(conSentName, "_con_sent");
-
-	instance->controllerSent = sem_open(conSentName, O_CREAT, S_IRWXU | S_IRWXG | S_IRWXO, 0); 
-	
-
-	char * childRecvName = malloc(sizeof(char) * 128);
-	memset(childRecvName, 0, sizeof(char) * 128);
-	strcat(childRecvName, "/");
-	strcat(childRecvName, name);
-	strcat(childRecvName, "_child_recv");
-	instance->childReceived = sem_open(childRecvName, O_CREAT, S_IRWXU | S_IRWXG | S_IRWXO, 0);
-	
-
-	char * childSentName = malloc(sizeof(char) * 128);
-	memset(childSentName, 0, sizeof(char) * 128);
-	strcat(childSentName, "/");
-	strcat(childSentName, name);
-	strcat(childSentName, "_child_sent");
-	instance->childSent = sem_open(childSentName, O_CREAT, S_IRWXU | S_IRWXG | S_IRWXO, 0);
-
-	char * conRecvName = malloc(sizeof(char) * 128);
-	memset(conRecvName, 0, sizeof(char) * 128);
-	strcat(conRecvName, "/");
-	strcat(conRecvName, name);
-	strcat(conRecvName, "_con_recv");
-	instance->controllerReceived = sem_open(conRecvName, O_CREAT, S_IRWXU | S_IRWXG | S_IRWXO, 0);
-
-	// Now that the instance members are initialized, we need 
-	// to allocate the shared memory used to pass parameters 
-	// between the processes.
-
-
-	char * msgFDName = getMessageFDNameLocationFDName(name);
-	instance->fd = shm_open(msgFDName, O_RDWR | O_CREAT, 0777);
-	free(msgFDName);
-
-	char * msgCodeFD = getMessageCodeFDName(name);
-	instance->messageCode = mallocShared(sizeof(int), msgCodeFD);
-	free(msgCodeFD);
-
-	char * msgSizeFD = getMessageSizeFDName(name);
-	instance->messageSize = mallocShared(sizeof(int), msgSizeFD);
-	free(msgSizeFD);
-
-	char * msgTypeFD = getMessageTypeFDName(name);
-	instance->messageType = mallocShared(sizeof(int), msgTypeFD);
-	free(msgTypeFD);
+#if defined(__x86_64__) || defined(__i386__)
+	char * to         = (char *)destination;
+	const char * from = (const char *)source;
 
-	// now that everything is in place, we can call MPIEXEC.
+	// Streaming stores are only efficient on whole, aligned lines.
+	size_t head = (MSG_CACHE_LINE - ((uintptr_t)to & (MSG_CACHE_LINE - 1))) & (MSG_CACHE_LINE - 1);
+	memcpy(to, from, head);
+	to     += head;
+	from   += head;
+	length -= head;
 
-	// we need to construct the argument string for MPIEXEC.
+	size_t lines = length / MSG_CACHE_LINE;
 
-	char * argString = malloc(sizeof(char) * 2048);
-	memset(argString, 0, sizeof(char) * 2048);
-	strcat(argString, "mpirun ");
-	strcat(argString, MPIArguments);
-	strcat(argString, " &"); // Necessary for it to run asynchronously.
+	if (strategy == MSG_COPY_AVX512) {
+		streamLinesAVX512(to, from, lines);
+	} else if (strategy == MSG_COPY_AVX2) {
+		streamLinesAVX2(to, from, lines);
+	} else {
+		streamLinesSSE2(to, from, lines);
+	}
 
-	// Start the MPI child processes.
-	system(argString);
+	to     += lines * MSG_CACHE_LINE;
+	from   += lines * MSG_CACHE_LINE;
+	memcpy(to, from, length - lines * MSG_CACHE_LINE);
 
-	// Now we wait on the instance->childReceived member,
-	// which will be set by the child process once it 
-	// starts up.
+	// Streaming stores aren't ordered with the stores that publish the
+	// message; make sure the peer sees the data first.
+	_mm_sfence();
+#endif
+}
 
-	sem_wait(instance->childReceived);
+// TRUE if a payload of the given total length should be copied with
+// streamingCopy.
+MSG_API bool useStreamingCopy(struct MPIController * instance, size_t length) {
+	return instance->copyThreshold != 0 && length >= instance->copyThreshold;
+}
 
-	// If we get to here, the child process has started.
-	// Time to return the instance.
-	return instance;
+// Copies a payload into or out of shared memory, picking the copy that
+// suits its length.
+MSG_API void copyPayload(struct MPIController * instance, void * destination, const void * source, size_t length) {
+	if (useStreamingCopy(instance, length)) {
+		streamingCopy(destination, source, length);
+	} else {
+		memcpy(destination, source, length);
+	}
 }
 
-// Called by the Rank0 process of the MPI world initiated by createControllerInstance.
-//
-// parameters:
-//     - name: user defined unique string
-//             must be the same in both the controller and child processes
-//
-struct MPIController * createChildInstance(char * name) {
-	// We need to do the following:
-	//     1) create and instance of MPIController
-	//     2) get copies of the semaphores from the system
-	//        they should have already been initialized by the
-	//        controller
-	//     3) get a pointer to each chunk of shared memory
-	//     4) trigger the instance->childReceived semaphore
-	//        to inform the controller that the system has
-	//        initialized 
+// Sets the smallest payload this process copies with streaming stores
+// (MSG_STREAMING_COPY_THRESHOLD by default). 0 always uses memcpy. 
+// Lower it when large messages are bulk data, like checkpoints, that
+// the process doesn't need in its cache; raise it when the receiver 
+// works on each message right away.
+MSG_API void setCopyThreshold(struct MPIController * instance, size_t threshold) {
+	instance->copyThreshold = threshold;
+}
 
+// Thin wrapper around the futex system call. The futexes used here 
+// live in memory shared between processes, so they can't use the
+// FUTEX_PRIVATE_FLAG variants. timeout is relative and may be NULL.
+MSG_API long futex(uint32_t * address, int operation, uint32_t value, const struct timespec * timeout) {
+	return syscall(SYS_futex, address, operation, value, timeout, NULL, 0);
+}
 
-	struct MPIController * instance = malloc(sizeof(struct MPIController));
+// Current time in nanoseconds.
+MSG_API uint64_t monotonicNanoseconds() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
 
-	instance->is_controller = false;
-	instance->system_name   = name;
+// Takes one post from the semaphore if there is one. Never blocks.
+MSG_API bool tryWaitSemaphore(struct MPISemaphore * semaphore) {
+	uint32_t count = __atomic_load_n(&semaphore->count, __ATOMIC_RELAXED);
 
-	// initialize the semaphores
+	while (count > 0) {
+		if (__atomic_compare_exchange_n(&semaphore->count, &count, count - 1, 
+			true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			return true;
+		}
+	}
 
-	char * conSentName = malloc(sizeof(char) * 128);
-	memset(conSentName, 0, sizeof(char) * 128);
-	strcat(conSentName, "/");
-	strcat(conSentName, name);
-	strcat(conSentName, "_con_sent");
+	return false;
+}
 
-	instance->controllerSent = sem_open(conSentName, 0); 
+// Makes count posts at once, with at most one wake up.
+MSG_API void postSemaphoreCount(struct MPISemaphore * semaphore, uint32_t count) {
+	__atomic_fetch_add(&semaphore->count, count, __ATOMIC_SEQ_CST);
 
-	char * childRecvName = malloc(sizeof(char) * 128);
-	memset(childRecvName, 0, sizeof(char) * 128);
-	strcat(childRecvName, "/");
-	strcat(childRecvName, name);
-	strcat(childRecvName, "_child_recv");
-	instance->childReceived = sem_open(childRecvName, 0);
+	// A waiter registers itself before it checks the count one last 
+	// time and goes to sleep, so if it isn't registered yet it will 
+	// see the post we just made.
+	if (__atomic_load_n(&semaphore->waiters, __ATOMIC_SEQ_CST) > 0) {
+		futex(&semaphore->count, FUTEX_WAKE, INT_MAX, NULL);
+	}
+}
 
-	char * childSentName = malloc(sizeof(char) * 128);
-	memset(childSentName, 0, sizeof(char) * 128);
-	strcat(childSentName, "/");
-	strcat(childSentName, name);
-	strcat(childSentName, "_child_sent");
-	instance->childSent = sem_open(childSentName, 0);
+MSG_API void postSemaphore(struct MPISemaphore * semaphore) {
+	postSemaphoreCount(semaphore, 1);
+}
 
-	char * conRecvName = malloc(sizeof(char) * 128);
-	memset(conRecvName, 0, sizeof(char) * 128);
-	strcat(conRecvName, "/");
-	strcat(conRecvName, name);
-	strcat(conRecvName, "_con_recv");
-	instance->controllerReceived = sem_open(conRecvName, 0);
+// Waits for a post using the instance's wait strategy.
+MSG_API void waitSemaphore(struct MPISemaphore * semaphore, int strategy, int spinCount) {
+	if (strategy == MSG_WAIT_SPIN) {
+		while (!tryWaitSemaphore(semaphore)) {
+			cpuRelax();
+		}
+		return;
+	}
 
-	// Now we map the shared memory.
+	if (strategy == MSG_WAIT_SPIN_THEN_BLOCK) {
+		for (int i = 0; i < spinCount; ++i) {
+			if (tryWaitSemaphore(semaphore)) {
+				return;
+			}
+			cpuRelax();
+		}
+	}
 
-	char * msgFDName = getMessageFDNameLocationFDName(name);
-	instance->fd = shm_open(msgFDName, O_RDWR | O_CREAT, 0777);
-	free(msgFDName);
+	while (!tryWaitSemaphore(semaphore)) {
+		// The kernel only puts us to sleep if the count is still 
+		// zero, so a post that lands in between isn't lost.
+		__atomic_fetch_add(&semaphore->waiters, 1, __ATOMIC_SEQ_CST);
+		futex(&semaphore->count, FUTEX_WAIT, 0, NULL);
+		__atomic_fetch_sub(&semaphore->waiters, 1, __ATOMIC_SEQ_CST);
+	}
+}
 
-	char * msgCodeFD = getMessageCodeFDName(name);
-	instance->messageCode = mallocShared(sizeof(int), msgCodeFD);
-	free(msgCodeFD);
+// Same as waitSemaphore, but gives up once timeout nanoseconds have
+// passed. Returns TRUE if a post was taken, FALSE on timeout.
+MSG_API bool waitSemaphoreTimed(struct MPISemaphore * semaphore, int strategy, int spinCount, uint64_t timeout) {
+	uint64_t deadline = monotonicNanoseconds() + timeout;
 
-	char * msgSizeFD = getMessageSizeFDName(name);
-	instance->messageSize = mallocShared(sizeof(int), msgSizeFD);
-	free(msgSizeFD);
+	if (strategy == MSG_WAIT_SPIN) {
+		while (!tryWaitSemaphore(semaphore)) {
+			if (monotonicNanoseconds() >= deadline) {
+				return false;
+			}
+			cpuRelax();
+		}
+		return true;
+	}
 
-	char * msgTypeFD = getMessageTypeFDName(name);
-	instance->messageType = mallocShared(sizeof(int), msgTypeFD);
-	free(msgTypeFD);
+	if (strategy == MSG_WAIT_SPIN_THEN_BLOCK) {
+		for (int i = 0; i < spinCount; ++i) {
+			if (tryWaitSemaphore(semaphore)) {
+				return true;
+			}
+			cpuRelax();
+		}
+	}
 
+	while (!tryWaitSemaphore(semaphore)) {
+		uint64_t now = monotonicNanoseconds();
+		if (now >= deadline) {
+			return false;
+		}
 
-	// Now we trigger the semaphore to inform the controller
-	// that we have succeeded.
+		struct timespec remaining;
+		remaining.tv_sec  = (deadline - now) / 1000000000ull;
+		remaining.tv_nsec = (deadline - now) % 1000000000ull;
 
-	sem_post(instance->childReceived);
+		__atomic_fetch_add(&semaphore->waiters, 1, __ATOMIC_SEQ_CST);
+		futex(&semaphore->count, FUTEX_WAIT, 0, &remaining);
+		__atomic_fetch_sub(&semaphore->waiters, 1, __ATOMIC_SEQ_CST);
+	}
 
-	return instance;
+	return true;
 }
 
-// Sends a message.
-// Can be called on either a child or controller, doesn't matter.
-// Internally the function will allocate some shared memory and 
-// copy the message to it before triggering a semaphore. The caller
-// is responsible for deallocating the message that they pass in.
-// This function will halt execution until the receiver confirms
-// that they have received the message.
-void sendMessage(struct MPIController * instance, void * message, int code, int length, int type) {
-	void * sharedMessage = reallocShared(length, instance->fd);
-	memcpy(sharedMessage, message, length);
+// Changes how this process waits for its peer. See the MSG_WAIT_*
+// definitions. spinCount is only used by MSG_WAIT_SPIN_THEN_BLOCK;
+// pass 0 to use MSG_DEFAULT_SPIN_COUNT.
+MSG_API void setWaitStrategy(struct MPIController * instance, int strategy, int spinCount) {
+	instance->waitStrategy = strategy;
+	instance->spinCount    = spinCount > 0 ? spinCount : MSG_DEFAULT_SPIN_COUNT;
+}
+
+// Like monotonicNanoseconds, but always 0 when the instance doesn't
+// time anything, so that differences come out as 0 for free.
+MSG_API uint64_t statsClock(struct MPIController * instance) {
+	return instance->timing ? monotonicNanoseconds() : 0;
+}
+
+// Index of the histogram bucket value belongs in.
+MSG_API int statsBucket(uint64_t value) {
+	if (value == 0) {
+		return 0;
+	}
+
+	int bucket = 64 - __builtin_clzll(value);
+	return bucket < MSG_STATS_BUCKETS ? bucket : MSG_STATS_BUCKETS - 1;
+}
+
+// Counts one message of the given length.
+MSG_API void countMessage(struct MPIDirectionStats * stats, size_t length) {
+	stats->messages++;
+	stats->bytes += length;
+	stats->sizeHistogram[statsBucket(length)]++;
+}
+
+// Records the number of messages waiting in the direction's queue 
+// right after a send.
+MSG_API void countQueueDepth(struct MPIDirectionStats * stats, struct MPIDirection * direction) {
+	uint64_t depth = __atomic_load_n(&direction->sent.count, __ATOMIC_RELAXED);
+	stats->queueDepth = depth;
+	if (depth > stats->maxQueueDepth) {
+		stats->maxQueueDepth = depth;
+	}
+}
+
+// Waits on one of the instance's semaphores using its wait strategy,
+// for up to timeout nanoseconds (forever if negative, not at all if 0).
+// Only waits that can't be satisfied right away are counted in stats,
+// which can be NULL for waits that aren't counted anywhere.
+// Returns 0 once a post has been taken, 1 on timeout and -1 if the 
+// peer is gone.
+//
+// The child of a persistent world can't wait forever, since its 
+// controller may exit without detaching, so it checks that the 
+// controller is still alive and still holds the world every 
+// MSG_LIVENESS_INTERVAL_MS. Once it doesn't, this returns -1 without
+// waiting until the next session starts, and everything the child 
+// sends is dropped.
+MSG_API int waitForPeerTimed(struct MPIController * instance, struct MPISemaphore * semaphore, 
+	struct MPIDirectionStats * stats, int64_t timeout) {
+	if (instance->peerLost) {
+		return -1;
+	}
+
+	if (tryWaitSemaphore(semaphore)) {
+		return 0;
+	}
+
+	if (timeout == 0) {
+		return 1;
+	}
+
+	bool watch = instance->persistent && !instance->is_controller;
+	uint64_t start    = statsClock(instance);
+	uint64_t deadline = timeout > 0 ? monotonicNanoseconds() + timeout : 0;
+
+	while (true) {
+		uint64_t slice = watch ? MSG_LIVENESS_INTERVAL_MS * 1000000ull : UINT64_MAX;
+
+		if (timeout > 0) {
+			uint64_t now = monotonicNanoseconds();
+			if (now >= deadline) {
+				return 1;
+			}
+			if (deadline - now < slice) {
+				slice = deadline - now;
+			}
+		}
+
+		if (slice == UINT64_MAX) {
+			waitSemaphore(semaphore, instance->waitStrategy, instance->spinCount);
+			break;
+		}
+
+		if (waitSemaphoreTimed(semaphore, instance->waitStrategy, instance->spinCount, slice)) {
+			break;
+		}
+
+		if (watch) {
+			// A new controller may already have taken over the world.
+			pid_t pid = __atomic_load_n(&instance->control->controllerPid, __ATOMIC_ACQUIRE);
+			uint32_t epoch = __atomic_load_n(&instance->control->sessionEpoch, __ATOMIC_ACQUIRE);
+
+			if (pid == 0 || epoch != instance->sessionEpoch || (kill(pid, 0) == -1 && errno == ESRCH)) {
+				instance->peerLost = true;
+				return -1;
+			}
+		}
+	}
+
+	if (stats == NULL) {
+		return 0;
+	}
+
+	uint64_t waited = statsClock(instance) - start;
+
+	stats->waits++;
+	stats->waitNanoseconds += waited;
+	stats->waitHistogram[statsBucket(waited)]++;
+
+	return 0;
+}
+
+// Waits on one of the instance's semaphores for as long as it takes.
+// Returns FALSE if the peer is gone (see waitForPeerTimed).
+MSG_API bool waitForPeer(struct MPIController * instance, struct MPISemaphore * semaphore, 
+	struct MPIDirectionStats * stats) {
+	return waitForPeerTimed(instance, semaphore, stats, -1) == 0;
+}
+
+// Constructs the path of the FIFO that wakes up the receiving side of
+// the given direction (see getMessageFd). Returns FALSE if it doesn't
+// fit.
+MSG_API bool getNotifyPath(char * buffer, char * base, int direction) {
+	return snprintf(buffer, MSG_MAX_NAME, "/dev/shm/%s_notify_%d", base, direction) < MSG_MAX_NAME;
+}
+
+// Constructs the name of the shared memory object that holds 
+// everything the controller and the child share. Returns FALSE if the
+// instance name is too long for it or for the notify FIFOs. Cutting 
+// the name short instead could give two instances the same segment.
+MSG_API bool getControlSegmentName(char * buffer, char * base) {
+	char path[MSG_MAX_NAME];
+
+	if (snprintf(buffer, MSG_MAX_NAME, "/%s_mpi_controller", base) >= MSG_MAX_NAME || 
+		!getNotifyPath(path, base, 1)) {
+		printf("instance name %s is too long\n", base);
+		return false;
+	}
+
+	return true;
+}
+
+// Called by the sender after it has posted messages. If the receiver
+// is polling getMessageFd and has run out of messages, wakes it up by
+// writing a byte to its FIFO. Costs a single load otherwise.
+MSG_API void notifyReceiver(struct MPIController * instance) {
+	struct MPIDirection * direction = instance->sendDirection;
+
+	if (__atomic_load_n(&direction->armed, __ATOMIC_SEQ_CST) == 0 || 
+		__atomic_exchange_n(&direction->armed, 0, __ATOMIC_SEQ_CST) == 0) {
+		return;
+	}
+
+	// Priority messages may be sent from another thread than the rest,
+	// so whichever opens the FIFO second closes its descriptor again.
+	int fd = __atomic_load_n(&instance->notifyFd, __ATOMIC_ACQUIRE);
+
+	if (fd == -1) {
+		char path[MSG_MAX_NAME];
+		getNotifyPath(path, instance->system_name, 
+			instance->is_controller ? MSG_TO_CHILD : MSG_TO_CONTROLLER);
+		int opened = open(path, O_WRONLY | O_NONBLOCK);
+
+		if (opened != -1 && !__atomic_compare_exchange_n(&instance->notifyFd, &fd, opened, false, 
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			close(opened);
+		} else {
+			fd = opened;
+		}
+	}
+
+	// A full FIFO is already readable, so a failed write is fine.
+	if (fd != -1 && write(fd, "", 1) == -1 && errno != EAGAIN) {
+		printf("could not notify the receiver\n");
+	}
+}
+
+// ----------------------------------------------
+// Placement
+// ----------------------------------------------
+// On machines with several sockets, a controller and a child that run
+// on different sockets, or shared memory that lives on a third one,
+// can halve the bandwidth of the channel. The options in struct 
+// MPIControllerOptions pin both processes and bind the shared memory
+// to one node. Both sides read them from the control block and place
+// themselves when they map it.
+
+// Returns the CPU and NUMA node the calling thread is running on.
+MSG_API void currentCpu(int * cpu, int * node) {
+	unsigned int c = 0;
+	unsigned int n = 0;
+
+	if (syscall(SYS_getcpu, &c, &n, NULL) == -1) {
+		*cpu  = -1;
+		*node = -1;
+		return;
+	}
+
+	*cpu  = c;
+	*node = n;
+}
+
+// Pins the calling process to a single CPU.
+MSG_API bool pinToCpu(int cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+		printf("could not pin the process to CPU %d\n", cpu);
+		return false;
+	}
+
+	return true;
+}
+
+// Restricts the calling process to the CPUs of a NUMA node, read from
+// sysfs since libnuma may not be installed.
+MSG_API bool pinToNode(int node) {
+	char path[MSG_MAX_NAME];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+	FILE * file = fopen(path, "r");
+	if (file == NULL) {
+		printf("could not read the CPUs of node %d\n", node);
+		return false;
+	}
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+
+	// The list looks like 0-15,32-47.
+	int first;
+	while (fscanf(file, "%d", &first) == 1) {
+		int last = first;
+		int next = fgetc(file);
+
+		if (next == '-') {
+			if (fscanf(file, "%d", &last) != 1) {
+				break;
+			}
+			next = fgetc(file);
+		}
+
+		for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+			CPU_SET(cpu, &set);
+		}
+
+		if (next != ',') {
+			break;
+		}
+	}
+
+	fclose(file);
+
+	if (CPU_COUNT(&set) == 0 || sched_setaffinity(0, sizeof(set), &set) == -1) {
+		printf("could not move the process to node %d\n", node);
+		return false;
+	}
+
+	return true;
+}
+
+// Pins this process as the control block says its side should be.
+MSG_API void applyAffinity(struct MPIController * instance) {
+	struct MPIControlBlock * control = instance->control;
+	int cpu = instance->is_controller ? control->controllerCpu : control->childCpu;
+
+	if (cpu >= 0) {
+		pinToCpu(cpu);
+	} else if (control->numaNode >= 0 && (control->placement & MSG_PLACE_PIN_NODE)) {
+		pinToNode(control->numaNode);
+	}
+}
+
+// Applies the placement of the instance to a mapping of its shared
+// memory: binds it to the instance's node, asks for huge pages and 
+// faults it in, in that order, since pages are placed when they're
+// first touched. MAP_POPULATE can't be used for the same reason.
+MSG_API void placeMapping(struct MPIController * instance, void * address, size_t size) {
+	struct MPIControlBlock * control = instance->control;
+
+	if (control->numaNode >= 0) {
+		unsigned long mask[16];
+		memset(mask, 0, sizeof(mask));
+
+		int node = control->numaNode;
+		int bits = 8 * sizeof(unsigned long);
+
+		if (node < 16 * bits) {
+			mask[node / bits] = 1ul << (node % bits);
+
+			if (syscall(SYS_mbind, address, size, MSG_MPOL_BIND, mask, 16 * bits + 1, MSG_MPOL_MF_MOVE) == -1) {
+				printf("could not bind shared memory to node %d (errno %d)\n", node, errno);
+			}
+		}
+	}
+
+	if (control->placement & MSG_PLACE_HUGE_PAGES) {
+		madvise(address, size, MADV_HUGEPAGE);
+	}
+
+	if (control->placement & MSG_PLACE_PREFAULT) {
+		// Older kernels don't have MADV_POPULATE_WRITE. Reading every 
+		// page faults it in as well.
+		if (madvise(address, size, MADV_POPULATE_WRITE) == -1) {
+			size_t pageSize = sysconf(_SC_PAGESIZE);
+			for (size_t i = 0; i < size; i += pageSize) {
+				(void)((volatile char *)address)[i];
+			}
+		}
+	}
+}
+
+// Constructs the name of the shared memory object that the statistics
+// of an instance are published in. Returns FALSE if the name doesn't
+// fit, rather than cut it short and share the segment with another 
+// instance.
+MSG_API bool getStatsSegmentName(char * buffer, char * base) {
+	if (snprintf(buffer, MSG_MAX_NAME, "/%s_stats", base) >= MSG_MAX_NAME) {
+		printf("instance name %s is too long for statistics\n", base);
+		return false;
+	}
+
+	return true;
+}
+
+// Sets up the statistics of the instance. Whoever created the control
+// segment (the controller, or the child of a persistent world) creates
+// the statistics segment if the control block says to, and the other
+// side maps it. Without one, the counters go to private memory nobody
+// reads.
+MSG_API void attachStats(struct MPIController * instance) {
+	bool named = getStatsSegmentName(instance->statsName, instance->system_name);
+	instance->statsBlock = NULL;
+
+	bool owner = instance->control->persistent ? !instance->is_controller : instance->is_controller;
+
+	if (instance->control->statistics && named) {
+		int flags = O_RDWR;
+		if (owner) {
+			shm_unlink(instance->statsName);
+			flags |= O_CREAT | O_EXCL;
+		}
+
+		int fd = shm_open(instance->statsName, flags, 0777);
+
+		if (fd == -1) {
+			printf("shm_open failed for %s\n", instance->statsName);
+		} else {
+			if (owner && ftruncate(fd, sizeof(struct MPIStatsBlock)) == -1) {
+				printf("ftruncate failed\n");
+			}
+
+			void * result = mmap(NULL, sizeof(struct MPIStatsBlock), PROT_READ | PROT_WRITE, 
+				MAP_SHARED, fd, 0);
+			close(fd);
+
+			if (result == (void *)-1) {
+				printf("mmap failed\n");
+			} else {
+				instance->statsBlock = (struct MPIStatsBlock *)result;
+			}
+		}
+	}
+
+	instance->timing = instance->statsBlock != NULL;
+
+	if (instance->statsBlock == NULL) {
+		instance->statsBlock = (struct MPIStatsBlock *)calloc(1, sizeof(struct MPIStatsBlock));
+	}
+
+	// A controller that attaches to a persistent world starts from zero.
+	int index = instance->is_controller ? MSG_STATS_CONTROLLER : MSG_STATS_CHILD;
+	instance->stats = &instance->statsBlock->process[index];
+	memset(&instance->stats->send, 0, sizeof(struct MPIDirectionStats));
+	memset(&instance->stats->recv, 0, sizeof(struct MPIDirectionStats));
+	instance->stats->pid    = getpid();
+	instance->stats->timing = instance->timing;
 
-	*instance->messageCode = code;
-	*instance->messageSize = length;
-	*instance->messageType = type;
+	// Where this process ended up (see applyAffinity).
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	sched_getaffinity(0, sizeof(allowed), &allowed);
+	currentCpu(&instance->stats->cpu, &instance->stats->node);
+	instance->stats->cpus   = CPU_COUNT(&allowed);
+	instance->stats->pinned = instance->stats->cpus == 1 ? instance->stats->cpu : -1;
+
+	if (owner) {
+		instance->statsBlock->memoryNode = instance->control->numaNode;
+		instance->statsBlock->placement  = instance->control->placement;
+		instance->statsBlock->version    = MSG_STATS_VERSION;
+		__atomic_store_n(&instance->statsBlock->magic, MSG_STATS_MAGIC, __ATOMIC_RELEASE);
+	}
+}
+
+// Maps the statistics segment of the instance with the given name 
+// read-only, for monitoring it from a third process. Returns NULL if
+// there is none. Unmap it with munmap(stats, sizeof(struct MPIStatsBlock)).
+MSG_API const struct MPIStatsBlock * openStats(char * name) {
+	char statsName[MSG_MAX_NAME];
+	if (!getStatsSegmentName(statsName, name)) {
+		return NULL;
+	}
+
+	int fd = shm_open(statsName, O_RDONLY, 0);
+
+	if (fd == -1) {
+		return NULL;
+	}
+
+	struct stat s;
+	if (fstat(fd, &s) == -1 || (size_t)s.st_size < sizeof(struct MPIStatsBlock)) {
+		close(fd);
+		return NULL;
+	}
+
+	struct MPIStatsBlock * stats = (struct MPIStatsBlock *)mmap(NULL, sizeof(struct MPIStatsBlock), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (stats == (void *)-1) {
+		return NULL;
+	}
+
+	if (__atomic_load_n(&stats->magic, __ATOMIC_ACQUIRE) != MSG_STATS_MAGIC || 
+		stats->version != MSG_STATS_VERSION) {
+		munmap(stats, sizeof(struct MPIStatsBlock));
+		return NULL;
+	}
+
+	return stats;
+}
+
+// Points the members of the instance that refer to shared memory at
+// their place in the control block. Both sides call this once the
+// control block is mapped.
+MSG_API void bindControlBlock(struct MPIController * instance) {
+	struct MPIControlBlock * control = instance->control;
 
 	if (instance->is_controller) {
-		sem_post(instance->controllerSent);
-		sem_wait(instance->childReceived);
+		instance->sendDirection = &control->direction[MSG_TO_CHILD];
+		instance->recvDirection = &control->direction[MSG_TO_CONTROLLER];
+		instance->sendLane      = &control->priority[MSG_TO_CHILD];
+		instance->recvLane      = &control->priority[MSG_TO_CONTROLLER];
 	} else {
-		sem_post(instance->childSent);
-		sem_wait(instance->controllerReceived);
+		instance->sendDirection = &control->direction[MSG_TO_CONTROLLER];
+		instance->recvDirection = &control->direction[MSG_TO_CHILD];
+		instance->sendLane      = &control->priority[MSG_TO_CONTROLLER];
+		instance->recvLane      = &control->priority[MSG_TO_CHILD];
+	}
+
+	instance->channelMode  = control->channelMode;
+	instance->ringCapacity = control->ringCapacity;
+	instance->sendRing     = NULL;
+	instance->recvRing     = NULL;
+
+	// The first ring carries messages from the controller to the child, 
+	// the second one carries messages the other way.
+	if (instance->channelMode == MSG_CHANNEL_RING) {
+		size_t ringSize = sizeof(struct MPIRing) + instance->ringCapacity;
+		struct MPIRing * toChild      = (struct MPIRing *)((char *)control + control->ringOffset);
+		struct MPIRing * toController = (struct MPIRing *)((char *)control + control->ringOffset + ringSize);
+
+		if (instance->is_controller) {
+			instance->sendRing = toChild;
+			instance->recvRing = toController;
+		} else {
+			instance->sendRing = toController;
+			instance->recvRing = toChild;
+		}
 	}
 
-	// Now we free the memory.
-	// By this point the receiver will already
-	// have it copied to non-shared memory.
-	munmap(sharedMessage, length);
+	instance->waitStrategy = MSG_WAIT_BLOCK;
+	instance->spinCount    = MSG_DEFAULT_SPIN_COUNT;
+
+	instance->sendHead       = 0;
+	instance->unpublished    = 0;
+	instance->batchRemaining = 0;
+
+	memset(&instance->sendStream, 0, sizeof(struct MPIStream));
+	memset(&instance->recvStream, 0, sizeof(struct MPIStream));
+
+	memset(&instance->sendMapping, 0, sizeof(struct MPIPayloadMapping));
+	memset(&instance->recvMapping, 0, sizeof(struct MPIPayloadMapping));
+
+	applyAffinity(instance);
+	placeMapping(instance, control, instance->controlSize);
 }
 
-// Halts until revceiving a message. When a message is received, it 
-// will be copied from shared memory into local memory. The returned
-// pointer is the responsibility of the caller to free.
-void * recvMessage(struct MPIController * instance, int * code, int * length, int * type) {
-	// wait for a message to come in
-	if (instance->is_controller) {
-		sem_wait(instance->childSent);
+// Makes sure that this process's mapping of a direction's payload 
+// area matches what is published in the control block. This is a 
+// single comparison unless the sender has moved the area since the 
+// last call, in which case the old mapping is dropped and the new 
+// area is mapped. The control block itself is never remapped.
+MSG_API void syncPayloadMapping(struct MPIController * instance, struct MPIDirection * direction, 
+	struct MPIPayloadMapping * mapping) {
+	if (mapping->data != NULL && mapping->generation == direction->generation) {
+		return;
+	}
+
+	if (mapping->data != NULL) {
+		munmap(mapping->data, mapping->size);
+	}
+
+	if (mapping == &instance->sendMapping) {
+		instance->stats->send.remaps++;
 	} else {
-		sem_wait(instance->controllerSent);
+		instance->stats->recv.remaps++;
 	}
 
-	*code   = *instance->messageCode;
-	*length = *instance->messageSize;
-	*type   = *instance->messageType;
+	size_t capacity = direction->payloadCapacity;
 
-	// Now we need to map the new data coming in
-	// so that it can be accessed.
-	void * msg = reallocShared(*length, instance->fd);
+	void * result = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, 
+		instance->fd, direction->payloadOffset);
 
-	// Allocate some process memory for it and copy it into
-	// the new memory.
-	void * result = malloc(*length);
-	memcpy(result, msg, *length);
+	if (result == (void *)-1) {
+		printf("mmap failed\n");
+		printf("errno: %d\n", errno);
+		mapping->data = NULL;
+		mapping->size = 0;
+		return;
+	}
 
-	if (instance->is_controller) {
-		sem_post(instance->controllerReceived);
+	placeMapping(instance, result, capacity);
+
+	mapping->data       = result;
+	mapping->size       = capacity;
+	mapping->generation = direction->generation;
+}
+
+// Allocates size bytes at the end of the shared memory object and 
+// returns their offset. Both directions can grow at the same time,
+// so this is done under a lock. It's rare enough that spinning on 
+// it is fine.
+MSG_API uint64_t allocateSegmentSpace(struct MPIController * instance, size_t size) {
+	struct MPIControlBlock * control = instance->control;
+
+	while (__atomic_exchange_n(&control->growLock, 1, __ATOMIC_ACQUIRE)) {
+		cpuRelax();
+	}
+
+	uint64_t offset = control->segmentSize;
+
+	// A huge page can only back an area that starts on a huge page 
+	// boundary of the object.
+	if ((control->placement & MSG_PLACE_HUGE_PAGES) && size >= MSG_HUGE_PAGE_SIZE) {
+		offset = (offset + MSG_HUGE_PAGE_SIZE - 1) & ~(uint64_t)(MSG_HUGE_PAGE_SIZE - 1);
+	}
+
+	if (ftruncate(instance->fd, offset + size) == -1) {
+		printf("ftruncate failed\n");
+		offset = 0;
 	} else {
-		sem_post(instance->childReceived);
+		control->segmentSize = offset + size;
 	}
 
-	munmap(msg, *length);
+	__atomic_store_n(&control->growLock, 0, __ATOMIC_RELEASE);
 
-	return result;
+	return offset;
 }
 
-// Removes all semaphores, frees shared memory and 
-// unlinks shared memory file descriptors. Call this in
-// the controller program before it exits. Do not call
-// in the child program. More than one call might cause
-// a problem.
-void destroyInstance(struct MPIController * instance) {
-	// remove all of the semaphores from the system
-	char * conSentName = malloc(sizeof(char) * 128);
-	memset(conSentName, 0, sizeof(char) * 128);
-	strcat(conSentName, "/");
-	strcat(conSentName, instance->system_name);
-	strcat(conSentName, "_con_sent");
-
-	char * childRecvName = malloc(sizeof(char) * 128);
-	memset(childRecvName, 0, sizeof(char) * 128);
-	strcat(childRecvName, "/");
-	strcat(childRecvName, instance->system_name);
-	strcat(childRecvName, "_child_recv");
-
-	char * childSentName = malloc(sizeof(char) * 128);
-	memset(childSentName, 0, sizeof(char) * 128);
-	strcat(childSentName, "/");
-	strcat(childSentName, instance->system_name);
-	strcat(childSentName, "_child_sent");
-
-	char * conRecvName = malloc(sizeof(char) * 128);
-	memset(conRecvName, 0, sizeof(char) * 128);
-	strcat(conRecvName, "/");
-	strcat(conRecvName, instance->system_name);
-	strcat(conRecvName, "_con_recv");
-	
-	sem_unlink(conSentName);
-	sem_unlink(childRecvName);
-	sem_unlink(childSentName);
-	sem_unlink(conRecvName);
-
-	char * msgFDName = getMessageFDNameLocationFDName(instance->system_name);
-	shm_unlink(msgFDName);
-	free(msgFDName);
-
-	char * msgCodeFD = getMessageCodeFDName(instance->system_name);
-	shm_unlink(msgCodeFD);
-	free(msgCodeFD);
-
-	char * msgSizeFD = getMessageSizeFDName(instance->system_name);
-	shm_unlink(msgSizeFD);
-	free(msgSizeFD);
-
-	char * msgTypeFD = getMessageTypeFDName(instance->system_name);
-	shm_unlink(msgTypeFD);
-	free(msgTypeFD);
-
-	// deallocate the shared memory and the instance itself
-	munmap(instance->messageCode, sizeof(int));
-	munmap(instance->messageSize, sizeof(int));
-	munmap(instance->messageType, sizeof(int));
+// Called by the sending side before it copies a message into the
+// payload area of its direction. If the message doesn't fit, a new
+// area is allocated at the next power of two multiple of the current
+// size so that a slowly growing message size doesn't cause a resize 
+// every time. The memory behind the old area is handed back to the 
+// system; the receiver is done with it, since the previous message 
+// has been acknowledged. Returns FALSE if the area couldn't be grown,
+// in which case the old one is left as it was.
+MSG_API bool reserveMessageCapacity(struct MPIController * instance, size_t length) {
+	struct MPIDirection * direction = instance->sendDirection;
+	size_t capacity = direction->payloadCapacity;
 
-	free(instance);
-}
\ No newline at end of file
+	if (length > capacity) {
+		while (capacity < length) {
+			capacity *= 2;
+		}
+
+		uint64_t offset = allocateSegmentSpace(instance, capacity);
+
+		if (offset == 0) {
+			printf("could not grow the payload area to %zu bytes\n", capacity);
+			return false;
+		}
+
+		syncPayloadMapping(instance, direction, &instance->sendMapping);
+		madvise(instance->sendMapping.data, instance->sendMapping.size, MADV_REMOVE);
+
+		direction->payloadOffset   = offset;
+		direction->payloadCapacity = capacity;
+		direction->generation++;
+	}
+
+	syncPayloadMapping(instance, direction, &instance->sendMapping);
+	return true;
+}
+
+// ----------------------------------------------
+// Priority lane
+// ----------------------------------------------
+// Ordinary messages are delivered one after the other, so a command 
+// like "abort" has to wait until everything sent before it has been
+// received, which can take a long time while a large transfer is in
+// progress. Each direction also has a priority lane of 
+// MSG_PRIORITY_SLOTS fixed size slots. Messages sent through it are 
+// received ahead of any ordinary message that is waiting, and don't
+// wait for the payload area or the ring. 
+//
+// Every priority message is announced with a post of the same 
+// semaphore as ordinary messages, which wakes up a receiver that is
+// waiting for one. The receiver takes one post per message of either 
+// kind, looking at the lane first, so the posts always add up.
+
+// Sends a message of at most MSG_PRIORITY_MESSAGE_SIZE bytes through
+// the priority lane. Only waits if all of the lane's slots are taken.
+// This can be called from another thread than the one that sends (and
+// may be blocked sending) ordinary messages, but only from one thread
+// at a time. Returns FALSE if the message is too long, or the peer is
+// gone. Priority messages aren't counted in the statistics of the 
+// sender, since that thread doesn't own them.
+MSG_API bool sendPriorityMessage(struct MPIController * instance, const void * message, int code, int length, 
+	int type) {
+	if (!instance->transport->sharedMemory) {
+		printf("the priority lane needs shared memory\n");
+		return false;
+	}
+
+	if (length < 0 || length > MSG_PRIORITY_MESSAGE_SIZE) {
+		printf("priority message of length %d is longer than %d bytes\n", length, MSG_PRIORITY_MESSAGE_SIZE);
+		return false;
+	}
+
+	struct MPIPriorityLane * lane = instance->sendLane;
+
+	if (!waitForPeer(instance, &lane->free, NULL)) {
+		return false;
+	}
+
+	uint64_t head = lane->head;
+	struct MPIPrioritySlot * slot = &lane->slots[head % MSG_PRIORITY_SLOTS];
+
+	slot->code   = code;
+	slot->length = length;
+	slot->type   = type;
+	memcpy(slot->data, message, length);
+
+	__atomic_store_n(&lane->head, head + 1, __ATOMIC_RELEASE);
+	postSemaphore(&instance->sendDirection->sent);
+	notifyReceiver(instance);
+
+	return true;
+}
+
+// Returns TRUE if a priority message is waiting, without receiving 
+// anything. It is what recvMessage returns next. A receiver that 
+// spends a long time on something else, like reading a stream, can 
+// call this now and then to find out whether it should stop.
+MSG_API bool hasPriorityMessage(struct MPIController * instance) {
+	if (!instance->transport->sharedMemory) {
+		return false;
+	}
+
+	struct MPIPriorityLane * lane = instance->recvLane;
+	uint64_t pending = __atomic_load_n(&lane->head, __ATOMIC_ACQUIRE) - lane->tail;
+
+	// The message being viewed stays in the lane until it's released.
+	return pending > (instance->viewPriority ? 1u : 0u);
+}
+
+// Returns a view of the next priority message, or NULL if there is 
+// none. The semaphore post that goes with it has to be taken by the 
+// caller.
+MSG_API const void * priorityView(struct MPIController * instance, int * code, int * length, int * type) {
+	struct MPIPriorityLane * lane = instance->recvLane;
+	uint64_t tail = lane->tail;
+
+	if (__atomic_load_n(&lane->head, __ATOMIC_ACQUIRE) == tail) {
+		return NULL;
+	}
+
+	struct MPIPrioritySlot * slot = &lane->slots[tail % MSG_PRIORITY_SLOTS];
+
+	*code   = slot->code;
+	*length = slot->length;
+	*type   = slot->type;
+
+	instance->viewPriority = true;
+	countMessage(&instance->stats->recv, *length);
+	return slot->data;
+}
+
+// Hands the slot of the priority message being viewed back to the sender.
+MSG_API void releasePriority(struct MPIController * instance) {
+	struct MPIPriorityLane * lane = instance->recvLane;
+
+	instance->viewPriority = false;
+
+	__atomic_store_n(&lane->tail, lane->tail + 1, __ATOMIC_RELEASE);
+	postSemaphore(&lane->free);
+}
+
+// The data area of a ring starts right after its header.
+MSG_API char * ringData(struct MPIRing * ring) {
+	return (char *)ring + sizeof(struct MPIRing);
+}
+
+// Number of bytes a message of the given length takes up in a ring
+// or a batch, including its header.
+MSG_API size_t recordSize(size_t length) {
+	size_t unit = sizeof(struct MPIRecord);
+	return ((unit + length + unit - 1) / unit) * unit;
+}
+
+// In ring mode the "sent" semaphore of a direction counts records that
+// are ready to be consumed, and the "received" semaphore is posted by 
+// the consumer when it frees space while the producer is waiting.
+
+// Makes every record written since the last call visible to the 
+// consumer, with a single store and a single post.
+MSG_API void ringPublish(struct MPIController * instance) {
+	if (instance->unpublished == 0) {
+		return;
+	}
+
+	__atomic_store_n(&instance->sendRing->head, instance->sendHead, __ATOMIC_RELEASE);
+	postSemaphoreCount(&instance->sendDirection->sent, instance->unpublished);
+	instance->unpublished = 0;
+
+	notifyReceiver(instance);
+
+	countQueueDepth(&instance->stats->send, instance->sendDirection);
+}
+
+// Blocks the producer until at least size bytes are free in its ring.
+// Anything that hasn't been published yet is published before going
+// to sleep, since the consumer can't free space otherwise.
+// The waiting flag is set before the free space is checked again, so
+// the consumer either sees the flag and posts the semaphore or the 
+// producer sees the space it freed. Stale posts only cause one extra
+// trip around the loop.
+MSG_API void ringWaitForSpace(struct MPIController * instance, size_t size) {
+	struct MPIRing * ring = instance->sendRing;
+
+	while (true) {
+		uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (instance->ringCapacity - (instance->sendHead - tail) >= size) {
+			return;
+		}
+
+		ringPublish(instance);
+
+		__atomic_store_n(&ring->producerWaiting, 1, __ATOMIC_SEQ_CST);
+
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+		if (instance->ringCapacity - (instance->sendHead - tail) >= size) {
+			return;
+		}
+
+		// There's nobody left to free space.
+		if (!waitForPeer(instance, &instance->sendDirection->received, &instance->stats->send)) {
+			return;
+		}
+	}
+}
+
+// Called by the consumer after it has moved the tail forward.
+MSG_API void ringReleaseSpace(struct MPIController * instance, uint64_t tail) {
+	struct MPIRing * ring = instance->recvRing;
+
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&ring->producerWaiting, __ATOMIC_SEQ_CST)) {
+		if (__atomic_exchange_n(&ring->producerWaiting, 0, __ATOMIC_SEQ_CST)) {
+			postSemaphore(&instance->recvDirection->received);
+		}
+	}
+}
+
+// Reserves room for a message of the given length in the ring this 
+// process produces into and returns a pointer to where its payload 
+// goes. Only blocks if there isn't enough free space in the ring.
+// Nothing is visible to the consumer until ringCommitSend is called.
+MSG_API void * ringAcquireSendBuffer(struct MPIController * instance, int length) {
+	struct MPIRing * ring = instance->sendRing;
+	size_t capacity = instance->ringCapacity;
+	size_t size     = recordSize(length);
+
+	if (size > capacity) {
+		printf("message of length %d does not fit in the ring\n", length);
+		return NULL;
+	}
+
+	size_t position = instance->sendHead & (capacity - 1);
+	size_t toEnd    = capacity - position;
+
+	// Records have to be contiguous, so if this one would run past
+	// the end of the data area, fill the rest with a padding record
+	// and start over at the beginning. The padding is counted as a
+	// record so that the consumer frees it like any other.
+	if (toEnd < size) {
+		ringWaitForSpace(instance, toEnd);
+
+		struct MPIRecord * pad = (struct MPIRecord *)(ringData(ring) + position);
+		pad->code   = 0;
+		pad->type   = 0;
+		pad->length = toEnd - sizeof(struct MPIRecord);
+		pad->flags  = MSG_RECORD_PADDING;
+
+		instance->sendHead += toEnd;
+		instance->unpublished++;
+		position = 0;
+	}
+
+	ringWaitForSpace(instance, size);
+
+	return ringData(ring) + position + sizeof(struct MPIRecord);
+}
+
+// Fills in the header of the record reserved by ringAcquireSendBuffer.
+// Unless publish is false (in the middle of a batch) it's made visible
+// to the consumer right away.
+MSG_API void ringCommitSend(struct MPIController * instance, int code, int length, int type, bool publish) {
+	struct MPIRing * ring = instance->sendRing;
+
+	struct MPIRecord * record = (struct MPIRecord *)(ringData(ring) + (instance->sendHead & (instance->ringCapacity - 1)));
+	record->code   = code;
+	record->type   = type;
+	record->length = length;
+	record->flags  = 0;
+
+	instance->sendHead += recordSize(length);
+	instance->unpublished++;
+
+	if (publish) {
+		ringPublish(instance);
+	}
+}
+
+// Hands out an empty MSG_TYPE_DETACH message in place of the one the
+// controller of a persistent world will never send.
+MSG_API const void * controllerLost(struct MPIController * instance, int * code, int * length, int * type) {
+	*code   = 0;
+	*length = 0;
+	*type   = MSG_TYPE_DETACH;
+
+	instance->viewLost = true;
+	return "";
+}
+
+// Waits up to timeout nanoseconds (see waitForPeerTimed) for the next
+// message in the ring this process consumes from and returns a pointer
+// to its payload inside the ring, or NULL on timeout. Padding records
+// are skipped. The space isn't handed back to the producer until 
+// ringReleaseMessage is called.
+MSG_API const void * ringRecvMessageView(struct MPIController * instance, int * code, int * length, int * type,
+	int64_t timeout) {
+	struct MPIRing * ring = instance->recvRing;
+	size_t capacity = instance->ringCapacity;
+
+	while (true) {
+		int status = waitForPeerTimed(instance, &instance->recvDirection->sent, &instance->stats->recv, timeout);
+
+		if (status == 1) {
+			return NULL;
+		} else if (status == -1) {
+			return controllerLost(instance, code, length, type);
+		}
+
+		// The post may have been for a priority message.
+		const void * priority = priorityView(instance, code, length, type);
+		if (priority != NULL) {
+			return priority;
+		}
+
+		uint64_t tail = ring->tail;
+		struct MPIRecord * record = (struct MPIRecord *)(ringData(ring) + (tail & (capacity - 1)));
+
+		if (record->flags == MSG_RECORD_PADDING) {
+			ringReleaseSpace(instance, tail + sizeof(struct MPIRecord) + record->length);
+			continue;
+		}
+
+		*code   = record->code;
+		*length = record->length;
+		*type   = record->type;
+
+		instance->viewRelease = tail + recordSize(*length);
+		return (char *)record + sizeof(struct MPIRecord);
+	}
+}
+
+MSG_API void ringReleaseMessage(struct MPIController * instance) {
+	ringReleaseSpace(instance, instance->viewRelease);
+}
+
+// Opens the shared memory of the instance and maps the header of the
+// control block, if the controller has published it. Returns 0 and 
+// sets header on success, 1 if the controller isn't done yet (or 
+// hasn't started) and -1 if the control block can never be used.
+MSG_API int openPublishedControlBlock(struct MPIController * instance, struct MPIControlBlock ** header) {
+	instance->fd = shm_open(instance->segmentName, O_RDWR, 0777);
+
+	if (instance->fd == -1) {
+		return 1;
+	}
+
+	// Touching a mapping past the end of the object would crash, so
+	// make sure the controller has at least sized it.
+	struct stat s;
+	if (fstat(instance->fd, &s) == -1 || (size_t)s.st_size < sizeof(struct MPIControlBlock)) {
+		close(instance->fd);
+		return 1;
+	}
+
+	struct MPIControlBlock * mapped = (struct MPIControlBlock *)mmap(NULL, sizeof(struct MPIControlBlock), 
+		PROT_READ, MAP_SHARED, instance->fd, 0);
+
+	if (mapped == (void *)-1) {
+		printf("mmap failed\n");
+		close(instance->fd);
+		return -1;
+	}
+
+	if (__atomic_load_n(&mapped->magic, __ATOMIC_ACQUIRE) != MSG_CONTROL_MAGIC) {
+		munmap(mapped, sizeof(struct MPIControlBlock));
+		close(instance->fd);
+		return 1;
+	}
+
+	if (mapped->version != MSG_CONTROL_VERSION) {
+		printf("%s was not created by a compatible controller\n", instance->segmentName);
+		munmap(mapped, sizeof(struct MPIControlBlock));
+		close(instance->fd);
+		return -1;
+	}
+
+	*header = mapped;
+	return 0;
+}
+
+// ----------------------------------------------
+// Capture
+// ----------------------------------------------
+// Every message a process sends and receives can be appended to a log
+// file, with the time it was sent or received, so that the traffic of
+// a real job can be played back later without running it (see 
+// mpi_replay.c). The file is mapped into memory and grows in 
+// MSG_CAPTURE_CHUNK steps, so capturing a message costs a copy of it 
+// and no system calls most of the time. Messages sent through the 
+// priority lane, and the data of streams, aren't captured.
+
+// Starts appending every message of the instance to the log at path,
+// which is replaced if it exists. Returns FALSE if it can't be created.
+// Only the process that calls this is captured, but that is both 
+// directions of the channel.
+MSG_API bool startCapture(struct MPIController * instance, const char * path) {
+	if (instance->capture != NULL) {
+		printf("the instance is already being captured\n");
+		return false;
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+	if (fd == -1) {
+		printf("could not create capture log %s\n", path);
+		return false;
+	}
+
+	if (ftruncate(fd, MSG_CAPTURE_CHUNK) == -1) {
+		printf("ftruncate failed for %s\n", path);
+		close(fd);
+		return false;
+	}
+
+	void * data = mmap(NULL, MSG_CAPTURE_CHUNK, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (data == (void *)-1) {
+		printf("mmap failed for %s\n", path);
+		close(fd);
+		return false;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	struct MPICaptureHeader * header = (struct MPICaptureHeader *)data;
+	header->magic       = MSG_CAPTURE_MAGIC;
+	header->version     = MSG_CAPTURE_VERSION;
+	header->channelMode = instance->channelMode;
+	header->controller  = instance->is_controller;
+	header->records     = 0;
+	header->length      = 0;
+	header->realtime    = now.tv_sec * 1000000000ull + now.tv_nsec;
+
+	struct MPICapture * capture = (struct MPICapture *)malloc(sizeof(struct MPICapture));
+	capture->fd    = fd;
+	capture->data  = (char *)data;
+	capture->size  = MSG_CAPTURE_CHUNK;
+	capture->start = monotonicNanoseconds();
+
+	instance->capture = capture;
+	return true;
+}
+
+// Stops capturing and trims the log to what was written.
+MSG_API void stopCapture(struct MPIController * instance) {
+	struct MPICapture * capture = instance->capture;
+
+	if (capture == NULL) {
+		return;
+	}
+
+	instance->capture = NULL;
+
+	struct MPICaptureHeader * header = (struct MPICaptureHeader *)capture->data;
+	size_t length = sizeof(struct MPICaptureHeader) + header->length;
+
+	munmap(capture->data, capture->size);
+
+	if (ftruncate(capture->fd, length) == -1) {
+		printf("could not trim the capture log\n");
+	}
+
+	close(capture->fd);
+	free(capture);
+}
+
+// Appends a record to the capture log of the instance, if it has one.
+MSG_API void captureMessage(struct MPIController * instance, int direction, int code, int length, int type, 
+	const void * data) {
+	struct MPICapture * capture = instance->capture;
+
+	if (capture == NULL) {
+		return;
+	}
+
+	struct MPICaptureHeader * header = (struct MPICaptureHeader *)capture->data;
+	size_t offset = sizeof(struct MPICaptureHeader) + header->length;
+	size_t size   = sizeof(struct MPICaptureRecord) + ((length + 7) & ~7);
+
+	if (offset + size > capture->size) {
+		size_t grown = capture->size + MSG_CAPTURE_CHUNK;
+		while (grown < offset + size) {
+			grown += MSG_CAPTURE_CHUNK;
+		}
+
+		void * data = (void *)-1;
+		if (ftruncate(capture->fd, grown) == 0) {
+			data = mremap(capture->data, capture->size, grown, MREMAP_MAYMOVE);
+		}
+
+		if (data == (void *)-1) {
+			printf("could not grow the capture log, capturing stopped\n");
+			stopCapture(instance);
+			return;
+		}
+
+		capture->data = (char *)data;
+		capture->size = grown;
+		header = (struct MPICaptureHeader *)data;
+	}
+
+	struct MPICaptureRecord * record = (struct MPICaptureRecord *)(capture->data + offset);
+	record->timestamp = monotonicNanoseconds() - capture->start;
+	record->direction = direction;
+	record->code      = code;
+	record->type      = type;
+	record->length    = length;
+	copyPayload(instance, record + 1, data, length);
+
+	header->length += size;
+	header->records++;
+}
+
+// Captures a message this process sent or received.
+MSG_API void captureSent(struct MPIController * instance, int code, int length, int type, const void * data) {
+	captureMessage(instance, instance->is_controller ? MSG_TO_CHILD : MSG_TO_CONTROLLER, 
+		code, length, type, data);
+}
+
+MSG_API void captureReceived(struct MPIController * instance, int code, int length, int type, const void * data) {
+	captureMessage(instance, instance->is_controller ? MSG_TO_CONTROLLER : MSG_TO_CHILD, 
+		code, length, type, data);
+}
+
+// The table of each backend is defined after its operations.
+MSG_API const struct MPITransport * sharedMemoryTransport(void);
+MSG_API const struct MPITransport * socketTransport(void);
+
+// Allocates an instance and fills in the members every kind of 
+// instance starts out with.
+MSG_API struct MPIController * allocateInstance(char * name, bool isController) {
+	struct MPIController * instance = (struct MPIController *)malloc(sizeof(struct MPIController));
+
+	snprintf(instance->nameStorage, MSG_MAX_NAME, "%s", name);
+
+	instance->is_controller = isController;
+	instance->system_name   = instance->nameStorage;
+	instance->sendPending     = false;
+	instance->deliveryPending = false;
+	instance->viewPending     = false;
+	instance->viewPriority    = false;
+	instance->viewHeld        = false;
+	instance->childPid      = -1;
+	instance->childStatus   = 0;
+	instance->childAttached = false;
+	instance->persistent    = false;
+	instance->sessionEpoch  = 0;
+	instance->viewLost      = false;
+	instance->peerLost      = false;
+	instance->messageFd     = -1;
+	instance->notifyFd      = -1;
+	instance->capture       = NULL;
+	instance->socket        = NULL;
+	instance->transport     = sharedMemoryTransport();
+	instance->copyThreshold = MSG_STREAMING_COPY_THRESHOLD;
+
+	return instance;
+}
+
+// ----------------------------------------------
+// Sockets
+// ----------------------------------------------
+// Shared memory only reaches a rank 0 on the controller's own node. An
+// instance whose name is tcp://host:port talks to its peer over TCP
+// instead, with the same calls: the controller listens on host:port,
+// and the child connects to it. Streams, the priority lane and shared
+// arrays need shared memory and aren't available on a socket. Sends 
+// don't wait for the receiver, as in ring mode. When the connection 
+// closes, receives return an empty MSG_TYPE_DETACH message.
+//
+// Every message is a struct MPISocketHeader followed by the payload,
+// padded to a multiple of eight bytes so that payloads received into 
+// the read-ahead buffer stay aligned. Headers are in network byte 
+// order; payloads are passed on as they are.
+
+// Returns TRUE if the instance with this name uses a socket.
+MSG_API bool isSocketName(const char * name) {
+	return strncmp(name, MSG_SOCKET_PREFIX, strlen(MSG_SOCKET_PREFIX)) == 0;
+}
+
+// Splits tcp://host:port. An empty host or * means any address.
+MSG_API bool parseSocketName(const char * name, char * host, char * port) {
+	const char * address = name + strlen(MSG_SOCKET_PREFIX);
+	const char * colon   = strrchr(address, ':');
+
+	if (colon == NULL || colon[1] == '\0' || colon - address >= MSG_MAX_NAME) {
+		printf("%s is not of the form tcp://host:port\n", name);
+		return false;
+	}
+
+	snprintf(host, MSG_MAX_NAME, "%.*s", (int)(colon - address), address);
+	snprintf(port, MSG_MAX_NAME, "%s", colon + 1);
+
+	if (strcmp(host, "*") == 0) {
+		host[0] = '\0';
+	}
+
+	return true;
+}
+
+// Sets up what a socket instance has instead of a control block. 
+// There's nothing to publish its statistics in, so they go to 
+// private memory.
+MSG_API struct MPISocket * createSocketState(struct MPIController * instance) {
+	struct MPISocket * connection = (struct MPISocket *)calloc(1, sizeof(struct MPISocket));
+	connection->fd       = -1;
+	connection->listenFd = -1;
+
+	instance->socket      = connection;
+	instance->transport   = socketTransport();
+	instance->channelMode = MSG_CHANNEL_SOCKET;
+	instance->fd          = -1;
+	instance->control     = NULL;
+
+	instance->statsBlock = (struct MPIStatsBlock *)calloc(1, sizeof(struct MPIStatsBlock));
+	instance->timing     = false;
+	instance->stats      = &instance->statsBlock->process[instance->is_controller ? 
+		MSG_STATS_CONTROLLER : MSG_STATS_CHILD];
+	instance->stats->pid = getpid();
+
+	instance->waitStrategy = MSG_WAIT_BLOCK;
+	instance->spinCount    = MSG_DEFAULT_SPIN_COUNT;
+
+	return connection;
+}
+
+// Turns the options the controller passed in hello into settings of
+// the connection.
+MSG_API void configureSocket(struct MPISocket * connection, uint32_t flags, size_t receiveBuffer, size_t maxMessage) {
+	int noDelay = (flags & MSG_SOCKET_NO_DELAY) != 0;
+	setsockopt(connection->fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+	connection->coalesce    = (flags & MSG_SOCKET_COALESCE) != 0;
+	connection->maxMessage  = maxMessage;
+	connection->readAhead   = receiveBuffer;
+	connection->inCapacity  = receiveBuffer > 0 ? receiveBuffer : MSG_SOCKET_MIN_BUFFER;
+	connection->in          = (char *)malloc(connection->inCapacity);
+	connection->outCapacity = MSG_SOCKET_COALESCE_BYTES;
+	connection->out         = (char *)malloc(connection->outCapacity);
+}
+
+// Writes everything described by iov, however many calls it takes.
+// Returns FALSE if the connection is gone.
+MSG_API bool writeSocket(int fd, struct iovec * iov, int iovcnt) {
+	while (iovcnt > 0) {
+		ssize_t written = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+
+		if (written == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+
+		// Skip what has been written, which may end halfway through a
+		// fragment.
+		while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return true;
+}
+
+// Reads exactly length bytes, waiting up to timeout milliseconds for
+// them to start arriving. Only used while connecting.
+MSG_API bool readSocketExactly(int fd, void * buffer, size_t length, int timeout) {
+	struct pollfd descriptor = { fd, POLLIN, 0 };
+
+	while (length > 0) {
+		if (poll(&descriptor, 1, timeout) != 1) {
+			return false;
+		}
+
+		ssize_t received = recv(fd, buffer, length, 0);
+		if (received <= 0) {
+			return false;
+		}
+
+		buffer = (char *)buffer + received;
+		length -= received;
+	}
+
+	return true;
+}
+
+// Writes out the messages that coalescing has held back. Called 
+// before every receive, since the peer may be waiting for them.
+MSG_API void flushMessages(struct MPIController * instance) {
+	struct MPISocket * connection = instance->socket;
+
+	if (connection == NULL || connection->outLength == 0) {
+		return;
+	}
+
+	struct iovec iov = { connection->out, connection->outLength };
+	if (!writeSocket(connection->fd, &iov, 1)) {
+		instance->peerLost = true;
+	}
+
+	connection->outLength = 0;
+}
+
+// Fills in the header of a message in the byte order used on the wire.
+MSG_API void encodeSocketHeader(struct MPISocketHeader * header, int code, int length, int type) {
+	header->code   = htonl((uint32_t)code);
+	header->length = htonl((uint32_t)length);
+	header->type   = htonl((uint32_t)type);
+	header->pad    = 0;
+}
+
+MSG_API size_t socketPadding(size_t length) {
+	return ((length + 7) & ~(size_t)7) - length;
+}
+
+// Makes room for size more bytes in the coalescing buffer, writing 
+// out what's in it first if it would overflow.
+MSG_API char * reserveSocketOutput(struct MPIController * instance, size_t size) {
+	struct MPISocket * connection = instance->socket;
+
+	if (connection->outLength + size > connection->outCapacity) {
+		flushMessages(instance);
+
+		if (size > connection->outCapacity) {
+			connection->outCapacity = size;
+			connection->out = (char *)realloc(connection->out, size);
+		}
+	}
+
+	char * buffer = connection->out + connection->outLength;
+	connection->outLength += size;
+	return buffer;
+}
+
+// Sends one message gathered from iov. Unless the connection coalesces
+// small messages, header, payload and padding go out with a single
+// writev.
+MSG_API void socketSendv(struct MPIController * instance, const struct iovec * iov, int iovcnt, int code, int type) {
+	struct MPISocket * connection = instance->socket;
+
+	size_t length = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		length += iov[i].iov_len;
+	}
+
+	if (length > connection->maxMessage) {
+		printf("message of %zu bytes is larger than socketMaxMessage\n", length);
+		return;
+	}
+
+	countMessage(&instance->stats->send, length);
+
+	if (instance->capture != NULL) {
+		// Captures need the message in one piece.
+		char * message = (char *)malloc(length);
+		char * position = message;
+		for (int i = 0; i < iovcnt; ++i) {
+			memcpy(position, iov[i].iov_base, iov[i].iov_len);
+			position += iov[i].iov_len;
+		}
+		captureSent(instance, code, length, type, message);
+		free(message);
+	}
+
+	if (instance->peerLost) {
+		return;
+	}
+
+	size_t padding = socketPadding(length);
+	size_t size    = sizeof(struct MPISocketHeader) + length + padding;
+
+	if (connection->coalesce && size <= MSG_SOCKET_COALESCE_BYTES / 2) {
+		char * buffer = reserveSocketOutput(instance, size);
+		encodeSocketHeader((struct MPISocketHeader *)buffer, code, length, type);
+		buffer += sizeof(struct MPISocketHeader);
+
+		for (int i = 0; i < iovcnt; ++i) {
+			memcpy(buffer, iov[i].iov_base, iov[i].iov_len);
+			buffer += iov[i].iov_len;
+		}
+		memset(buffer, 0, padding);
+
+		if (connection->outLength >= MSG_SOCKET_COALESCE_BYTES / 2) {
+			flushMessages(instance);
+		}
+		return;
+	}
+
+	// Held back messages have to go first.
+	flushMessages(instance);
+
+	static const char zeros[8] = { 0 };
+	struct MPISocketHeader header;
+	encodeSocketHeader(&header, code, length, type);
+
+	struct iovec * parts = (struct iovec *)malloc((iovcnt + 2) * sizeof(struct iovec));
+	parts[0].iov_base = &header;
+	parts[0].iov_len  = sizeof(header);
+	memcpy(parts + 1, iov, iovcnt * sizeof(struct iovec));
+	parts[iovcnt + 1].iov_base = (void *)zeros;
+	parts[iovcnt + 1].iov_len  = padding;
+
+	if (!writeSocket(connection->fd, parts, iovcnt + 2)) {
+		instance->peerLost = true;
+	}
+
+	free(parts);
+}
+
+// Sends a batch of messages with as few writev calls as possible.
+MSG_API void socketSendBatch(struct MPIController * instance, struct MPIMessage * messages, int count) {
+	struct MPISocket * connection = instance->socket;
+
+	if (connection->coalesce) {
+		for (int i = 0; i < count; ++i) {
+			struct iovec iov = { messages[i].data, (size_t)messages[i].length };
+			socketSendv(instance, &iov, 1, messages[i].code, messages[i].type);
+		}
+		return;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		if ((size_t)messages[i].length > connection->maxMessage) {
+			printf("message of %d bytes is larger than socketMaxMessage\n", messages[i].length);
+			return;
+		}
+	}
+
+	static const char zeros[8] = { 0 };
+	struct MPISocketHeader * headers = (struct MPISocketHeader *)malloc(count * sizeof(struct MPISocketHeader));
+	struct iovec * parts = (struct iovec *)malloc(3 * count * sizeof(struct iovec));
+	int used = 0;
+
+	for (int i = 0; i < count; ++i) {
+		encodeSocketHeader(&headers[i], messages[i].code, messages[i].length, messages[i].type);
+		countMessage(&instance->stats->send, messages[i].length);
+		captureSent(instance, messages[i].code, messages[i].length, messages[i].type, messages[i].data);
+
+		parts[used].iov_base = &headers[i];
+		parts[used].iov_len  = sizeof(struct MPISocketHeader);
+		++used;
+
+		if (messages[i].length > 0) {
+			parts[used].iov_base = messages[i].data;
+			parts[used].iov_len  = messages[i].length;
+			++used;
+		}
+
+		size_t padding = socketPadding(messages[i].length);
+		if (padding > 0) {
+			parts[used].iov_base = (void *)zeros;
+			parts[used].iov_len  = padding;
+			++used;
+		}
+	}
+
+	flushMessages(instance);
+	if (!instance->peerLost && !writeSocket(connection->fd, parts, used)) {
+		instance->peerLost = true;
+	}
+
+	free(parts);
+	free(headers);
+}
+
+// Makes sure at least minimum bytes are in the receive buffer, waiting
+// up to timeout nanoseconds (forever if negative) for them. Reads as
+// much as fits when read-ahead is on. Returns 0 once they're there, 1
+// on timeout and -1 if the connection is gone.
+MSG_API int fillSocket(struct MPIController * instance, size_t minimum, int64_t timeout) {
+	struct MPISocket * connection = instance->socket;
+	uint64_t deadline = timeout > 0 ? monotonicNanoseconds() + timeout : 0;
+
+	// Move what's left to the front, and grow the buffer if the message
+	// doesn't fit at all.
+	if (connection->inStart + minimum > connection->inCapacity) {
+		memmove(connection->in, connection->in + connection->inStart, connection->inEnd - connection->inStart);
+		connection->inEnd  -= connection->inStart;
+		connection->inStart = 0;
+
+		if (minimum > connection->inCapacity) {
+			connection->inCapacity = minimum;
+			connection->in = (char *)realloc(connection->in, minimum);
+		}
+	}
+
+	while (connection->inEnd - connection->inStart < minimum) {
+		int wait = -1;
+		if (timeout >= 0) {
+			uint64_t now = monotonicNanoseconds();
+			wait = timeout == 0 || now >= deadline ? 0 : (int)((deadline - now + 999999) / 1000000);
+		}
+
+		struct pollfd descriptor = { connection->fd, POLLIN, 0 };
+		int ready = poll(&descriptor, 1, wait);
+
+		if (ready == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ready == 0) {
+			return 1;
+		}
+
+		size_t wanted = connection->readAhead > 0 ? connection->inCapacity - connection->inEnd : 
+			connection->inStart + minimum - connection->inEnd;
+		ssize_t received = recv(connection->fd, connection->in + connection->inEnd, wanted, 0);
+
+		if (received == -1 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		}
+		if (received <= 0) {
+			return -1;
+		}
+
+		connection->inEnd += received;
+	}
+
+	return 0;
+}
+
+// Waits up to timeout nanoseconds for the next message on the socket
+// and returns a view of it in the receive buffer, or NULL on timeout.
+MSG_API const void * socketRecvView(struct MPIController * instance, int * code, int * length, int * type, 
+	int64_t timeout) {
+	struct MPISocket * connection = instance->socket;
+
+	if (connection->coalesce) {
+		flushMessages(instance);
+	}
+
+	if (instance->peerLost) {
+		return controllerLost(instance, code, length, type);
+	}
+
+	int status = fillSocket(instance, sizeof(struct MPISocketHeader), timeout);
+
+	if (status == 0) {
+		struct MPISocketHeader * header = (struct MPISocketHeader *)(connection->in + connection->inStart);
+		uint32_t announced = ntohl(header->length);
+
+		// Nothing after this can be trusted.
+		if (announced > connection->maxMessage) {
+			printf("the peer of %s announced a message of %u bytes\n", instance->system_name, announced);
+			instance->peerLost = true;
+			return controllerLost(instance, code, length, type);
+		}
+
+		size_t size = sizeof(struct MPISocketHeader) + announced;
+		size += socketPadding(size);
+
+		// A message that is already partly here is worth waiting for.
+		status = fillSocket(instance, size, timeout);
+	}
+
+	if (status == 1) {
+		return NULL;
+	} else if (status == -1) {
+		instance->peerLost = true;
+		return controllerLost(instance, code, length, type);
+	}
+
+	struct MPISocketHeader * header = (struct MPISocketHeader *)(connection->in + connection->inStart);
+	*code   = (int32_t)ntohl(header->code);
+	*length = (int32_t)ntohl(header->length);
+	*type   = (int32_t)ntohl(header->type);
+
+	connection->viewLength = sizeof(struct MPISocketHeader) + *length + socketPadding(*length);
+	countMessage(&instance->stats->recv, *length);
+
+	return header + 1;
+}
+
+// Drops the message returned by socketRecvView from the buffer.
+MSG_API void socketReleaseMessage(struct MPIController * instance) {
+	struct MPISocket * connection = instance->socket;
+
+	connection->inStart += connection->viewLength;
+	if (connection->inStart == connection->inEnd) {
+		connection->inStart = 0;
+		connection->inEnd   = 0;
+	}
+}
+
+// Closes the connection of a socket instance and frees its buffers.
+MSG_API void closeSocket(struct MPIController * instance) {
+	struct MPISocket * connection = instance->socket;
+
+	flushMessages(instance);
+
+	if (connection->fd != -1) {
+		close(connection->fd);
+	}
+	if (connection->listenFd != -1) {
+		close(connection->listenFd);
+	}
+
+	free(connection->in);
+	free(connection->out);
+	free(connection);
+	free(instance->statsBlock);
+
+	instance->socket = NULL;
+}
+
+// Closes the connection. Neither end owns anything else, so this is
+// how a socket instance is destroyed too.
+MSG_API void socketClose(struct MPIController * instance) {
+	stopCapture(instance);
+	closeSocket(instance);
+}
+
+// The message is built in the coalescing buffer, after room for its 
+// header.
+MSG_API void * socketAcquireSendBuffer(struct MPIController * instance, int length) {
+	if ((size_t)length > instance->socket->maxMessage) {
+		printf("message of %d bytes is larger than socketMaxMessage\n", length);
+		return NULL;
+	}
+
+	size_t size = sizeof(struct MPISocketHeader) + length + socketPadding(length);
+	return reserveSocketOutput(instance, size) + sizeof(struct MPISocketHeader);
+}
+
+// Fills in the header in front of the message and sends it, unless
+// it can wait in the coalescing buffer for more.
+MSG_API void socketPostSend(struct MPIController * instance, int code, int type) {
+	struct MPISocket * connection = instance->socket;
+	char * buffer = (char *)instance->sendBuffer;
+	encodeSocketHeader((struct MPISocketHeader *)buffer - 1, code, instance->sendLength, type);
+	memset(buffer + instance->sendLength, 0, socketPadding(instance->sendLength));
+
+	if (!connection->coalesce || connection->outLength >= MSG_SOCKET_COALESCE_BYTES / 2) {
+		flushMessages(instance);
+	}
+}
+
+// Sends never wait for the receiver.
+MSG_API bool socketCanSend(struct MPIController * instance, int length) {
+	(void)instance;
+	(void)length;
+	return true;
+}
+
+// A socket is readable when a message comes in anyway.
+MSG_API int socketMessageFd(struct MPIController * instance) {
+	return instance->socket->fd;
+}
+
+// Called by the controller. Starts listening on the address in the 
+// name of the instance. The child connects in waitForChild.
+MSG_API bool listenSocket(struct MPIController * instance, struct MPIControllerOptions * options) {
+	struct MPIControllerOptions defaults;
+	if (options == NULL) {
+		initControllerOptions(&defaults);
+		options = &defaults;
+	}
+
+	struct MPISocket * connection = createSocketState(instance);
+	connection->flags         = (options->socketNoDelay ? MSG_SOCKET_NO_DELAY : 0) | 
+	                        (options->socketCoalesce ? MSG_SOCKET_COALESCE : 0);
+	connection->receiveBuffer = options->socketReceiveBuffer;
+	connection->maxMessage    = options->socketMaxMessage > INT_MAX ? INT_MAX : options->socketMaxMessage;
+
+	char host[MSG_MAX_NAME];
+	char port[MSG_MAX_NAME];
+	if (!parseSocketName(instance->system_name, host, port)) {
+		return false;
+	}
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags    = AI_PASSIVE;
+
+	struct addrinfo * addresses;
+	if (getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &addresses) != 0) {
+		printf("could not resolve %s\n", instance->system_name);
+		return false;
+	}
+
+	for (struct addrinfo * address = addresses; address != NULL; address = address->ai_next) {
+		int fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+		if (fd == -1) {
+			continue;
+		}
+
+		int reuse = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+		if (bind(fd, address->ai_addr, address->ai_addrlen) == 0 && listen(fd, 1) == 0) {
+			connection->listenFd = fd;
+			break;
+		}
+
+		close(fd);
+	}
+
+	freeaddrinfo(addresses);
+
+	if (connection->listenFd == -1) {
+		printf("could not listen on %s\n", instance->system_name);
+		return false;
+	}
+
+	if (options->capture != NULL) {
+		startCapture(instance, options->capture);
+	}
+
+	return true;
+}
+
+// Called by waitForChild. Waits up to timeout nanoseconds for the 
+// child to connect and shakes hands with it, for MSG_ATTACH_TIMEOUT_MS
+// at most but not past deadline. Returns TRUE once it has.
+MSG_API bool acceptSocketChild(struct MPIController * instance, uint64_t timeout, uint64_t deadline) {
+	struct MPISocket * connection = instance->socket;
+	struct pollfd descriptor = { connection->listenFd, POLLIN, 0 };
+
+	if (poll(&descriptor, 1, (int)((timeout + 999999) / 1000000)) != 1) {
+		return false;
+	}
+
+	int fd = accept4(connection->listenFd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+
+	// The controller decides how both ends of the connection behave.
+	struct MPISocketHello hello;
+	hello.magic         = htonl(MSG_SOCKET_MAGIC);
+	hello.version       = htonl(MSG_SOCKET_VERSION);
+	hello.flags         = htonl(connection->flags);
+	hello.receiveBuffer = htonl((uint32_t)connection->receiveBuffer);
+	hello.maxMessage    = htonl((uint32_t)connection->maxMessage);
+	hello.pad           = 0;
+
+	struct MPISocketHello reply;
+	struct iovec iov = { &hello, sizeof(hello) };
+
+	// A child that has connected gets at least a millisecond to reply.
+	int handshake = MSG_ATTACH_TIMEOUT_MS;
+	uint64_t now  = monotonicNanoseconds();
+	if (deadline != UINT64_MAX) {
+		uint64_t left = deadline > now ? (deadline - now + 999999) / 1000000 : 1;
+		if (left < (uint64_t)handshake) {
+			handshake = (int)left;
+		}
+	}
+
+	if (!writeSocket(fd, &iov, 1) || !readSocketExactly(fd, &reply, sizeof(reply), handshake) ||
+		ntohl(reply.magic) != MSG_SOCKET_MAGIC || ntohl(reply.version) != MSG_SOCKET_VERSION) {
+		printf("a peer connected to %s but didn't complete the handshake\n", instance->system_name);
+		close(fd);
+		return false;
+	}
+
+	close(connection->listenFd);
+	connection->listenFd = -1;
+	connection->fd       = fd;
+	configureSocket(connection, connection->flags, connection->receiveBuffer, connection->maxMessage);
+
+	return true;
+}
+
+// Called by createChildInstance for a socket name. Connects to the 
+// controller, retrying for up to MSG_ATTACH_TIMEOUT_MS since it may 
+// not be listening yet.
+MSG_API struct MPIController * connectSocketChild(char * name) {
+	struct MPIController * instance = allocateInstance(name, false);
+	struct MPISocket * connection = createSocketState(instance);
+
+	char host[MSG_MAX_NAME];
+	char port[MSG_MAX_NAME];
+	if (!parseSocketName(name, host, port)) {
+		closeSocket(instance);
+		free(instance);
+		return NULL;
+	}
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	for (int waited = 0; connection->fd == -1 && waited < MSG_ATTACH_TIMEOUT_MS; waited += 10) {
+		struct addrinfo * addresses;
+		if (getaddrinfo(host[0] != '\0' ? host : "localhost", port, &hints, &addresses) == 0) {
+			for (struct addrinfo * address = addresses; address != NULL; address = address->ai_next) {
+				int fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+				if (fd == -1) {
+					continue;
+				}
+
+				if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+					connection->fd = fd;
+					break;
+				}
+
+				close(fd);
+			}
+			freeaddrinfo(addresses);
+		}
+
+		if (connection->fd == -1) {
+			usleep(10000);
+		}
+	}
+
+	struct MPISocketHello hello;
+
+	if (connection->fd == -1 || !readSocketExactly(connection->fd, &hello, sizeof(hello), MSG_ATTACH_TIMEOUT_MS) ||
+		ntohl(hello.magic) != MSG_SOCKET_MAGIC || ntohl(hello.version) != MSG_SOCKET_VERSION) {
+		printf("could not connect to %s\n", name);
+		closeSocket(instance);
+		free(instance);
+		return NULL;
+	}
+
+	struct iovec iov = { &hello, sizeof(hello) };
+	if (!writeSocket(connection->fd, &iov, 1)) {
+		printf("could not connect to %s\n", name);
+		closeSocket(instance);
+		free(instance);
+		return NULL;
+	}
+
+	configureSocket(connection, ntohl(hello.flags), ntohl(hello.receiveBuffer), ntohl(hello.maxMessage));
+	return instance;
+}
+
+// The socket backend. Destroying and closing are the same.
+MSG_API const struct MPITransport * socketTransport(void) {
+	static const struct MPITransport transport = {
+		socketAcquireSendBuffer,
+		socketPostSend,
+		socketCanSend,
+		socketSendv,
+		socketSendBatch,
+		socketRecvView,
+		socketReleaseMessage,
+		socketMessageFd,
+		acceptSocketChild,
+		socketClose,
+		socketClose,
+		false
+	};
+
+	return &transport;
+}
+
+// Creates the shared memory of a new instance, lays out the control 
+// block in it and publishes it. Called by the controller, or by the
+// child of a persistent world, which owns the shared memory instead.
+// Returns FALSE if the shared memory couldn't be set up, in which case
+// nothing is left behind.
+MSG_API bool createControlSegment(struct MPIController * instance, struct MPIControllerOptions * options, 
+	bool persistent) {
+	struct MPIControllerOptions defaults;
+	if (options == NULL) {
+		initControllerOptions(&defaults);
+		options = &defaults;
+	}
+
+	// Work out where everything goes. The rings (if any) follow the 
+	// header and the payload area starts on the next page boundary, 
+	// since it's mapped separately. Ring capacities have to be a 
+	// power of two.
+	size_t ringCapacity = sizeof(struct MPIRecord);
+	while (ringCapacity < options->ringCapacity) {
+		ringCapacity *= 2;
+	}
+
+	size_t ringOffset = sizeof(struct MPIControlBlock);
+	size_t ringsEnd   = ringOffset;
+	if (options->channelMode == MSG_CHANNEL_RING) {
+		ringsEnd += 2 * (sizeof(struct MPIRing) + ringCapacity);
+	}
+
+	size_t pageSize    = sysconf(_SC_PAGESIZE);
+	size_t controlSize = ((ringsEnd + pageSize - 1) / pageSize) * pageSize;
+
+	// Place this process before anything is touched, so that 
+	// MSG_NUMA_LOCAL means the node it will run on.
+	int ownCpu = persistent ? options->childCpu : options->controllerCpu;
+	if (ownCpu >= 0) {
+		pinToCpu(ownCpu);
+	}
+
+	int numaNode = options->numaNode;
+	if (numaNode == MSG_NUMA_LOCAL) {
+		int cpu;
+		currentCpu(&cpu, &numaNode);
+	}
+
+	// Remove anything left behind by an earlier run with the same 
+	// name, so that we always start out with zeroed memory. The caller
+	// has already worked out the name of the segment.
+	shm_unlink(instance->segmentName);
+
+	instance->fd = shm_open(instance->segmentName, O_RDWR | O_CREAT | O_EXCL, 0777);
+
+	if (instance->fd == -1) {
+		printf("shm_open failed for %s\n", instance->segmentName);
+		return false;
+	}
+
+	// Size both payload areas once up front. They will only be
+	// resized again if a message larger than this is sent.
+	size_t segmentSize = controlSize + 2 * MSG_INITIAL_CAPACITY;
+	if (ftruncate(instance->fd, segmentSize) == -1) {
+		printf("ftruncate failed\n");
+		close(instance->fd);
+		shm_unlink(instance->segmentName);
+		return false;
+	}
+
+	instance->controlSize = controlSize;
+	instance->control     = (struct MPIControlBlock *)mmap(NULL, controlSize, PROT_READ | PROT_WRITE, MAP_SHARED, instance->fd, 0);
+
+	if (instance->control == (void *)-1) {
+		printf("mmap failed\n");
+		close(instance->fd);
+		shm_unlink(instance->segmentName);
+		return false;
+	}
+
+	struct MPIControlBlock * control = instance->control;
+	control->version      = MSG_CONTROL_VERSION;
+	control->channelMode  = options->channelMode;
+	control->controlSize  = controlSize;
+	control->segmentSize  = segmentSize;
+	control->ringOffset   = ringOffset;
+	control->ringCapacity = ringCapacity;
+
+	control->streamSlots    = options->streamSlots < 2 ? 2 : options->streamSlots;
+	control->streamSlotSize = ((options->streamSlotSize + MSG_CACHE_LINE - 1) / MSG_CACHE_LINE) * MSG_CACHE_LINE;
+	control->statistics     = options->statistics;
+	control->persistent     = persistent;
+
+	control->numaNode      = numaNode < 0 ? MSG_NUMA_ANY : numaNode;
+	control->controllerCpu = options->controllerCpu;
+	control->childCpu      = options->childCpu;
+	control->placement     = (options->pinToNode ? MSG_PLACE_PIN_NODE : 0) |
+	                         (options->prefault ? MSG_PLACE_PREFAULT : 0) |
+	                         (options->hugePages ? MSG_PLACE_HUGE_PAGES : 0);
+
+	for (int i = 0; i < 2; ++i) {
+		control->direction[i].generation      = 1;
+		control->direction[i].payloadOffset   = controlSize + i * MSG_INITIAL_CAPACITY;
+		control->direction[i].payloadCapacity = MSG_INITIAL_CAPACITY;
+		control->priority[i].free.count       = MSG_PRIORITY_SLOTS;
+	}
+
+	bindControlBlock(instance);
+	attachStats(instance);
+
+	if (options->capture != NULL) {
+		startCapture(instance, options->capture);
+	}
+
+	// Publish the control block. The child won't touch anything 
+	// until it sees this.
+	__atomic_store_n(&control->magic, MSG_CONTROL_MAGIC, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+// Maps all of the control block, given the header that 
+// openPublishedControlBlock mapped, which is unmapped.
+MSG_API void mapControlBlock(struct MPIController * instance, struct MPIControlBlock * header) {
+	instance->controlSize = header->controlSize;
+	munmap(header, sizeof(struct MPIControlBlock));
+
+	instance->control = (struct MPIControlBlock *)mmap(NULL, instance->controlSize, PROT_READ | PROT_WRITE, 
+		MAP_SHARED, instance->fd, 0);
+
+	if (instance->control == (void *)-1) {
+		printf("mmap failed\n");
+	}
+}
+
+// ----------------------------------------------
+// Initialization functions
+// ----------------------------------------------
+// These two functions need to be called in the 
+// controller application and the Rank0 thread
+// of the MPI world.
+// CreateControllerInstance will call MPIEXEC with 
+// specified arguments. At this point
+// the Rank0 process should call createChildInstance.
+// Once called, it will be able to access
+// the shared memory for communication and the
+// semphores for synchronization. 
+
+
+// Splits arguments into words the way a shell would for simple
+// command lines: on spaces and tabs, with single or double quotes
+// grouping words that contain spaces. Nothing else is interpreted (no
+// variables, redirections or escapes). The words are written into 
+// buffer, which has to be at least as long as arguments, and pointers
+// to them into argv, after prefix. Returns the number of entries in 
+// argv, which is NULL terminated, or -1 if there are too many.
+MSG_API int splitArguments(const char * arguments, char * buffer, char ** argv, int prefix) {
+	int count = prefix;
+	char * out = buffer;
+
+	while (*arguments != '\0') {
+		while (*arguments == ' ' || *arguments == '\t') {
+			arguments++;
+		}
+
+		if (*arguments == '\0') {
+			break;
+		}
+
+		if (count >= MSG_MAX_ARGUMENTS - 1) {
+			return -1;
+		}
+
+		argv[count++] = out;
+
+		char quote = 0;
+		while (*arguments != '\0' && (quote != 0 || (*arguments != ' ' && *arguments != '\t'))) {
+			if (quote == 0 && (*arguments == '\'' || *arguments == '"')) {
+				quote = *arguments;
+			} else if (quote != 0 && *arguments == quote) {
+				quote = 0;
+			} else {
+				*out++ = *arguments;
+			}
+			arguments++;
+		}
+
+		*out++ = '\0';
+	}
+
+	argv[count] = NULL;
+	return count;
+}
+
+// Defined at the end of this file. Used to clean up after a failed start.
+MSG_API void destroyInstance(struct MPIController * instance);
+MSG_API void detachInstance(struct MPIController * instance);
+
+// Starts mpirun with the given arguments and environment without 
+// going through a shell. Returns its PID, or -1 if it couldn't be 
+// started.
+MSG_API pid_t spawnMPIRun(char * MPIArguments, char ** environment) {
+	if (strlen(MPIArguments) >= MSG_MAX_ARGUMENTS_LENGTH) {
+		printf("mpirun arguments are too long\n");
+		return -1;
+	}
+
+	char buffer[MSG_MAX_ARGUMENTS_LENGTH];
+	char * argv[MSG_MAX_ARGUMENTS];
+	argv[0] = (char *)"mpirun";
+
+	if (splitArguments(MPIArguments, buffer, argv, 1) == -1) {
+		printf("too many mpirun arguments\n");
+		return -1;
+	}
+
+	pid_t pid;
+	int error = posix_spawnp(&pid, "mpirun", NULL, NULL, argv, environment);
+
+	if (error != 0) {
+		printf("could not start mpirun: %s\n", strerror(error));
+		return -1;
+	}
+
+	return pid;
+}
+
+// Called in the controlling program (the one not started with MPIEXEC).
+// Sets up the shared memory, starts an MPI world as a child process 
+// using MPIEXEC and returns right away, without waiting for the child
+// to call createChildInstance. Call waitForChild before using the
+// instance. This makes it possible to start many worlds in parallel.
+// Returns NULL if mpirun couldn't be started.
+// 
+// parameters:
+//     - name: user defined unique string
+//             must be the same in both the controller and child processes
+//
+//     - MPIArguments: arguments to pass to MPIEXEC. They are split into
+//                     words on whitespace (quotes group words), and
+//                     are not passed through a shell. NULL to not start
+//                     anything, when the child is started some other
+//                     way (for example with fork, or by hand).
+//
+//     - options: see struct MPIControllerOptions. NULL for defaults.
+MSG_API struct MPIController * createControllerInstanceAsync(char * name, char * MPIArguments, 
+	struct MPIControllerOptions * options) {
+	// We need to do the following:
+	//     1) create and instance of MPIController
+	//     2) create the shared memory and lay out the control block
+	//     3) call MPIEXEC
+
+	struct MPIController * instance = allocateInstance(name, true);
+
+	if (!isSocketName(name)) {
+		if (!getControlSegmentName(instance->segmentName, name) || 
+			!createControlSegment(instance, options, false)) {
+			free(instance);
+			return NULL;
+		}
+	} else if (!listenSocket(instance, options)) {
+		closeSocket(instance);
+		free(instance);
+		return NULL;
+	}
+
+	// now that everything is in place, we can call MPIEXEC.
+	if (MPIArguments != NULL) {
+		extern char ** environ;
+		instance->childPid = spawnMPIRun(MPIArguments, environ);
+
+		if (instance->childPid == -1) {
+			destroyInstance(instance);
+			return NULL;
+		}
+	}
+
+	return instance;
+}
+
+// Reaps mpirun if it has exited. Returns TRUE if it's still running, 
+// FALSE if it has exited (see childStatus) or was never started.
+MSG_API bool isChildRunning(struct MPIController * instance) {
+	if (instance->childPid == -1) {
+		return false;
+	}
+
+	if (waitpid(instance->childPid, &instance->childStatus, WNOHANG) == instance->childPid) {
+		instance->childPid = -1;
+		return false;
+	}
+
+	return true;
+}
+
+// Waits up to timeout nanoseconds for the child to attach to the 
+// shared memory. Returns TRUE once it has. Nothing follows, so the 
+// deadline doesn't matter.
+MSG_API bool shmAcceptChild(struct MPIController * instance, uint64_t timeout, uint64_t deadline) {
+	(void)deadline;
+	return waitSemaphoreTimed(&instance->control->childAttached, instance->waitStrategy, 
+		instance->spinCount, timeout);
+}
+
+// Waits up to timeout milliseconds (forever if negative) for the child
+// started by createControllerInstanceAsync to call createChildInstance.
+// Returns MSG_ATTACH_OK once it has, MSG_ATTACH_TIMEOUT if it hasn't
+// yet and MSG_ATTACH_FAILED if mpirun exited without the child ever
+// attaching. mpirun is checked every few milliseconds, so a world that
+// fails to start is noticed right away instead of after the timeout.
+MSG_API int waitForChild(struct MPIController * instance, int timeout) {
+	if (instance->childAttached) {
+		return MSG_ATTACH_OK;
+	}
+
+	bool started = instance->childPid != -1;
+	uint64_t deadline = monotonicNanoseconds() + (uint64_t)timeout * 1000000ull;
+	uint64_t limit    = timeout < 0 ? UINT64_MAX : deadline;
+
+	while (true) {
+		uint64_t slice = 10000000ull;
+
+		if (timeout >= 0) {
+			uint64_t now = monotonicNanoseconds();
+			if (now >= deadline) {
+				slice = 0;
+			} else if (deadline - now < slice) {
+				slice = deadline - now;
+			}
+		}
+
+		bool attached = instance->transport->acceptChild(instance, slice, limit);
+
+		if (attached) {
+			instance->childAttached = true;
+			return MSG_ATTACH_OK;
+		}
+
+		// The child may attach right before mpirun exits, so only give
+		// up after looking at the semaphore one more time.
+		if (started && !isChildRunning(instance)) {
+			if (instance->transport->acceptChild(instance, 0, limit)) {
+				instance->childAttached = true;
+				return MSG_ATTACH_OK;
+			}
+
+			printf("mpirun exited before the child attached\n");
+			return MSG_ATTACH_FAILED;
+		}
+
+		if (slice == 0) {
+			return MSG_ATTACH_TIMEOUT;
+		}
+	}
+}
+
+// Same as createControllerInstanceAsync, but waits for the child to
+// attach before returning. Returns NULL if mpirun couldn't be started
+// or exited before the child attached.
+MSG_API struct MPIController * createControllerInstanceWithOptions(char * name, char * MPIArguments, 
+	struct MPIControllerOptions * options) {
+	struct MPIController * instance = createControllerInstanceAsync(name, MPIArguments, options);
+
+	if (instance == NULL) {
+		return NULL;
+	}
+
+	if (waitForChild(instance, -1) != MSG_ATTACH_OK) {
+		destroyInstance(instance);
+		return NULL;
+	}
+
+	return instance;
+}
+
+// Same as createControllerInstanceWithOptions, using the default options.
+MSG_API struct MPIController * createControllerInstance(char * name, char * MPIArguments) {
+	return createControllerInstanceWithOptions(name, MPIArguments, NULL);
+}
+
+// Called by the Rank0 process of the MPI world initiated by createControllerInstance.
+// Returns NULL if the controller doesn't set up an instance with this name
+// within MSG_ATTACH_TIMEOUT_MS.
+//
+// parameters:
+//     - name: user defined unique string
+//             must be the same in both the controller and child processes
+//
+MSG_API struct MPIController * createChildInstance(char * name) {
+	// We need to do the following:
+	//     1) create and instance of MPIController
+	//     2) map the control block, which should have already
+	//        been initialized by the controller
+	//     3) trigger the childAttached semaphore
+	//        to inform the controller that the system has
+	//        initialized 
+
+	if (isSocketName(name)) {
+		return connectSocketChild(name);
+	}
+
+	struct MPIController * instance = allocateInstance(name, false);
+
+	if (!getControlSegmentName(instance->segmentName, name)) {
+		free(instance);
+		return NULL;
+	}
+
+	// The controller normally creates the shared memory before the 
+	// child is started, but a child started some other way may get
+	// here first, so give the controller a little while to show up.
+	struct MPIControlBlock * header = NULL;
+	for (int waited = 0; header == NULL; ++waited) {
+		int status = openPublishedControlBlock(instance, &header);
+
+		if (status == -1 || (status == 1 && waited >= MSG_ATTACH_TIMEOUT_MS)) {
+			if (status == 1) {
+				printf("timed out waiting for %s\n", instance->segmentName);
+			}
+			free(instance);
+			return NULL;
+		}
+
+		if (status == 1) {
+			usleep(1000);
+		}
+	}
+
+	if (header->persistent) {
+		printf("%s belongs to a persistent world\n", instance->segmentName);
+		munmap(header, sizeof(struct MPIControlBlock));
+		close(instance->fd);
+		free(instance);
+		return NULL;
+	}
+
+	mapControlBlock(instance, header);
+
+	bindControlBlock(instance);
+	attachStats(instance);
+
+	// Now we trigger the semaphore to inform the controller
+	// that we have succeeded.
+
+	postSemaphore(&instance->control->childAttached);
+
+	return instance;
+}
+
+// ----------------------------------------------
+// Persistent worlds
+// ----------------------------------------------
+// Starting mpirun and going through MPI_Init can take much longer than
+// a short job runs. In a persistent world rank 0 creates the shared 
+// memory itself and outlives its controllers: controllers attach to 
+// it by name, run a session and detach, and the world waits for the
+// next one. Every session gets a new epoch. mpi_pool.c keeps a number
+// of such worlds running and acquirePooledInstance hands them out.
+//
+// Child (rank 0):
+//     inst = createPersistentChildInstance(name, NULL);
+//     while (running) {
+//         waitForController(inst);
+//         // serve requests until a MSG_TYPE_DETACH message arrives
+//     }
+//     destroyInstance(inst);
+//
+// Controller:
+//     inst = attachControllerInstance(name, 5000);
+//     ...
+//     detachInstance(inst);
+
+// Called by rank 0 of a persistent world. Creates the shared memory 
+// under the given name (see createControllerInstanceAsync for options)
+// and returns without waiting for a controller; call waitForController
+// before using the instance. The world is torn down with destroyInstance.
+MSG_API struct MPIController * createPersistentChildInstance(char * name, struct MPIControllerOptions * options) {
+	if (isSocketName(name)) {
+		printf("persistent worlds need shared memory\n");
+		return NULL;
+	}
+
+	struct MPIController * instance = allocateInstance(name, false);
+	instance->persistent = true;
+
+	if (!getControlSegmentName(instance->segmentName, name) || 
+		!createControlSegment(instance, options, true)) {
+		free(instance);
+		return NULL;
+	}
+
+	return instance;
+}
+
+// Puts everything both directions share back to how a new control 
+// block starts out, except that payload areas and stream windows that
+// have already been allocated are kept. Called by the child of a 
+// persistent world between sessions, while the new controller waits.
+MSG_API void resetSession(struct MPIController * instance) {
+	struct MPIControlBlock * control = instance->control;
+
+	for (int i = 0; i < 2; ++i) {
+		struct MPIDirection * direction = &control->direction[i];
+
+		__atomic_store_n(&direction->sent.count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&direction->received.count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&direction->streamFilled.count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&direction->streamEmpty.count, 
+			direction->streamOffset != 0 ? control->streamSlots : 0, __ATOMIC_RELAXED);
+
+		control->priority[i].head = 0;
+		control->priority[i].tail = 0;
+		__atomic_store_n(&control->priority[i].free.count, MSG_PRIORITY_SLOTS, __ATOMIC_RELAXED);
+	}
+
+	if (instance->channelMode == MSG_CHANNEL_RING) {
+		struct MPIRing * rings[2] = { instance->sendRing, instance->recvRing };
+
+		for (int i = 0; i < 2; ++i) {
+			rings[i]->head            = 0;
+			rings[i]->tail            = 0;
+			rings[i]->producerWaiting = 0;
+		}
+	}
+
+	// Start over locally as well, keeping the wait strategy.
+	int waitStrategy = instance->waitStrategy;
+	int spinCount    = instance->spinCount;
+
+	if (instance->sendMapping.data != NULL) {
+		munmap(instance->sendMapping.data, instance->sendMapping.size);
+	}
+	if (instance->recvMapping.data != NULL) {
+		munmap(instance->recvMapping.data, instance->recvMapping.size);
+	}
+	if (instance->sendStream.window.data != NULL) {
+		munmap(instance->sendStream.window.data, instance->sendStream.window.size);
+	}
+	if (instance->recvStream.window.data != NULL) {
+		munmap(instance->recvStream.window.data, instance->recvStream.window.size);
+	}
+
+	bindControlBlock(instance);
+	setWaitStrategy(instance, waitStrategy, spinCount);
+
+	instance->sendPending  = false;
+	instance->viewPending  = false;
+	instance->viewPriority = false;
+	instance->viewHeld     = false;
+	instance->viewLost     = false;
+	instance->peerLost    = false;
+}
+
+// Called by the child of a persistent world. Blocks until a controller
+// attaches, sets up a new session for it and returns its epoch. Call
+// this again after the controller detaches (MSG_TYPE_DETACH).
+MSG_API uint32_t waitForController(struct MPIController * instance) {
+	struct MPIControlBlock * control = instance->control;
+
+	while (true) {
+		waitSemaphore(&control->controllerAttached, instance->waitStrategy, instance->spinCount);
+
+		// Skip posts left behind by controllers that gave up, and
+		// posts for a session that has already been set up.
+		uint32_t epoch = __atomic_load_n(&control->sessionEpoch, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&control->controllerPid, __ATOMIC_ACQUIRE) == 0 || 
+			epoch == control->acceptedEpoch) {
+			continue;
+		}
+
+		resetSession(instance);
+		instance->sessionEpoch = epoch;
+
+		__atomic_store_n(&control->acceptedEpoch, epoch, __ATOMIC_RELEASE);
+		postSemaphore(&control->childAttached);
+
+		return epoch;
+	}
+}
+
+// Claims the persistent world for this process. Fails if another
+// controller that is still alive holds it; a controller that exited
+// without detaching doesn't count.
+MSG_API bool claimWorld(struct MPIControlBlock * control) {
+	int32_t holder = 0;
+
+	while (!__atomic_compare_exchange_n(&control->controllerPid, &holder, getpid(), 
+		false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		if (kill(holder, 0) == 0 || errno != ESRCH) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Attaches a controller to the persistent world with the given name.
+// Waits up to timeout milliseconds (forever if negative) for its child
+// to start the session. Returns NULL if there's no such world, another
+// controller holds it, or the child doesn't respond in time.
+MSG_API struct MPIController * attachControllerInstance(char * name, int timeout) {
+	struct MPIController * instance = allocateInstance(name, true);
+	instance->persistent = true;
+
+	if (!getControlSegmentName(instance->segmentName, name)) {
+		free(instance);
+		return NULL;
+	}
+
+	struct MPIControlBlock * header;
+	if (openPublishedControlBlock(instance, &header) != 0) {
+		free(instance);
+		return NULL;
+	}
+
+	if (!header->persistent) {
+		printf("%s is not a persistent world\n", instance->segmentName);
+		munmap(header, sizeof(struct MPIControlBlock));
+		close(instance->fd);
+		free(instance);
+		return NULL;
+	}
+
+	mapControlBlock(instance, header);
+	struct MPIControlBlock * control = instance->control;
+
+	if (!claimWorld(control)) {
+		munmap(control, instance->controlSize);
+		close(instance->fd);
+		free(instance);
+		return NULL;
+	}
+
+	bindControlBlock(instance);
+	attachStats(instance);
+
+	uint32_t epoch = __atomic_add_fetch(&control->sessionEpoch, 1, __ATOMIC_SEQ_CST);
+	instance->sessionEpoch = epoch;
+	postSemaphore(&control->controllerAttached);
+
+	// Answers for earlier epochs come from sessions that a previous 
+	// controller gave up on.
+	uint64_t deadline = monotonicNanoseconds() + (uint64_t)timeout * 1000000ull;
+
+	while (__atomic_load_n(&control->acceptedEpoch, __ATOMIC_ACQUIRE) != epoch) {
+		uint64_t now = monotonicNanoseconds();
+		uint64_t remaining = timeout < 0 ? 1000000000ull : (now < deadline ? deadline - now : 0);
+
+		if (!waitSemaphoreTimed(&control->childAttached, instance->waitStrategy, 
+			instance->spinCount, remaining) && timeout >= 0 && monotonicNanoseconds() >= deadline) {
+			printf("%s did not start a session in time\n", instance->segmentName);
+			detachInstance(instance);
+			return NULL;
+		}
+	}
+
+	instance->childAttached = true;
+	return instance;
+}
+
+// Finds a free world in the pool with the given name (see mpi_pool.c)
+// and attaches to it. Waits up to timeout milliseconds (forever if 
+// negative) for one to become free. A world whose child doesn't start
+// the session within MSG_POOL_ATTACH_TIMEOUT_MS is passed over. Returns
+// NULL if there's no such pool or nothing became free in time.
+MSG_API struct MPIController * acquirePooledInstance(char * pool, int timeout) {
+	char poolName[MSG_MAX_NAME];
+	snprintf(poolName, MSG_MAX_NAME, "/%s_pool", pool);
+
+	int fd = shm_open(poolName, O_RDONLY, 0);
+
+	if (fd == -1) {
+		printf("no pool named %s\n", pool);
+		return NULL;
+	}
+
+	struct MPIPoolBlock * block = (struct MPIPoolBlock *)mmap(NULL, sizeof(struct MPIPoolBlock), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (block == (void *)-1 || __atomic_load_n(&block->magic, __ATOMIC_ACQUIRE) != MSG_POOL_MAGIC || 
+		block->version != MSG_POOL_VERSION) {
+		printf("%s is not a pool\n", poolName);
+		if (block != (void *)-1) {
+			munmap(block, sizeof(struct MPIPoolBlock));
+		}
+		return NULL;
+	}
+
+	uint32_t worlds = block->worlds;
+	munmap(block, sizeof(struct MPIPoolBlock));
+
+	uint64_t deadline = monotonicNanoseconds() + (uint64_t)timeout * 1000000ull;
+	char name[MSG_MAX_NAME];
+
+	while (true) {
+		for (uint32_t i = 0; i < worlds; ++i) {
+			snprintf(name, MSG_MAX_NAME, "%s_%u", pool, i);
+
+			int64_t remaining = MSG_POOL_ATTACH_TIMEOUT_MS;
+			if (timeout >= 0) {
+				int64_t left = ((int64_t)deadline - (int64_t)monotonicNanoseconds()) / 1000000;
+				remaining = left < 0 ? 0 : (left < remaining ? left : remaining);
+			}
+
+			struct MPIController * instance = attachControllerInstance(name, (int)remaining);
+
+			if (instance != NULL) {
+				return instance;
+			}
+		}
+
+		if (timeout >= 0 && monotonicNanoseconds() >= deadline) {
+			return NULL;
+		}
+
+		usleep(1000);
+	}
+}
+
+// Called by rank 0 of a world that may have been started by the pool
+// manager. The name is taken from MPI_CONTROLLER_NAME if it's set and
+// defaultName otherwise. If MPI_CONTROLLER_PERSISTENT is set to a 
+// nonzero value a persistent world is created (see 
+// createPersistentChildInstance), otherwise this is createChildInstance.
+MSG_API struct MPIController * createChildInstanceFromEnvironment(char * defaultName) {
+	char * name       = getenv(MSG_ENV_NAME);
+	char * persistent = getenv(MSG_ENV_PERSISTENT);
+
+	if (name == NULL) {
+		name = defaultName;
+	}
+
+	if (persistent != NULL && atoi(persistent) != 0) {
+		return createPersistentChildInstance(name, NULL);
+	}
+
+	return createChildInstance(name);
+}
+
+// Second half of commitSend: in rendezvous mode, waits for the 
+// receiver to release the message handed over by postSend.
+MSG_API void finishSend(struct MPIController * instance) {
+	if (!instance->deliveryPending) {
+		return;
+	}
+
+	instance->deliveryPending = false;
+	waitForPeer(instance, &instance->sendDirection->received, &instance->stats->send);
+}
+
+// Room in the ring, or the payload area grown to fit the message.
+MSG_API void * shmAcquireSendBuffer(struct MPIController * instance, int length) {
+	if (instance->channelMode == MSG_CHANNEL_RING) {
+		return ringAcquireSendBuffer(instance, length);
+	}
+
+	if (!reserveMessageCapacity(instance, length)) {
+		return NULL;
+	}
+
+	return instance->sendMapping.data;
+}
+
+// Returns a pointer to length bytes of shared memory that the next
+// message can be written into directly, which avoids building the
+// message somewhere else first and having sendMessage copy it. The
+// message isn't sent until commitSend is called, and nothing else 
+// may be sent on this instance in between. In ring mode this blocks
+// until the ring has room for the message.
+MSG_API void * acquireSendBuffer(struct MPIController * instance, int length) {
+	if (instance->sendPending) {
+		printf("acquireSendBuffer called before committing the previous message\n");
+		return NULL;
+	}
+
+	// The payload area is still in use by the message given to postSend.
+	finishSend(instance);
+
+	void * buffer = instance->transport->acquire(instance, length);
+
+	if (buffer != NULL) {
+		instance->sendPending = true;
+		instance->sendLength  = length;
+		instance->sendBuffer  = buffer;
+	}
+
+	return buffer;
+}
+
+// First half of commitSend: hands the message to the receiver without
+// waiting for it to be received. In rendezvous mode the next 
+// acquireSendBuffer waits for that if finishSend hasn't been called
+// by then. Lets a controller get messages to several ranks in flight
+// at once.
+MSG_API void postSend(struct MPIController * instance, int code, int type) {
+	if (!instance->sendPending) {
+		printf("commitSend called without a buffer to commit\n");
+		return;
+	}
+
+	instance->sendPending = false;
+	countMessage(&instance->stats->send, instance->sendLength);
+	captureSent(instance, code, instance->sendLength, type, instance->sendBuffer);
+	instance->transport->post(instance, code, type);
+}
+
+// Publishes the message in the ring, or announces it to the receiver
+// in rendezvous mode.
+MSG_API void shmPostSend(struct MPIController * instance, int code, int type) {
+	if (instance->channelMode == MSG_CHANNEL_RING) {
+		ringCommitSend(instance, code, instance->sendLength, type, true);
+		return;
+	}
+
+	instance->sendDirection->code   = code;
+	instance->sendDirection->length = instance->sendLength;
+	instance->sendDirection->type   = type;
+
+	postSemaphore(&instance->sendDirection->sent);
+	notifyReceiver(instance);
+	countQueueDepth(&instance->stats->send, instance->sendDirection);
+	instance->deliveryPending = true;
+}
+
+// Sends the message written into the buffer returned by 
+// acquireSendBuffer. Blocks just like sendMessage does.
+MSG_API void commitSend(struct MPIController * instance, int code, int type) {
+	postSend(instance, code, type);
+	finishSend(instance);
+}
+
+// Returns TRUE if a message of the given length can be sent right away,
+// without waiting for the receiver: in ring mode if there is room for
+// it in the ring, in rendezvous mode once the receiver has released 
+// the message handed over by postSend.
+MSG_API bool canSend(struct MPIController * instance, int length) {
+	return instance->transport->canSend(instance, length);
+}
+
+// See canSend.
+MSG_API bool shmCanSend(struct MPIController * instance, int length) {
+	if (instance->channelMode == MSG_CHANNEL_RING) {
+		size_t capacity = instance->ringCapacity;
+		size_t size     = recordSize(length);
+		size_t toEnd    = capacity - (instance->sendHead & (capacity - 1));
+
+		// A record that doesn't fit before the end needs a padding record.
+		if (toEnd < size) {
+			size += toEnd;
+		}
+
+		uint64_t tail = __atomic_load_n(&instance->sendRing->tail, __ATOMIC_ACQUIRE);
+		return capacity - (instance->sendHead - tail) >= size;
+	}
+
+	if (instance->deliveryPending && tryWaitSemaphore(&instance->sendDirection->received)) {
+		instance->deliveryPending = false;
+	}
+
+	return !instance->deliveryPending;
+}
+
+// Sends a message.
+// Can be called on either a child or controller, doesn't matter.
+// Internally the function will copy the message into the shared
+// message region (growing it first if the message doesn't fit) 
+// before triggering a semaphore. The caller is responsible for
+// deallocating the message that they pass in.
+// This function will halt execution until the receiver confirms
+// that they have received the message. In ring mode the message
+// is written into the ring instead, and this only blocks when the
+// ring is full.
+MSG_API void sendMessage(struct MPIController * instance, void * message, int code, int length, int type) {
+	struct iovec iov = { message, (size_t)length };
+	instance->transport->sendv(instance, &iov, 1, code, type);
+}
+
+// Sends the fragments described by iov as a single message, gathering
+// them straight into shared memory. The receiver sees one message 
+// whose contents are the fragments back to back. Blocks just like 
+// sendMessage does.
+MSG_API void sendMessagev(struct MPIController * instance, const struct iovec * iov, int iovcnt, int code, int type) {
+	instance->transport->sendv(instance, iov, iovcnt, code, type);
+}
+
+// Gathers the fragments into the buffer from acquireSendBuffer.
+MSG_API void shmSendv(struct MPIController * instance, const struct iovec * iov, int iovcnt, int code, int type) {
+	size_t length = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		length += iov[i].iov_len;
+	}
+
+	char * buffer = (char *)acquireSendBuffer(instance, length);
+
+	if (buffer == NULL) {
+		return;
+	}
+
+	// The message as a whole decides how it's copied, not each fragment.
+	bool streaming = useStreamingCopy(instance, length);
+
+	uint64_t start = statsClock(instance);
+	for (int i = 0; i < iovcnt; ++i) {
+		if (streaming) {
+			streamingCopy(buffer, iov[i].iov_base, iov[i].iov_len);
+		} else {
+			memcpy(buffer, iov[i].iov_base, iov[i].iov_len);
+		}
+		buffer += iov[i].iov_len;
+	}
+	instance->stats->send.copyNanoseconds += statsClock(instance) - start;
+
+	commitSend(instance, code, type);
+}
+
+// Sends count messages with a single synchronization. The receiver 
+// gets them one at a time, in order, from recvMessage or 
+// recvMessageView as if they had been sent separately. In rendezvous
+// mode all of them are packed into the payload area and this blocks
+// until the receiver has released the last one. In ring mode they
+// are written into the ring and published together; this only 
+// blocks if the ring fills up along the way.
+MSG_API void sendBatch(struct MPIController * instance, struct MPIMessage * messages, int count) {
+	if (instance->sendPending) {
+		printf("sendBatch called before committing the previous message\n");
+		return;
+	}
+
+	if (count == 0) {
+		return;
+	}
+
+	instance->transport->sendBatch(instance, messages, count);
+}
+
+// See sendBatch.
+MSG_API void shmSendBatch(struct MPIController * instance, struct MPIMessage * messages, int count) {
+	struct MPIDirectionStats * stats = &instance->stats->send;
+
+	if (instance->channelMode == MSG_CHANNEL_RING) {
+		for (int i = 0; i < count; ++i) {
+			void * buffer = ringAcquireSendBuffer(instance, messages[i].length);
+
+			if (buffer == NULL) {
+				continue;
+			}
+
+			uint64_t start = statsClock(instance);
+			memcpy(buffer, messages[i].data, messages[i].length);
+			stats->copyNanoseconds += statsClock(instance) - start;
+
+			countMessage(stats, messages[i].length);
+			captureSent(instance, messages[i].code, messages[i].length, messages[i].type, messages[i].data);
+			ringCommitSend(instance, messages[i].code, messages[i].length, messages[i].type, false);
+		}
+
+		ringPublish(instance);
+		return;
+	}
+
+	size_t length = 0;
+	for (int i = 0; i < count; ++i) {
+		length += recordSize(messages[i].length);
+	}
+
+	finishSend(instance);
+
+	if (!reserveMessageCapacity(instance, length)) {
+		return;
+	}
+
+	char * buffer = (char *)instance->sendMapping.data;
+
+	uint64_t start = statsClock(instance);
+	for (int i = 0; i < count; ++i) {
+		struct MPIRecord * record = (struct MPIRecord *)buffer;
+		record->code   = messages[i].code;
+		record->type   = messages[i].type;
+		record->length = messages[i].length;
+		record->flags  = 0;
+		memcpy(buffer + sizeof(struct MPIRecord), messages[i].data, messages[i].length);
+
+		buffer += recordSize(messages[i].length);
+		countMessage(stats, messages[i].length);
+		captureSent(instance, messages[i].code, messages[i].length, messages[i].type, messages[i].data);
+	}
+	stats->copyNanoseconds += statsClock(instance) - start;
+
+	instance->sendDirection->code   = count;
+	instance->sendDirection->length = length;
+	instance->sendDirection->type   = MSG_TYPE_BATCH;
+
+	postSemaphore(&instance->sendDirection->sent);
+	notifyReceiver(instance);
+	countQueueDepth(stats, instance->sendDirection);
+	waitForPeer(instance, &instance->sendDirection->received, stats);
+}
+
+// Waits up to timeout nanoseconds (see waitForPeerTimed) for the next
+// message and returns a view of it, or NULL on timeout. The work 
+// behind recvMessageView and its timed variants.
+MSG_API const void * shmReceiveView(struct MPIController * instance, int * code, int * length, int * type, 
+	int64_t timeout) {
+	// A priority message that has been put in the lane has been, or is
+	// about to be, announced. Take the post that goes with it.
+	if (hasPriorityMessage(instance)) {
+		waitSemaphore(&instance->recvDirection->sent, instance->waitStrategy, instance->spinCount);
+		return priorityView(instance, code, length, type);
+	}
+
+	if (instance->channelMode == MSG_CHANNEL_RING) {
+		const void * view = ringRecvMessageView(instance, code, length, type, timeout);
+
+		if (view != NULL && !instance->viewLost && !instance->viewPriority) {
+			countMessage(&instance->stats->recv, *length);
+		}
+
+		return view;
+	}
+
+	// The rest of a batch is handed out one record at a time
+	// before waiting for anything new.
+	if (instance->batchRemaining == 0) {
+		// wait for a message to come in
+		int status = waitForPeerTimed(instance, &instance->recvDirection->sent, &instance->stats->recv, timeout);
+
+		if (status == 1) {
+			return NULL;
+		} else if (status == -1) {
+			return controllerLost(instance, code, length, type);
+		}
+
+		// The post may have been for a priority message.
+		const void * priority = priorityView(instance, code, length, type);
+		if (priority != NULL) {
+			return priority;
+		}
+
+		*code   = instance->recvDirection->code;
+		*length = instance->recvDirection->length;
+		*type   = instance->recvDirection->type;
+
+		// The sender may have grown its payload area to fit 
+		// this message. If so, pick up the new one.
+		syncPayloadMapping(instance, instance->recvDirection, &instance->recvMapping);
+
+		if (*type != MSG_TYPE_BATCH) {
+			countMessage(&instance->stats->recv, *length);
+			return instance->recvMapping.data;
+		}
+
+		// For a batch the code holds the number of records.
+		instance->batchRemaining = *code;
+		instance->batchOffset    = 0;
+	}
+
+	struct MPIRecord * record = (struct MPIRecord *)((char *)instance->recvMapping.data + instance->batchOffset);
+
+	*code   = record->code;
+	*length = record->length;
+	*type   = record->type;
+
+	countMessage(&instance->stats->recv, *length);
+	return (char *)record + sizeof(struct MPIRecord);
+}
+
+// Empties the FIFO returned by getMessageFd and asks the sender to 
+// write to it when it posts the next message. Returns TRUE if a message
+// was posted in the meantime, in which case the caller should look 
+// again instead of going to sleep.
+MSG_API bool armMessageFd(struct MPIController * instance) {
+	char buffer[64];
+	while (read(instance->messageFd, buffer, sizeof(buffer)) > 0);
+
+	__atomic_store_n(&instance->recvDirection->armed, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&instance->recvDirection->sent.count, __ATOMIC_SEQ_CST) > 0;
+}
+
+// Puts back the message just received with recvMessageView without 
+// releasing it, for a caller that can't handle it. The next receive
+// returns it again (it isn't counted or captured twice).
+MSG_API void holdMessage(struct MPIController * instance, const void * view, int code, int length, int type) {
+	instance->viewHeld   = true;
+	instance->heldView   = view;
+	instance->heldCode   = code;
+	instance->heldLength = length;
+	instance->heldType   = type;
+}
+
+// Same as recvMessageView, but waits at most timeout milliseconds (0 
+// doesn't wait at all). Returns NULL if no message arrived in time.
+// After a NULL return, the descriptor from getMessageFd (if it's used)
+// becomes readable as soon as the next message is sent.
+MSG_API const void * recvMessageViewTimed(struct MPIController * instance, int * code, int * length, int * type, 
+	int timeout) {
+	// A message that was put back is still in place.
+	if (instance->viewHeld) {
+		instance->viewHeld = false;
+		*code   = instance->heldCode;
+		*length = instance->heldLength;
+		*type   = instance->heldType;
+		return instance->heldView;
+	}
+
+	if (instance->viewPending) {
+		printf("recvMessageView called before releasing the previous message\n");
+		return NULL;
+	}
+
+	instance->viewPending = true;
+
+	int64_t nanoseconds = timeout < 0 ? -1 : (int64_t)timeout * 1000000;
+	const void * view = instance->transport->recvView(instance, code, length, type, nanoseconds);
+
+	// Whoever polls the descriptor only goes to sleep after we come up
+	// empty, so this is the time to arm it.
+	if (view == NULL && instance->messageFd != -1 && armMessageFd(instance)) {
+		view = instance->transport->recvView(instance, code, length, type, 0);
+	}
+
+	if (view == NULL) {
+		instance->viewPending = false;
+	} else if (!instance->viewLost) {
+		captureReceived(instance, *code, *length, *type, view);
+	}
+
+	return view;
+}
+
+// Halts until receiving a message, like recvMessage, but doesn't copy
+// it. The returned pointer points straight into shared memory and
+// stays valid until releaseMessage is called. The sender isn't told 
+// that the message was received until then either, so parse it in
+// place and release it as soon as possible. Only one message can be
+// viewed at a time per instance.
+MSG_API const void * recvMessageView(struct MPIController * instance, int * code, int * length, int * type) {
+	return recvMessageViewTimed(instance, code, length, type, -1);
+}
+
+// Same as recvMessageView, but returns NULL right away if no message
+// is waiting.
+MSG_API const void * tryRecvMessageView(struct MPIController * instance, int * code, int * length, int * type) {
+	return recvMessageViewTimed(instance, code, length, type, 0);
+}
+
+// Hands the message returned by recvMessageView back to the sender.
+// The pointer returned by recvMessageView must not be used afterwards.
+MSG_API void releaseMessage(struct MPIController * instance) {
+	if (!instance->viewPending) {
+		printf("releaseMessage called without a message to release\n");
+		return;
+	}
+
+	instance->viewPending = false;
+	instance->viewHeld    = false;
+
+	if (instance->viewLost) {
+		instance->viewLost = false;
+		return;
+	}
+
+	if (instance->viewPriority) {
+		releasePriority(instance);
+		return;
+	}
+
+	instance->transport->release(instance);
+}
+
+// Tells the sender the message is done with, or in ring mode frees 
+// its room in the ring.
+MSG_API void shmReleaseMessage(struct MPIController * instance) {
+	if (instance->channelMode == MSG_CHANNEL_RING) {
+		ringReleaseMessage(instance);
+		return;
+	}
+
+	// A batch is only acknowledged once its last record is released.
+	if (instance->batchRemaining > 0) {
+		struct MPIRecord * record = (struct MPIRecord *)((char *)instance->recvMapping.data + instance->batchOffset);
+		instance->batchOffset += recordSize(record->length);
+		instance->batchRemaining--;
+
+		if (instance->batchRemaining > 0) {
+			return;
+		}
+	}
+
+	postSemaphore(&instance->recvDirection->received);
+}
+
+// Same as recvMessage, but waits at most timeout milliseconds (0 
+// doesn't wait at all). Returns NULL if no message arrived in time.
+// See recvMessageViewTimed.
+MSG_API void * recvMessageTimed(struct MPIController * instance, int * code, int * length, int * type, int timeout) {
+	const void * view = recvMessageViewTimed(instance, code, length, type, timeout);
+
+	if (view == NULL) {
+		return NULL;
+	}
+
+	// Allocate some process memory for it and copy it into
+	// the new memory.
+	void * result = malloc(*length);
+
+	uint64_t start = statsClock(instance);
+	copyPayload(instance, result, view, *length);
+	instance->stats->recv.copyNanoseconds += statsClock(instance) - start;
+
+	releaseMessage(instance);
+
+	return result;
+}
+
+// Halts until revceiving a message. When a message is received, it 
+// will be copied from shared memory into local memory. The returned
+// pointer is the responsibility of the caller to free.
+MSG_API void * recvMessage(struct MPIController * instance, int * code, int * length, int * type) {
+	return recvMessageTimed(instance, code, length, type, -1);
+}
+
+// Same as recvMessage, but returns NULL right away if no message is 
+// waiting.
+MSG_API void * tryRecvMessage(struct MPIController * instance, int * code, int * length, int * type) {
+	return recvMessageTimed(instance, code, length, type, 0);
+}
+
+// Returns a file descriptor that becomes readable when a message is 
+// waiting for this process, so that one thread can wait for many 
+// instances (and anything else) with poll or epoll. The descriptor
+// belongs to the instance; don't read from it or close it. Receive
+// with tryRecvMessage or tryRecvMessageView until they return NULL
+// each time it becomes readable, since it's only rearmed then. 
+// Returns -1 if it couldn't be set up. With shared memory it's a FIFO
+// in /dev/shm, so it works across processes without passing 
+// descriptors around; on a socket it's the socket.
+MSG_API int getMessageFd(struct MPIController * instance) {
+	return instance->transport->messageFd(instance);
+}
+
+// Creates the FIFO the first time it's asked for.
+MSG_API int shmMessageFd(struct MPIController * instance) {
+	if (instance->messageFd != -1) {
+		return instance->messageFd;
+	}
+
+	char path[MSG_MAX_NAME];
+	getNotifyPath(path, instance->system_name, 
+		instance->is_controller ? MSG_TO_CONTROLLER : MSG_TO_CHILD);
+
+	if (mkfifo(path, 0777) == -1 && errno != EEXIST) {
+		printf("mkfifo failed for %s\n", path);
+		return -1;
+	}
+
+	// Opening it for writing too means it never reports end of file
+	// while the sender doesn't have it open.
+	instance->messageFd = open(path, O_RDWR | O_NONBLOCK);
+
+	if (instance->messageFd == -1) {
+		printf("could not open %s\n", path);
+		return -1;
+	}
+
+	// Messages that are already waiting have to make it readable too.
+	if (armMessageFd(instance) && write(instance->messageFd, "", 1) == -1) {
+		printf("could not notify the receiver\n");
+	}
+
+	return instance->messageFd;
+}
+
+// ----------------------------------------------
+// Rank channels
+// ----------------------------------------------
+// Normally only rank 0 talks to the controller and has to pass 
+// everything on over MPI. Instead, every rank on the controller's node
+// can have a channel of its own, so that data moves between the 
+// controller and each rank directly and in parallel. The instance of
+// rank k is named <name>_r<k>; rank 0's is just <name>, so a single
+// rank program works as before. Ranks on other nodes can't share 
+// memory with the controller, so only node-local ranks should take 
+// part (see MPI_Comm_split_type with MPI_COMM_TYPE_SHARED).
+//
+// Each rank:
+//     inst = createChildInstanceForRank(name, rank);
+//
+// Controller:
+//     group = createControllerGroup(name, "-n 4 ./worker.o", 4, NULL);
+//     scatterMessages(group, messages);  // one per rank
+//     gatherMessages(group, results);    // one from each rank
+//     destroyControllerGroup(group);
+
+// Constructs the name of the instance used by the given rank. Returns
+// FALSE if it doesn't fit.
+MSG_API bool getRankInstanceName(char * buffer, char * name, int rank) {
+	int length;
+
+	// Ranks of a socket instance use the ports after it.
+	char host[MSG_MAX_NAME];
+	char port[MSG_MAX_NAME];
+	if (isSocketName(name) && parseSocketName(name, host, port)) {
+		length = snprintf(buffer, MSG_MAX_NAME, "%s%s:%d", MSG_SOCKET_PREFIX, host, atoi(port) + rank);
+	} else if (rank == 0) {
+		length = snprintf(buffer, MSG_MAX_NAME, "%s", name);
+	} else {
+		length = snprintf(buffer, MSG_MAX_NAME, "%s_r%d", name, rank);
+	}
+
+	// Cut short, the names of two ranks could be the same.
+	if (length >= MSG_MAX_NAME) {
+		printf("instance name %s is too long for rank %d\n", name, rank);
+		return false;
+	}
+
+	return true;
+}
+
+// Called by every rank that has a channel of its own. Same as 
+// createChildInstance otherwise.
+MSG_API struct MPIController * createChildInstanceForRank(char * name, int rank) {
+	char rankName[MSG_MAX_NAME];
+	if (!getRankInstanceName(rankName, name, rank)) {
+		return NULL;
+	}
+
+	return createChildInstance(rankName);
+}
+
+// Unmaps and unlinks the shared memory of every rank and frees the group.
+MSG_API void destroyControllerGroup(struct MPIControllerGroup * group) {
+	for (int r = 0; r < group->size; ++r) {
+		if (group->ranks[r] != NULL) {
+			destroyInstance(group->ranks[r]);
+		}
+	}
+
+	free(group->ranks);
+	free(group);
+}
+
+// Constructs the path of the capture log of the given rank of a group.
+// Rank 0 keeps the path from the options, like its instance name, and
+// the other ranks get .r<rank> appended. Returns FALSE if it doesn't 
+// fit.
+MSG_API bool getRankCapturePath(char * buffer, const char * path, int rank) {
+	int length = rank == 0 ? snprintf(buffer, PATH_MAX, "%s", path) : 
+		snprintf(buffer, PATH_MAX, "%s.r%d", path, rank);
+
+	if (length >= PATH_MAX) {
+		printf("capture path %s is too long for rank %d\n", path, rank);
+		return false;
+	}
+
+	return true;
+}
+
+// Sets up a channel for each of the first size ranks of a world and 
+// starts it with mpirun (see createControllerInstanceAsync for the 
+// arguments and options). With options->capture set, every rank's 
+// channel is captured to a log of its own (see getRankCapturePath).
+// Returns once every rank has attached, or NULL if mpirun couldn't be
+// started or exited before that.
+MSG_API struct MPIControllerGroup * createControllerGroup(char * name, char * MPIArguments, int size, 
+	struct MPIControllerOptions * options) {
+	struct MPIControllerGroup * group = (struct MPIControllerGroup *)malloc(sizeof(struct MPIControllerGroup));
+	group->size  = size;
+	group->ranks = (struct MPIController **)calloc(size, sizeof(struct MPIController *));
+
+	char rankName[MSG_MAX_NAME];
+	char capturePath[PATH_MAX];
+	struct MPIControllerOptions rankOptions;
+
+	// Every channel has to exist before mpirun starts the ranks, so 
+	// rank 0's instance, which starts it, comes last.
+	for (int r = size - 1; r >= 0; --r) {
+		if (!getRankInstanceName(rankName, name, r)) {
+			destroyControllerGroup(group);
+			return NULL;
+		}
+
+		// Logs opened by several instances would overwrite each other.
+		struct MPIControllerOptions * instanceOptions = options;
+		if (options != NULL && options->capture != NULL) {
+			if (!getRankCapturePath(capturePath, options->capture, r)) {
+				destroyControllerGroup(group);
+				return NULL;
+			}
+
+			rankOptions         = *options;
+			rankOptions.capture = capturePath;
+			instanceOptions     = &rankOptions;
+		}
+
+		group->ranks[r] = createControllerInstanceAsync(rankName, r == 0 ? MPIArguments : NULL, instanceOptions);
+
+		if (group->ranks[r] == NULL) {
+			destroyControllerGroup(group);
+			return NULL;
+		}
+	}
+
+	// Only rank 0's instance knows about mpirun, so it's the one that
+	// notices when the world fails to start.
+	for (int r = 0; r < size; ++r) {
+		while (true) {
+			int result = waitForChild(group->ranks[r], 10);
+
+			if (result == MSG_ATTACH_OK) {
+				break;
+			}
+
+			if (result == MSG_ATTACH_FAILED || (MPIArguments != NULL && !isChildRunning(group->ranks[0]))) {
+				printf("mpirun exited before rank %d attached\n", r);
+				destroyControllerGroup(group);
+				return NULL;
+			}
+		}
+	}
+
+	return group;
+}
+
+// Sends the same message to every rank. All ranks get it at the same
+// time; in rendezvous mode this returns once all of them have 
+// received it.
+MSG_API void broadcastMessage(struct MPIControllerGroup * group, void * message, int code, int length, int type) {
+	for (int r = 0; r < group->size; ++r) {
+		void * buffer = acquireSendBuffer(group->ranks[r], length);
+
+		if (buffer != NULL) {
+			copyPayload(group->ranks[r], buffer, message, length);
+			postSend(group->ranks[r], code, type);
+		}
+	}
+
+	for (int r = 0; r < group->size; ++r) {
+		finishSend(group->ranks[r]);
+	}
+}
+
+// Sends messages[r] to rank r, for every rank of the group. All ranks
+// get theirs at the same time; in rendezvous mode this returns once 
+// all of them have received it.
+MSG_API void scatterMessages(struct MPIControllerGroup * group, struct MPIMessage * messages) {
+	for (int r = 0; r < group->size; ++r) {
+		void * buffer = acquireSendBuffer(group->ranks[r], messages[r].length);
+
+		if (buffer != NULL) {
+			copyPayload(group->ranks[r], buffer, messages[r].data, messages[r].length);
+			postSend(group->ranks[r], messages[r].code, messages[r].type);
+		}
+	}
+
+	for (int r = 0; r < group->size; ++r) {
+		finishSend(group->ranks[r]);
+	}
+}
+
+// Receives the next message from every rank of the group into 
+// messages[r]. The data of each message is allocated with malloc and
+// has to be freed by the caller. Every rank is released as soon as 
+// its message has been copied.
+MSG_API void gatherMessages(struct MPIControllerGroup * group, struct MPIMessage * messages) {
+	for (int r = 0; r < group->size; ++r) {
+		messages[r].data = recvMessage(group->ranks[r], &messages[r].code, 
+			&messages[r].length, &messages[r].type);
+	}
+}
+
+// ----------------------------------------------
+// Reductions
+// ----------------------------------------------
+// Combines an array of MSG_TYPE_INT, MSG_TYPE_FLOAT or MSG_TYPE_DOUBLE
+// values from every rank of a group into one array, element by element.
+// Each message is read where it lies in shared memory and folded into
+// the result right away, so no rank's array is ever copied.
+//
+//     double totals[1000];
+//     if (reduceMessages(group, totals, 1000, MSG_TYPE_DOUBLE, MSG_REDUCE_SUM)) {
+//         ...
+//     }
+
+#if defined(__x86_64__) || defined(__i386__)
+// The kernels below combine values into result, as many elements as
+// fill whole vectors, and return how many they did; combineValues and
+// addInts take care of the rest. min and max follow the instructions:
+// where either value is NaN, the one from values wins. Integers are
+// only compared here; they are added up in 64 bits by the addInts 
+// kernels, so that sums of many ranks don't overflow.
+
+// SSE2 has no min and max for 32 bit integers.
+__attribute__((target("sse2")))
+MSG_API __m128i selectInts(__m128i mask, __m128i a, __m128i b) {
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+__attribute__((target("sse2")))
+MSG_API size_t addIntsSSE2(int64_t * sums, const int32_t * values, size_t count) {
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i v    = _mm_loadu_si128((const __m128i *)(values + i));
+		__m128i sign = _mm_srai_epi32(v, 31);
+		__m128i low  = _mm_unpacklo_epi32(v, sign);
+		__m128i high = _mm_unpackhi_epi32(v, sign);
+		_mm_storeu_si128((__m128i *)(sums + i), _mm_add_epi64(_mm_loadu_si128((const __m128i *)(sums + i)), low));
+		_mm_storeu_si128((__m128i *)(sums + i + 2), _mm_add_epi64(_mm_loadu_si128((const __m128i *)(sums + i + 2)), high));
+	}
+	return i;
+}
+
+__attribute__((target("sse2")))
+MSG_API size_t combineIntsSSE2(int32_t * result, const int32_t * values, size_t count, int operation) {
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(result + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(values + i));
+
+		if (operation == MSG_REDUCE_MIN) {
+			a = selectInts(_mm_cmplt_epi32(a, b), a, b);
+		} else {
+			a = selectInts(_mm_cmpgt_epi32(a, b), a, b);
+		}
+
+		_mm_storeu_si128((__m128i *)(result + i), a);
+	}
+	return i;
+}
+
+__attribute__((target("sse2")))
+MSG_API size_t combineFloatsSSE2(float * result, const float * values, size_t count, int operation) {
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 a = _mm_loadu_ps(result + i);
+		__m128 b = _mm_loadu_ps(values + i);
+
+		if (operation == MSG_REDUCE_MIN) {
+			a = _mm_min_ps(a, b);
+		} else if (operation == MSG_REDUCE_MAX) {
+			a = _mm_max_ps(a, b);
+		} else {
+			a = _mm_add_ps(a, b);
+		}
+
+		_mm_storeu_ps(result + i, a);
+	}
+	return i;
+}
+
+__attribute__((target("sse2")))
+MSG_API size_t combineDoublesSSE2(double * result, const double * values, size_t count, int operation) {
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2) {
+		__m128d a = _mm_loadu_pd(result + i);
+		__m128d b = _mm_loadu_pd(values + i);
+
+		if (operation == MSG_REDUCE_MIN) {
+			a = _mm_min_pd(a, b);
+		} else if (operation == MSG_REDUCE_MAX) {
+			a = _mm_max_pd(a, b);
+		} else {
+			a = _mm_add_pd(a, b);
+		}
+
+		_mm_storeu_pd(result + i, a);
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+MSG_API size_t addIntsAVX2(int64_t * sums, const int32_t * values, size_t count) {
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m256i v = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i *)(values + i)));
+		_mm256_storeu_si256((__m256i *)(sums + i), _mm256_add_epi64(_mm256_loadu_si256((const __m256i *)(sums + i)), v));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+MSG_API size_t combineIntsAVX2(int32_t * result, const int32_t * values, size_t count, int operation) {
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(result + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(values + i));
+
+		if (operation == MSG_REDUCE_MIN) {
+			a = _mm256_min_epi32(a, b);
+		} else {
+			a = _mm256_max_epi32(a, b);
+		}
+
+		_mm256_storeu_si256((__m256i *)(result + i), a);
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+MSG_API size_t combineFloatsAVX2(float * result, const float * values, size_t count, int operation) {
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 a = _mm256_loadu_ps(result + i);
+		__m256 b = _mm256_loadu_ps(values + i);
+
+		if (operation == MSG_REDUCE_MIN) {
+			a = _mm256_min_ps(a, b);
+		} else if (operation == MSG_REDUCE_MAX) {
+			a = _mm256_max_ps(a, b);
+		} else {
+			a = _mm256_add_ps(a, b);
+		}
+
+		_mm256_storeu_ps(result + i, a);
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+MSG_API size_t combineDoublesAVX2(double * result, const double * values, size_t count, int operation) {
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m256d a = _mm256_loadu_pd(result + i);
+		__m256d b = _mm256_loadu_pd(values + i);
+
+		if (operation == MSG_REDUCE_MIN) {
+			a = _mm256_min_pd(a, b);
+		} else if (operation == MSG_REDUCE_MAX) {
+			a = _mm256_max_pd(a, b);
+		} else {
+			a = _mm256_add_pd(a, b);
+		}
+
+		_mm256_storeu_pd(result + i, a);
+	}
+	return i;
+}
+
+__attribute__((target("avx512f")))
+MSG_API size_t addIntsAVX512(int64_t * sums, const int32_t * values, size_t count) {
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m512i v = _mm512_cvtepi32_epi64(_mm256_loadu_si256((const __m256i *)(values + i)));
+		_mm512_storeu_si512((void *)(sums + i), _mm512_add_epi64(_mm512_loadu_si512((const void *)(sums + i)), v));
+	}
+	return i;
+}
+
+__attribute__((target("avx512f")))
+MSG_API size_t combineIntsAVX512(int32_t * result, const int32_t * values, size_t count, int operation) {
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m512i a = _mm512_loadu_si512((const void *)(result + i));
+		__m512i b = _mm512_loadu_si512((const void *)(values + i));
+
+		if (operation == MSG_REDUCE_MIN) {
+			a = _mm512_min_epi32(a, b);
+		} else {
+			a = _mm512_max_epi32(a, b);
+		}
+
+		_mm512_storeu_si512((void *)(result + i), a);
+	}
+	return i;
+}
+
+__attribute__((target("avx512f")))
+MSG_API size_t combineFloatsAVX512(float * result, const float * values, size_t count, int operation) {
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m512 a = _mm512_loadu_ps(result + i);
+		__m512 b = _mm512_loadu_ps(values + i);
+
+		if (operation == MSG_REDUCE_MIN) {
+			a = _mm512_min_ps(a, b);
+		} else if (operation == MSG_REDUCE_MAX) {
+			a = _mm512_max_ps(a, b);
+		} else {
+			a = _mm512_add_ps(a, b);
+		}
+
+		_mm512_storeu_ps(result + i, a);
+	}
+	return i;
+}
+
+__attribute__((target("avx512f")))
+MSG_API size_t combineDoublesAVX512(double * result, const double * values, size_t count, int operation) {
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m512d a = _mm512_loadu_pd(result + i);
+		__m512d b = _mm512_loadu_pd(values + i);
+
+		if (operation == MSG_REDUCE_MIN) {
+			a = _mm512_min_pd(a, b);
+		} else if (operation == MSG_REDUCE_MAX) {
+			a = _mm512_max_pd(a, b);
+		} else {
+			a = _mm512_add_pd(a, b);
+		}
+
+		_mm512_storeu_pd(result + i, a);
+	}
+	return i;
+}
+#endif
+
+// Size in bytes of one value of a type reduceMessages understands, 0
+// for any other type.
+MSG_API size_t reduceValueSize(int type) {
+	switch (type) {
+	case MSG_TYPE_INT:    return sizeof(int32_t);
+	case MSG_TYPE_FLOAT:  return sizeof(float);
+	case MSG_TYPE_DOUBLE: return sizeof(double);
+	}
+	return 0;
+}
+
+// Folds count values of the given type into result with the given 
+// operation (MSG_REDUCE_MEAN adds). Integers are only taken with 
+// MSG_REDUCE_MIN and MSG_REDUCE_MAX (see addInts). Uses the widest 
+// vectors the CPU has, picked like the ones of streamingCopy.
+MSG_API void combineValues(void * result, const void * values, size_t count, int type, int operation) {
+	size_t done = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	int strategy = copyStrategy();
+
+	if (type == MSG_TYPE_INT) {
+		done = strategy == MSG_COPY_AVX512 ? combineIntsAVX512((int32_t *)result, (const int32_t *)values, count, operation) :
+			strategy == MSG_COPY_AVX2 ? combineIntsAVX2((int32_t *)result, (const int32_t *)values, count, operation) :
+			combineIntsSSE2((int32_t *)result, (const int32_t *)values, count, operation);
+	} else if (type == MSG_TYPE_FLOAT) {
+		done = strategy == MSG_COPY_AVX512 ? combineFloatsAVX512((float *)result, (const float *)values, count, operation) :
+			strategy == MSG_COPY_AVX2 ? combineFloatsAVX2((float *)result, (const float *)values, count, operation) :
+			combineFloatsSSE2((float *)result, (const float *)values, count, operation);
+	} else {
+		done = strategy == MSG_COPY_AVX512 ? combineDoublesAVX512((double *)result, (const double *)values, count, operation) :
+			strategy == MSG_COPY_AVX2 ? combineDoublesAVX2((double *)result, (const double *)values, count, operation) :
+			combineDoublesSSE2((double *)result, (const double *)values, count, operation);
+	}
+#endif
+
+	// Whatever doesn't fill a whole vector.
+	for (size_t i = done; i < count; ++i) {
+		if (type == MSG_TYPE_INT) {
+			int32_t * a = (int32_t *)result + i;
+			int32_t b   = ((const int32_t *)values)[i];
+			*a = operation == MSG_REDUCE_MIN ? (*a < b ? *a : b) : (*a > b ? *a : b);
+		} else if (type == MSG_TYPE_FLOAT) {
+			float * a = (float *)result + i;
+			float b   = ((const float *)values)[i];
+			*a = operation == MSG_REDUCE_MIN ? (*a < b ? *a : b) : 
+				operation == MSG_REDUCE_MAX ? (*a > b ? *a : b) : *a + b;
+		} else {
+			double * a = (double *)result + i;
+			double b   = ((const double *)values)[i];
+			*a = operation == MSG_REDUCE_MIN ? (*a < b ? *a : b) : 
+				operation == MSG_REDUCE_MAX ? (*a > b ? *a : b) : *a + b;
+		}
+	}
+}
+
+// Adds count integers to 64 bit sums.
+MSG_API void addInts(int64_t * sums, const int32_t * values, size_t count) {
+	size_t done = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	int strategy = copyStrategy();
+	done = strategy == MSG_COPY_AVX512 ? addIntsAVX512(sums, values, count) :
+		strategy == MSG_COPY_AVX2 ? addIntsAVX2(sums, values, count) : addIntsSSE2(sums, values, count);
+#endif
+
+	for (size_t i = done; i < count; ++i) {
+		sums[i] += values[i];
+	}
+}
+
+// Receives the next message from every rank of the group and combines
+// them into result, which has room for count values of the given type
+// (MSG_TYPE_INT, MSG_TYPE_FLOAT or MSG_TYPE_DOUBLE). operation is one of
+// the MSG_REDUCE_* values. Integers are added up in 64 bits, so the 
+// mean is always right (rounded toward zero); a sum that doesn't fit
+// in 32 bits is clamped to INT32_MIN or INT32_MAX and makes this 
+// return FALSE. Ranks are taken in order, so sums of floating point 
+// values come out the same every time. Every rank is released as soon
+// as its values have been added. Also returns FALSE if a rank sent a 
+// message of another type or length. Its values are then left out 
+// (the mean is taken over the other ranks), but the other ranks are 
+// still received.
+MSG_API bool reduceMessages(struct MPIControllerGroup * group, void * result, int count, int type, int operation) {
+	size_t valueSize = reduceValueSize(type);
+
+	if (valueSize == 0 || operation < MSG_REDUCE_SUM || operation > MSG_REDUCE_MEAN) {
+		printf("reduceMessages: unsupported type %d or operation %d\n", type, operation);
+		return false;
+	}
+
+	bool ok      = true;
+	int  reduced = 0;
+
+	// One buffer for the whole reduction, not one per rank.
+	int64_t * sums = NULL;
+	if (type == MSG_TYPE_INT && (operation == MSG_REDUCE_SUM || operation == MSG_REDUCE_MEAN)) {
+		sums = (int64_t *)calloc(count > 0 ? count : 1, sizeof(int64_t));
+	}
+
+	for (int r = 0; r < group->size; ++r) {
+		int code, length, messageType;
+		const void * values = recvMessageView(group->ranks[r], &code, &length, &messageType);
+
+		if (values == NULL) {
+			ok = false;
+			continue;
+		}
+
+		if (messageType != type || (size_t)length != (size_t)count * valueSize) {
+			printf("reduceMessages: rank %d sent %d bytes of type %d\n", r, length, messageType);
+			ok = false;
+		} else {
+			if (sums != NULL) {
+				addInts(sums, (const int32_t *)values, count);
+			} else if (reduced == 0) {
+				memcpy(result, values, length);
+			} else {
+				combineValues(result, values, count, type, operation);
+			}
+			reduced++;
+		}
+
+		releaseMessage(group->ranks[r]);
+	}
+
+	if (reduced == 0) {
+		free(sums);
+		return false;
+	}
+
+	if (sums != NULL) {
+		int32_t * values = (int32_t *)result;
+		bool clamped = false;
+
+		for (int i = 0; i < count; ++i) {
+			int64_t value = operation == MSG_REDUCE_MEAN ? sums[i] / reduced : sums[i];
+
+			if (value > INT32_MAX || value < INT32_MIN) {
+				value   = value > 0 ? INT32_MAX : INT32_MIN;
+				clamped = true;
+			}
+			values[i] = (int32_t)value;
+		}
+
+		if (clamped) {
+			printf("reduceMessages: sum does not fit in 32 bits\n");
+			ok = false;
+		}
+
+		free(sums);
+		return ok;
+	}
+
+	if (operation == MSG_REDUCE_MEAN) {
+		for (int i = 0; i < count; ++i) {
+			if (type == MSG_TYPE_FLOAT) {
+				((float *)result)[i] /= reduced;
+			} else {
+				((double *)result)[i] /= reduced;
+			}
+		}
+	}
+
+	return ok;
+}
+
+// ----------------------------------------------
+// Result queue
+// ----------------------------------------------
+// An instance only carries one message in each direction at a time, so
+// when many ranks have results to report they have to take turns (or
+// send them to rank 0 first). A result queue is shared by the whole 
+// world instead: every process can send to it at the same time 
+// without locking and the controller receives whatever has arrived in
+// one go. Every result carries the rank that sent it.
+//
+// Controller:
+//     queue = createResultQueue(name, 0, 0);  // before starting mpirun
+//     while ((count = drainResults(queue, results, 64, -1)) > 0) {
+//         // handle results[0 .. count - 1]
+//         releaseResults(queue);
+//     }
+//
+// Any rank:
+//     queue = openResultQueue(name);
+//     enqueueResult(queue, rank, &value, code, sizeof(value), type);
+
+// Constructs the name of the shared memory object of a result queue.
+MSG_API void getResultQueueName(char * buffer, char * base) {
+	snprintf(buffer, MSG_MAX_NAME, "/%s_results", base);
+}
+
+MSG_API struct MPIResultSlot * resultSlot(struct MPIResultQueue * queue, uint64_t position) {
+	return (struct MPIResultSlot *)(queue->slots + (position & (queue->block->slots - 1)) * queue->stride);
+}
+
+// Maps a result queue segment of the given size. The slots can only 
+// be found once the slot size is known.
+MSG_API bool mapResultQueue(struct MPIResultQueue * queue, int fd, size_t size) {
+	void * mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (mapped == (void *)-1) {
+		printf("mmap failed\n");
+		return false;
+	}
+
+	queue->size   = size;
+	queue->block  = (struct MPIResultQueueBlock *)mapped;
+	queue->slots  = (char *)mapped + sizeof(struct MPIResultQueueBlock);
+	return true;
+}
+
+// Called by the controller, normally before the processes that send 
+// results are started. slots is rounded up to a power of two and 
+// slotSize, the largest result that can be sent, to a whole cache 
+// line. Pass 0 for either to use the defaults. Returns NULL if the 
+// shared memory couldn't be set up.
+MSG_API struct MPIResultQueue * createResultQueue(char * name, int slots, int slotSize) {
+	uint32_t count = slots > 0 ? slots : MSG_RESULTS_DEFAULT_SLOTS;
+	count = count > 1 ? 1u << (32 - __builtin_clz(count - 1)) : 1;
+
+	uint32_t size = slotSize > 0 ? slotSize : MSG_RESULTS_DEFAULT_SLOT_SIZE;
+	size = (size + MSG_CACHE_LINE - 1) & ~(uint32_t)(MSG_CACHE_LINE - 1);
+
+	struct MPIResultQueue * queue = (struct MPIResultQueue *)calloc(1, sizeof(struct MPIResultQueue));
+	queue->owner = true;
+	getResultQueueName(queue->segmentName, name);
+
+	// A queue left behind by a crashed controller might still have
+	// processes attached to it, so start over with a new object.
+	shm_unlink(queue->segmentName);
+	int fd = shm_open(queue->segmentName, O_RDWR | O_CREAT | O_EXCL, 0777);
+
+	if (fd == -1) {
+		printf("shm_open failed for %s\n", queue->segmentName);
+		free(queue);
+		return NULL;
+	}
+
+	size_t total = sizeof(struct MPIResultQueueBlock) + (size_t)count * (sizeof(struct MPIResultSlot) + size);
+
+	if (ftruncate(fd, total) == -1) {
+		printf("ftruncate failed\n");
+		close(fd);
+		shm_unlink(queue->segmentName);
+		free(queue);
+		return NULL;
+	}
+
+	if (!mapResultQueue(queue, fd, total)) {
+		close(fd);
+		shm_unlink(queue->segmentName);
+		free(queue);
+		return NULL;
+	}
+
+	close(fd);
+
+	queue->block->slots    = count;
+	queue->block->slotSize = size;
+	queue->stride = sizeof(struct MPIResultSlot) + size;
+	for (uint64_t i = 0; i < count; ++i) {
+		resultSlot(queue, i)->sequence = i;
+	}
+
+	queue->block->version = MSG_RESULTS_VERSION;
+	__atomic_store_n(&queue->block->magic, MSG_RESULTS_MAGIC, __ATOMIC_RELEASE);
+
+	return queue;
+}
+
+// Called by every process that sends results. Waits up to 
+// MSG_ATTACH_TIMEOUT_MS for the controller to create the queue and 
+// returns NULL if it doesn't.
+MSG_API struct MPIResultQueue * openResultQueue(char * name) {
+	struct MPIResultQueue * queue = (struct MPIResultQueue *)calloc(1, sizeof(struct MPIResultQueue));
+	getResultQueueName(queue->segmentName, name);
+
+	for (int waited = 0; ; ++waited) {
+		int fd = shm_open(queue->segmentName, O_RDWR, 0777);
+
+		struct stat s;
+		if (fd != -1 && fstat(fd, &s) != -1 && (size_t)s.st_size > sizeof(struct MPIResultQueueBlock)) {
+			if (!mapResultQueue(queue, fd, s.st_size)) {
+				close(fd);
+				free(queue);
+				return NULL;
+			}
+
+			close(fd);
+
+			if (__atomic_load_n(&queue->block->magic, __ATOMIC_ACQUIRE) == MSG_RESULTS_MAGIC) {
+				if (queue->block->version != MSG_RESULTS_VERSION) {
+					printf("%s was not created by a compatible controller\n", queue->segmentName);
+					munmap(queue->block, queue->size);
+					free(queue);
+					return NULL;
+				}
+
+				queue->stride = sizeof(struct MPIResultSlot) + queue->block->slotSize;
+				return queue;
+			}
+
+			munmap(queue->block, queue->size);
+		} else if (fd != -1) {
+			close(fd);
+		}
+
+		if (waited >= MSG_ATTACH_TIMEOUT_MS) {
+			printf("timed out waiting for %s\n", queue->segmentName);
+			free(queue);
+			return NULL;
+		}
+
+		usleep(1000);
+	}
+}
+
+// Sends a result from the given rank. Only blocks while every slot is
+// taken. Returns FALSE, without sending anything, if the result is 
+// larger than the queue's slots.
+MSG_API bool enqueueResult(struct MPIResultQueue * queue, int rank, void * data, int code, int length, int type) {
+	struct MPIResultQueueBlock * block = queue->block;
+
+	if (length < 0 || (uint32_t)length > block->slotSize) {
+		printf("result of %d bytes does not fit in a slot of %u\n", length, block->slotSize);
+		return false;
+	}
+
+	uint64_t position = __atomic_load_n(&block->enqueuePosition, __ATOMIC_RELAXED);
+	struct MPIResultSlot * slot;
+
+	while (true) {
+		slot = resultSlot(queue, position);
+		uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+		if (sequence == position) {
+			// The slot is free; try to take it before another producer does.
+			if (__atomic_compare_exchange_n(&block->enqueuePosition, &position, position + 1, 
+				true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (sequence < position) {
+			// Every slot is taken. Same protocol as the ring's 
+			// producerWaiting: register, then check once more.
+			__atomic_fetch_add(&block->producersWaiting, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) < position) {
+				waitSemaphore(&block->space, MSG_WAIT_BLOCK, 0);
+			}
+			__atomic_fetch_sub(&block->producersWaiting, 1, __ATOMIC_SEQ_CST);
+			position = __atomic_load_n(&block->enqueuePosition, __ATOMIC_RELAXED);
+		} else {
+			// Somebody else took it.
+			position = __atomic_load_n(&block->enqueuePosition, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->rank   = rank;
+	slot->code   = code;
+	slot->type   = type;
+	slot->length = length;
+	memcpy(slot + 1, data, length);
+
+	__atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+	postSemaphore(&block->ready);
+
+	return true;
+}
+
+// Hands the slots of the results returned by the last drainResults
+// back to the producers. Called automatically by the next drainResults.
+MSG_API void releaseResults(struct MPIResultQueue * queue) {
+	struct MPIResultQueueBlock * block = queue->block;
+	uint64_t position = block->dequeuePosition;
+
+	for (int i = 0; i < queue->pending; ++i) {
+		__atomic_store_n(&resultSlot(queue, position + i)->sequence, 
+			position + i + block->slots, __ATOMIC_SEQ_CST);
+	}
+
+	block->dequeuePosition = position + queue->pending;
+	queue->pending = 0;
+
+	uint32_t waiting = __atomic_load_n(&block->producersWaiting, __ATOMIC_SEQ_CST);
+	if (waiting > 0) {
+		postSemaphoreCount(&block->space, waiting);
+	}
+}
+
+// Called by the controller. Waits up to timeout milliseconds (forever
+// if negative, not at all if 0) for a result, then receives every 
+// result that has arrived, up to max of them, into results. Returns 
+// the number of results received. Their data stays in the queue, 
+// and producers can't reuse their slots, until releaseResults is called.
+// Results come out in the order their slots were reserved, so one that
+// is still being copied holds back those after it until the next call.
+MSG_API int drainResults(struct MPIResultQueue * queue, struct MPIResult * results, int max, int timeout) {
+	struct MPIResultQueueBlock * block = queue->block;
+	uint64_t deadline = monotonicNanoseconds() + (uint64_t)(timeout < 0 ? 0 : timeout) * 1000000ull;
+
+	if (queue->pending > 0) {
+		releaseResults(queue);
+	}
+
+	if (max <= 0) {
+		return 0;
+	}
+
+	bool first;
+	if (timeout < 0) {
+		waitSemaphore(&block->ready, MSG_WAIT_BLOCK, 0);
+		first = true;
+	} else if (timeout == 0) {
+		first = tryWaitSemaphore(&block->ready);
+	} else {
+		first = waitSemaphoreTimed(&block->ready, MSG_WAIT_BLOCK, 0, (uint64_t)timeout * 1000000ull);
+	}
+
+	if (!first) {
+		return 0;
+	}
+
+	int count = 1;
+	while (count < max && tryWaitSemaphore(&block->ready)) {
+		count++;
+	}
+
+	uint64_t position = block->dequeuePosition;
+
+	int received;
+	for (received = 0; received < count; ++received) {
+		int i = received;
+		struct MPIResultSlot * slot = resultSlot(queue, position + i);
+
+		// Producers commit in whatever order they finish, so one that
+		// reserved an earlier slot may still be copying its result, or
+		// may have died doing so. Whatever follows it waits for the next
+		// call; the first slot is waited for until the deadline.
+		bool ready = true;
+		for (int spin = 0; __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != position + i + 1; ++spin) {
+			if (i > 0 || (timeout >= 0 && monotonicNanoseconds() >= deadline)) {
+				ready = false;
+				break;
+			}
+
+			if (spin < MSG_DEFAULT_SPIN_COUNT) {
+				cpuRelax();
+			} else {
+				sched_yield();
+			}
+		}
+
+		if (!ready) {
+			break;
+		}
+
+		results[i].rank   = slot->rank;
+		results[i].code   = slot->code;
+		results[i].type   = slot->type;
+		results[i].length = slot->length;
+		results[i].data   = slot + 1;
+	}
+
+	// The posts of the results left behind belong to the next call.
+	if (received < count) {
+		postSemaphoreCount(&block->ready, count - received);
+	}
+
+	queue->pending = received;
+	return received;
+}
+
+// Unmaps the queue. The controller also removes it, so it can't be 
+// opened anymore; processes that have it open can keep using it.
+MSG_API void destroyResultQueue(struct MPIResultQueue * queue) {
+	munmap(queue->block, queue->size);
+
+	if (queue->owner) {
+		shm_unlink(queue->segmentName);
+	}
+
+	free(queue);
+}
+
+// ----------------------------------------------
+// Shared arrays
+// ----------------------------------------------
+// Large data that changes rarely (meshes, lookup tables) doesn't need
+// to be copied into every message. It can live in a shared array that
+// both sides map once. Messages then only carry a handle that says 
+// which part of which array to look at, and after an update, only the
+// ranges that changed. Arrays are identified by a number and belong to
+// a named registry, which every process that uses them opens; they 
+// stay around until the last process that mapped them releases them.
+// The data is read in place, so the sender shouldn't change a range 
+// again until the receiver is done with it.
+//
+// Sender:
+//     registry = openArrayRegistry("tables");
+//     array    = createSharedArray(registry, 1, size);
+//     fill(array->data);
+//     sendSharedArray(instance, array, code);
+//     ...
+//     change(array->data + offset, length);
+//     markArrayDirty(array, offset, length);
+//     sendArrayUpdate(instance, array, code);
+//
+// Receiver:
+//     message = recvMessageView(instance, &code, &length, &type);
+//     if (type == MSG_TYPE_HANDLE) {
+//         const struct MPIHandle * handles = message;
+//         for (int i = 0; i < length / sizeof(struct MPIHandle); ++i) {
+//             const char * data = resolveHandle(registry, &handles[i]);
+//             // handles[i].length bytes at data have changed
+//         }
+//     }
+//     releaseMessage(instance);
+
+// Constructs the name of the shared memory object of a shared array.
+// Returns FALSE if it doesn't fit; cut short, it could be the name of
+// another array.
+MSG_API bool getSharedArrayName(char * buffer, char * registry, uint32_t id) {
+	if (snprintf(buffer, MSG_MAX_NAME, "/%s_array_%u", registry, id) >= MSG_MAX_NAME) {
+		printf("registry name %s is too long for array %u\n", registry, id);
+		return false;
+	}
+
+	return true;
+}
+
+// Opens the registry with the given name. Nothing is mapped until an
+// array is created or opened.
+MSG_API struct MPIArrayRegistry * openArrayRegistry(char * name) {
+	struct MPIArrayRegistry * registry = (struct MPIArrayRegistry *)calloc(1, sizeof(struct MPIArrayRegistry));
+	snprintf(registry->name, MSG_MAX_NAME, "%s", name);
+	return registry;
+}
+
+// Returns the registry's mapping of the given array, NULL if this 
+// process doesn't have it mapped.
+MSG_API struct MPISharedArray * findSharedArray(struct MPIArrayRegistry * registry, uint32_t id) {
+	for (struct MPISharedArray * array = registry->arrays; array != NULL; array = array->next) {
+		if (array->id == id) {
+			return array;
+		}
+	}
+
+	return NULL;
+}
+
+// Maps the shared array behind fd and adds it to the registry.
+MSG_API struct MPISharedArray * mapSharedArray(struct MPIArrayRegistry * registry, uint32_t id, int fd, size_t size) {
+	void * mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (mapped == (void *)-1) {
+		printf("mmap failed\n");
+		return NULL;
+	}
+
+	struct MPISharedArray * array = (struct MPISharedArray *)calloc(1, sizeof(struct MPISharedArray));
+	array->id     = id;
+	array->block  = (struct MPISharedArrayBlock *)mapped;
+	array->length = size - sizeof(struct MPISharedArrayBlock);
+	array->data   = (char *)mapped + sizeof(struct MPISharedArrayBlock);
+	array->next   = registry->arrays;
+
+	registry->arrays = array;
+	return array;
+}
+
+// Removes the array from the registry and unmaps it, without touching
+// its reference count.
+MSG_API void unmapSharedArray(struct MPIArrayRegistry * registry, struct MPISharedArray * array) {
+	for (struct MPISharedArray ** link = &registry->arrays; *link != NULL; link = &(*link)->next) {
+		if (*link == array) {
+			*link = array->next;
+			break;
+		}
+	}
+
+	munmap(array->block, sizeof(struct MPISharedArrayBlock) + array->length);
+	free(array);
+}
+
+// Creates a shared array of the given length, filled with zeros, that
+// replaces any array with the same id. Returns NULL if the shared 
+// memory couldn't be set up.
+MSG_API struct MPISharedArray * createSharedArray(struct MPIArrayRegistry * registry, uint32_t id, size_t length) {
+	if (findSharedArray(registry, id) != NULL) {
+		printf("shared array %u is already mapped\n", id);
+		return NULL;
+	}
+
+	char segmentName[MSG_MAX_NAME];
+	if (!getSharedArrayName(segmentName, registry->name, id)) {
+		return NULL;
+	}
+
+	shm_unlink(segmentName);
+	int fd = shm_open(segmentName, O_RDWR | O_CREAT | O_EXCL, 0777);
+
+	if (fd == -1) {
+		printf("shm_open failed for %s\n", segmentName);
+		return NULL;
+	}
+
+	size_t size = sizeof(struct MPISharedArrayBlock) + length;
+
+	if (ftruncate(fd, size) == -1) {
+		printf("ftruncate failed\n");
+		close(fd);
+		shm_unlink(segmentName);
+		return NULL;
+	}
+
+	struct MPISharedArray * array = mapSharedArray(registry, id, fd, size);
+	close(fd);
+
+	if (array == NULL) {
+		shm_unlink(segmentName);
+		return NULL;
+	}
+
+	array->block->refcount = 1;
+	array->block->length   = length;
+	array->block->version  = monotonicNanoseconds();
+	__atomic_store_n(&array->block->magic, MSG_ARRAY_MAGIC, __ATOMIC_RELEASE);
+
+	return array;
+}
+
+// Maps an existing shared array, or returns the mapping this process
+// already has. Returns NULL if there is no such array.
+MSG_API struct MPISharedArray * openSharedArray(struct MPIArrayRegistry * registry, uint32_t id) {
+	struct MPISharedArray * array = findSharedArray(registry, id);
+
+	if (array != NULL) {
+		return array;
+	}
+
+	char segmentName[MSG_MAX_NAME];
+	if (!getSharedArrayName(segmentName, registry->name, id)) {
+		return NULL;
+	}
+
+	int fd = shm_open(segmentName, O_RDWR, 0777);
+
+	if (fd == -1) {
+		return NULL;
+	}
+
+	struct stat s;
+	if (fstat(fd, &s) == -1 || (size_t)s.st_size < sizeof(struct MPISharedArrayBlock)) {
+		close(fd);
+		return NULL;
+	}
+
+	array = mapSharedArray(registry, id, fd, s.st_size);
+	close(fd);
+
+	if (array == NULL) {
+		return NULL;
+	}
+
+	// The last owner may be releasing it right now; don't bring it back.
+	uint32_t count = __atomic_load_n(&array->block->refcount, __ATOMIC_ACQUIRE);
+	while (__atomic_load_n(&array->block->magic, __ATOMIC_ACQUIRE) == MSG_ARRAY_MAGIC && count > 0) {
+		if (__atomic_compare_exchange_n(&array->block->refcount, &count, count + 1, 
+			true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			return array;
+		}
+	}
+
+	unmapSharedArray(registry, array);
+	return NULL;
+}
+
+// Unmaps the array and drops this process's reference to it. The last 
+// process to release an array removes it.
+MSG_API void releaseSharedArray(struct MPIArrayRegistry * registry, struct MPISharedArray * array) {
+	if (__atomic_sub_fetch(&array->block->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		char segmentName[MSG_MAX_NAME];
+		if (getSharedArrayName(segmentName, registry->name, array->id)) {
+			shm_unlink(segmentName);
+		}
+	}
+
+	unmapSharedArray(registry, array);
+}
+
+// Releases every array of the registry and frees it.
+MSG_API void closeArrayRegistry(struct MPIArrayRegistry * registry) {
+	while (registry->arrays != NULL) {
+		releaseSharedArray(registry, registry->arrays);
+	}
+
+	free(registry);
+}
+
+// Records that length bytes starting at offset have changed, to be 
+// sent by sendArrayUpdate. Overlapping and adjacent ranges are merged,
+// and once there are too many to keep apart, the two closest ones are.
+MSG_API void markArrayDirty(struct MPISharedArray * array, size_t offset, size_t length) {
+	if (length == 0 || offset >= array->length) {
+		return;
+	}
+	if (length > array->length - offset) {
+		length = array->length - offset;
+	}
+
+	uint64_t start = offset;
+	uint64_t end   = offset + length;
+
+	// Swallow every range the new one touches.
+	for (int i = 0; i < array->dirtyCount; ) {
+		struct MPIDirtyRange * range = &array->dirty[i];
+
+		if (range->offset <= end && range->offset + range->length >= start) {
+			if (range->offset < start) {
+				start = range->offset;
+			}
+			if (range->offset + range->length > end) {
+				end = range->offset + range->length;
+			}
+			array->dirty[i] = array->dirty[--array->dirtyCount];
+		} else {
+			++i;
+		}
+	}
+
+	if (array->dirtyCount == MSG_ARRAY_DIRTY_RANGES) {
+		// Merge the new range with the existing one closest to it.
+		int closest = 0;
+		uint64_t closestGap = UINT64_MAX;
+
+		for (int i = 0; i < array->dirtyCount; ++i) {
+			struct MPIDirtyRange * range = &array->dirty[i];
+			uint64_t gap = range->offset > end ? range->offset - end : start - (range->offset + range->length);
+
+			if (gap < closestGap) {
+				closestGap = gap;
+				closest    = i;
+			}
+		}
+
+		struct MPIDirtyRange * range = &array->dirty[closest];
+		if (range->offset < start) {
+			start = range->offset;
+		}
+		if (range->offset + range->length > end) {
+			end = range->offset + range->length;
+		}
+		array->dirty[closest] = array->dirty[--array->dirtyCount];
+	}
+
+	array->dirty[array->dirtyCount].offset = start;
+	array->dirty[array->dirtyCount].length = end - start;
+	array->dirtyCount++;
+}
+
+// Sends a handle to the whole array, for a receiver that hasn't seen
+// it yet. Clears the dirty ranges.
+MSG_API void sendSharedArray(struct MPIController * instance, struct MPISharedArray * array, int code) {
+	struct MPIHandle handle;
+	handle.id      = array->id;
+	handle.pad     = 0;
+	handle.offset  = 0;
+	handle.length  = array->length;
+	handle.version = __atomic_add_fetch(&array->block->version, 1, __ATOMIC_RELEASE);
+
+	array->dirtyCount = 0;
+	sendMessage(instance, &handle, code, sizeof(handle), MSG_TYPE_HANDLE);
+}
+
+// Sends one handle for every range marked with markArrayDirty since 
+// the array was last sent, all in one message, and clears them. 
+// Returns the number of ranges sent; nothing is sent if there are none.
+MSG_API int sendArrayUpdate(struct MPIController * instance, struct MPISharedArray * array, int code) {
+	int count = array->dirtyCount;
+
+	if (count == 0) {
+		return 0;
+	}
+
+	uint64_t version = __atomic_add_fetch(&array->block->version, 1, __ATOMIC_RELEASE);
+
+	struct MPIHandle * handles = (struct MPIHandle *)acquireSendBuffer(instance, count * sizeof(struct MPIHandle));
+
+	if (handles == NULL) {
+		return 0;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		handles[i].id      = array->id;
+		handles[i].pad     = 0;
+		handles[i].offset  = array->dirty[i].offset;
+		handles[i].length  = array->dirty[i].length;
+		handles[i].version = version;
+	}
+
+	array->dirtyCount = 0;
+	commitSend(instance, code, MSG_TYPE_HANDLE);
+
+	return count;
+}
+
+// Returns a pointer to the data a received handle refers to, mapping
+// the array the first time one of its handles is resolved. The mapping
+// is kept until the array is released. A handle newer than the array
+// mapped under its id means the array has been created again since, so
+// the old mapping is dropped and the new array mapped. Returns NULL if 
+// the array doesn't exist or is smaller than the handle says.
+MSG_API const void * resolveHandle(struct MPIArrayRegistry * registry, const struct MPIHandle * handle) {
+	struct MPISharedArray * array = openSharedArray(registry, handle->id);
+
+	if (array != NULL && handle->version > __atomic_load_n(&array->block->version, __ATOMIC_ACQUIRE)) {
+		// Its name belongs to the new array now; don't remove it.
+		__atomic_sub_fetch(&array->block->refcount, 1, __ATOMIC_ACQ_REL);
+		unmapSharedArray(registry, array);
+
+		array = openSharedArray(registry, handle->id);
+
+		if (array != NULL && handle->version > __atomic_load_n(&array->block->version, __ATOMIC_ACQUIRE)) {
+			printf("handle to array %u is newer than the array\n", handle->id);
+			return NULL;
+		}
+	}
+
+	if (array == NULL || handle->offset > array->length || handle->length > array->length - handle->offset) {
+		return NULL;
+	}
+
+	return (const char *)array->data + handle->offset;
+}
+
+// ----------------------------------------------
+// RPC
+// ----------------------------------------------
+// Calls that are answered by handlers on the other side. Each call
+// gets a ticket, and its reply is matched to it by that, so any 
+// number of calls can be in flight at once instead of paying a round
+// trip for each. One side of an instance makes calls and the other 
+// serves them; the instance shouldn't carry anything else meanwhile.
+// Replies are only picked up while the caller is inside one of the 
+// functions below, and a caller that is waiting to send picks up 
+// replies in the meantime, so the two sides never wait for each other.
+// Works in both channel modes, but only ring mode lets the server
+// receive the next call while the caller sends it.
+//
+// Child (server):
+//     rpc = createRpc(instance, 0);
+//     registerHandler(rpc, CODE_LOOKUP, lookup, &table);
+//     serveCalls(rpc, -1);
+//
+// Controller (caller):
+//     rpc = createRpc(instance, 0);
+//     for (i = 0; i < n; ++i) tickets[i] = callAsync(rpc, CODE_LOOKUP, &keys[i], sizeof(int), MSG_TYPE_INT);
+//     for (i = 0; i < n; ++i) values[i] = waitCall(rpc, tickets[i], &length, &type, &status);
+
+// Sets up the RPC layer of an instance. slots is the number of calls
+// that are expected to be in flight at once, rounded up to a power of
+// two; 0 uses MSG_RPC_DEFAULT_SLOTS. More are fine, but make the table
+// of calls grow.
+MSG_API struct MPIRpc * createRpc(struct MPIController * instance, int slots) {
+	int count = slots > 0 ? slots : MSG_RPC_DEFAULT_SLOTS;
+	count = count > 1 ? 1 << (32 - __builtin_clz(count - 1)) : 1;
+
+	struct MPIRpc * rpc = (struct MPIRpc *)calloc(1, sizeof(struct MPIRpc));
+	rpc->instance = instance;
+	rpc->nextId   = 1;
+	rpc->slots    = count;
+	rpc->calls    = (struct MPICall *)calloc(count, sizeof(struct MPICall));
+
+	return rpc;
+}
+
+// Frees the RPC layer. Replies that haven't been collected are lost.
+MSG_API void destroyRpc(struct MPIRpc * rpc) {
+	for (int i = 0; i < rpc->slots; ++i) {
+		free(rpc->calls[i].data);
+	}
+
+	free(rpc->calls);
+	free(rpc->handlers);
+	free(rpc);
+}
+
+// Makes handler serve the calls with the given code, replacing the 
+// handler registered for it before, if any. context is passed to it.
+MSG_API void registerHandler(struct MPIRpc * rpc, int code, MPICallHandler handler, void * context) {
+	for (int i = 0; i < rpc->handlerCount; ++i) {
+		if (rpc->handlers[i].code == code) {
+			rpc->handlers[i].handler = handler;
+			rpc->handlers[i].context = context;
+			return;
+		}
+	}
+
+	rpc->handlers = (struct MPICallRegistration *)realloc(rpc->handlers, 
+		(rpc->handlerCount + 1) * sizeof(struct MPICallRegistration));
+	rpc->handlers[rpc->handlerCount].code    = code;
+	rpc->handlers[rpc->handlerCount].handler = handler;
+	rpc->handlers[rpc->handlerCount].context = context;
+	rpc->handlerCount++;
+}
+
+// Completes every call in flight with MSG_RPC_LOST.
+MSG_API void failCalls(struct MPIRpc * rpc) {
+	for (int i = 0; i < rpc->slots; ++i) {
+		struct MPICall * call = &rpc->calls[i];
+
+		if (call->id != 0 && !call->done) {
+			call->done   = true;
+			call->status = MSG_RPC_LOST;
+			call->length = 0;
+			call->type   = 0;
+		}
+	}
+}
+
+// Picks up the replies that have arrived, waiting up to timeout 
+// milliseconds for the first one (forever if negative). Returns the 
+// number of replies picked up.
+MSG_API int progressCalls(struct MPIRpc * rpc, int timeout) {
+	struct MPIController * instance = rpc->instance;
+	int count = 0;
+	int code, length, type;
+	const void * view;
+
+	while ((view = recvMessageViewTimed(instance, &code, &length, &type, count == 0 ? timeout : 0)) != NULL) {
+		if (type == MSG_TYPE_DETACH || instance->peerLost) {
+			releaseMessage(instance);
+			failCalls(rpc);
+			return count;
+		}
+
+		const struct MPICallHeader * header = (const struct MPICallHeader *)view;
+		struct MPICall * call = NULL;
+
+		if (type == MSG_TYPE_REPLY && length >= (int)sizeof(struct MPICallHeader)) {
+			call = &rpc->calls[header->id & (rpc->slots - 1)];
+		}
+
+		if (call == NULL || call->id != header->id || call->done) {
+			printf("dropped a message that isn't the reply to a call (type %d)\n", type);
+		} else {
+			call->length = length - sizeof(struct MPICallHeader);
+			call->type   = header->type;
+			call->status = header->status;
+			call->data   = malloc(call->length);
+			memcpy(call->data, header + 1, call->length);
+			call->done   = true;
+		}
+
+		releaseMessage(instance);
+		count++;
+	}
+
+	return count;
+}
+
+// Sends a call or a reply. While it can't be sent right away, replies
+// are picked up (when calls are in flight) so that the other side, 
+// which may be waiting to send one of them, can get to the message 
+// that is in the way.
+MSG_API void sendCallMessage(struct MPIRpc * rpc, int code, uint64_t id, int status, const void * data, 
+	int length, int type, int messageType) {
+	struct MPIController * instance = rpc->instance;
+	int total = sizeof(struct MPICallHeader) + length;
+
+	if (messageType == MSG_TYPE_CALL) {
+		while (!canSend(instance, total)) {
+			progressCalls(rpc, 1);
+
+			if (instance->peerLost) {
+				return;
+			}
+		}
+	}
+
+	struct MPICallHeader * header = (struct MPICallHeader *)acquireSendBuffer(instance, total);
+
+	if (header == NULL) {
+		return;
+	}
+
+	header->id     = id;
+	header->type   = type;
+	header->status = status;
+	if (length > 0) {
+		memcpy(header + 1, data, length);
+	}
+
+	// Calls don't wait for delivery; canSend waits before the next one.
+	postSend(instance, code, messageType);
+	if (messageType == MSG_TYPE_REPLY) {
+		finishSend(instance);
+	}
+}
+
+// Doubles the table of calls until the call with the given id has a 
+// free slot in it.
+MSG_API void growCalls(struct MPIRpc * rpc, uint64_t id) {
+	int slots = rpc->slots;
+	struct MPICall * calls;
+	bool fits;
+
+	do {
+		slots *= 2;
+		calls = (struct MPICall *)calloc(slots, sizeof(struct MPICall));
+		fits  = true;
+
+		for (int i = 0; i < rpc->slots && fits; ++i) {
+			struct MPICall * call = &rpc->calls[i];
+			if (call->id == 0) {
+				continue;
+			}
+
+			struct MPICall * slot = &calls[call->id & (slots - 1)];
+			fits = slot->id == 0;
+			*slot = *call;
+		}
+
+		fits = fits && calls[id & (slots - 1)].id == 0;
+		if (!fits) {
+			free(calls);
+		}
+	} while (!fits);
+
+	free(rpc->calls);
+	rpc->calls = calls;
+	rpc->slots = slots;
+}
+
+// Calls the handler registered for code on the other side with length
+// bytes of arguments of the given type. Returns right after sending 
+// the call, with the ticket to collect the result with; only waits 
+// for room in the channel. Returns 0 if the call can't be made.
+MSG_API uint64_t callAsync(struct MPIRpc * rpc, int code, const void * args, int length, int type) {
+	if (rpc->instance->peerLost) {
+		return 0;
+	}
+
+	uint64_t id = rpc->nextId;
+
+	if (rpc->calls[id & (rpc->slots - 1)].id != 0) {
+		growCalls(rpc, id);
+	}
+
+	struct MPICall * call = &rpc->calls[id & (rpc->slots - 1)];
+
+	rpc->nextId++;
+	call->id   = id;
+	call->done = false;
+	call->data = NULL;
+
+	sendCallMessage(rpc, code, id, 0, args, length, type, MSG_TYPE_CALL);
+
+	return id;
+}
+
+// Returns TRUE if the result of the call is ready to be collected with
+// waitCall. Picks up whatever replies have arrived, but never waits.
+MSG_API bool pollCall(struct MPIRpc * rpc, uint64_t ticket) {
+	struct MPICall * call = &rpc->calls[ticket & (rpc->slots - 1)];
+
+	if (call->id != ticket) {
+		return false;
+	}
+
+	if (!call->done) {
+		progressCalls(rpc, 0);
+	}
+
+	return call->done;
+}
+
+// Waits for the result of a call and collects it. Returns the result,
+// which the caller has to free, and sets length, type and status (the
+// value the handler returned, or one of MSG_RPC_*). Returns NULL and
+// sets status to MSG_RPC_LOST if the ticket isn't a call in flight.
+MSG_API void * waitCall(struct MPIRpc * rpc, uint64_t ticket, int * length, int * type, int * status) {
+	struct MPICall * call = &rpc->calls[ticket & (rpc->slots - 1)];
+
+	if (ticket == 0 || call->id != ticket) {
+		*length = 0;
+		*type   = 0;
+		*status = MSG_RPC_LOST;
+		return NULL;
+	}
+
+	while (!call->done) {
+		progressCalls(rpc, -1);
+	}
+
+	void * result = call->data;
+	*length = call->length;
+	*type   = call->type;
+	*status = call->status;
+
+	call->id   = 0;
+	call->data = NULL;
+
+	return result;
+}
+
+// Makes a call and waits for its result. See callAsync and waitCall.
+MSG_API void * callAndWait(struct MPIRpc * rpc, int code, const void * args, int length, int type, 
+	int * resultLength, int * resultType, int * status) {
+	uint64_t ticket = callAsync(rpc, code, args, length, type);
+	return waitCall(rpc, ticket, resultLength, resultType, status);
+}
+
+// Serves calls as they arrive, until none arrives for timeout 
+// milliseconds (never, if negative) or the controller of a persistent
+// world detaches, which sets rpc->detached. Returns the number of 
+// calls served. Messages that aren't calls are dropped.
+MSG_API int serveCalls(struct MPIRpc * rpc, int timeout) {
+	struct MPIController * instance = rpc->instance;
+	int served = 0;
+	int code, length, type;
+	const void * view;
+
+	while ((view = recvMessageViewTimed(instance, &code, &length, &type, timeout)) != NULL) {
+		if (type == MSG_TYPE_DETACH) {
+			releaseMessage(instance);
+			rpc->detached = true;
+			return served;
+		}
+
+		if (type != MSG_TYPE_CALL || length < (int)sizeof(struct MPICallHeader)) {
+			printf("dropped a message that isn't a call (type %d)\n", type);
+			releaseMessage(instance);
+			continue;
+		}
+
+		const struct MPICallHeader * header = (const struct MPICallHeader *)view;
+		uint64_t id = header->id;
+
+		struct MPIReply reply = { NULL, 0, 0 };
+		int status = MSG_RPC_NO_HANDLER;
+
+		for (int i = 0; i < rpc->handlerCount; ++i) {
+			if (rpc->handlers[i].code == code) {
+				status = rpc->handlers[i].handler(rpc->handlers[i].context, header + 1, 
+					length - sizeof(struct MPICallHeader), header->type, &reply);
+				break;
+			}
+		}
+
+		releaseMessage(instance);
+		sendCallMessage(rpc, code, id, status, reply.data, reply.length, reply.type, MSG_TYPE_REPLY);
+		served++;
+	}
+
+	return served;
+}
+
+// ----------------------------------------------
+// Streaming
+// ----------------------------------------------
+// Streams move an arbitrary amount of data (64 bit lengths) through a
+// fixed size window of slots in shared memory, so a multi-GB transfer
+// never needs a multi-GB payload area. The writer fills one slot while
+// the reader empties another, so the two copies overlap. A stream is 
+// announced with an ordinary message of type MSG_TYPE_STREAM, so it 
+// stays in order with the other messages in its direction.
+//
+// Sender:
+//     sendStreamBegin(inst, code, type, totalLength);
+//     sendStreamWrite(inst, data, length); // as often as needed
+//     sendStreamEnd(inst);  // FALSE if fewer bytes were written than announced
+//
+// Receiver:
+//     recvStreamBegin(inst, &code, &type, &totalLength);
+//     while ((n = recvStreamRead(inst, buffer, sizeof(buffer))) > 0) ...
+//     if (recvStreamEnd(inst) != 0) ... // the writer ended it short
+
+// Size of one slot of a stream window, including its header.
+MSG_API size_t streamSlotStride(struct MPIController * instance) {
+	return sizeof(struct MPIStreamSlot) + instance->control->streamSlotSize;
+}
+
+// Returns the header of the given slot of a mapped stream window.
+MSG_API struct MPIStreamSlot * streamSlot(struct MPIController * instance, struct MPIStream * stream) {
+	size_t index = stream->slot % instance->control->streamSlots;
+	return (struct MPIStreamSlot *)((char *)stream->window.data + index * streamSlotStride(instance));
+}
+
+// Maps the window of the given direction if it isn't mapped yet.
+MSG_API void syncStreamWindow(struct MPIController * instance, struct MPIDirection * direction, struct MPIStream * stream) {
+	if (stream->window.data != NULL && stream->window.generation == direction->streamGeneration) {
+		return;
+	}
+
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+	size_t size     = instance->control->streamSlots * streamSlotStride(instance);
+	size = ((size + pageSize - 1) / pageSize) * pageSize;
+
+	void * result = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, instance->fd, direction->streamOffset);
+
+	if (stream == &instance->sendStream) {
+		instance->stats->send.remaps++;
+	} else {
+		instance->stats->recv.remaps++;
+	}
+
+	if (result == (void *)-1) {
+		printf("mmap failed\n");
+		printf("errno: %d\n", errno);
+		return;
+	}
+
+	placeMapping(instance, result, size);
+
+	stream->window.data       = result;
+	stream->window.size       = size;
+	stream->window.generation = direction->streamGeneration;
+}
+
+// Announces a stream of totalLength bytes. The data itself is passed
+// to sendStreamWrite. In rendezvous mode this blocks until the 
+// receiver has called recvStreamBegin.
+MSG_API void sendStreamBegin(struct MPIController * instance, int code, int type, uint64_t totalLength) {
+	struct MPIDirection * direction = instance->sendDirection;
+	struct MPIStream * stream = &instance->sendStream;
+
+	if (stream->active) {
+		printf("sendStreamBegin called before ending the previous stream\n");
+		return;
+	}
+
+	if (!instance->transport->sharedMemory) {
+		printf("streams need shared memory\n");
+		return;
+	}
+
+	// The window is allocated the first time this direction streams.
+	// Every slot starts out empty.
+	if (direction->streamOffset == 0) {
+		size_t pageSize = sysconf(_SC_PAGESIZE);
+		size_t size     = instance->control->streamSlots * streamSlotStride(instance);
+		size = ((size + pageSize - 1) / pageSize) * pageSize;
+
+		uint64_t offset = allocateSegmentSpace(instance, size);
+
+		if (offset == 0) {
+			return;
+		}
+
+		direction->streamOffset = offset;
+		direction->streamGeneration++;
+		postSemaphoreCount(&direction->streamEmpty, instance->control->streamSlots);
+	}
+
+	syncStreamWindow(instance, direction, stream);
+
+	struct MPIStreamHeader * header = (struct MPIStreamHeader *)acquireSendBuffer(instance, sizeof(struct MPIStreamHeader));
+
+	if (header == NULL) {
+		return;
+	}
+
+	header->totalLength = totalLength;
+	header->type        = type;
+	header->pad         = 0;
+
+	stream->active    = true;
+	stream->remaining = totalLength;
+	stream->position  = 0;
+
+	commitSend(instance, code, MSG_TYPE_STREAM);
+}
+
+// Hands the current slot to the reader and moves on to the next one.
+MSG_API void sendStreamFlush(struct MPIController * instance) {
+	struct MPIStream * stream = &instance->sendStream;
+
+	if (stream->position == 0) {
+		return;
+	}
+
+	streamSlot(instance, stream)->length = stream->position;
+	postSemaphore(&instance->sendDirection->streamFilled);
+
+	stream->slot++;
+	stream->position = 0;
+}
+
+// Copies the next length bytes of the stream into the window. Blocks
+// whenever every slot is full until the reader frees one.
+MSG_API void sendStreamWrite(struct MPIController * instance, const void * data, size_t length) {
+	struct MPIStream * stream = &instance->sendStream;
+	size_t slotSize = instance->control->streamSlotSize;
+
+	if (!stream->active) {
+		printf("sendStreamWrite called without an active stream\n");
+		return;
+	}
+
+	if (length > stream->remaining) {
+		printf("sendStreamWrite called with more data than announced\n");
+		length = stream->remaining;
+	}
+
+	const char * source = (const char *)data;
+
+	while (length > 0) {
+		// Take a slot from the reader before writing to it.
+		if (stream->position == 0) {
+			waitForPeer(instance, &instance->sendDirection->streamEmpty, &instance->stats->send);
+		}
+
+		size_t count = slotSize - stream->position;
+		if (count > length) {
+			count = length;
+		}
+
+		char * slotData = (char *)streamSlot(instance, stream) + sizeof(struct MPIStreamSlot);
+
+		uint64_t start = statsClock(instance);
+		if (useStreamingCopy(instance, stream->remaining)) {
+			streamingCopy(slotData + stream->position, source, count);
+		} else {
+			memcpy(slotData + stream->position, source, count);
+		}
+		instance->stats->send.copyNanoseconds += statsClock(instance) - start;
+		instance->stats->send.bytes += count;
+
+		stream->position  += count;
+		stream->remaining -= count;
+		source += count;
+		length -= count;
+
+		if (stream->position == slotSize) {
+			sendStreamFlush(instance);
+		}
+	}
+}
+
+// Finishes the stream started by sendStreamBegin. If not every byte 
+// that was announced has been written, the stream is ended short: the
+// reader gets what was written, then recvStreamEnd fails, and this 
+// returns FALSE.
+MSG_API bool sendStreamEnd(struct MPIController * instance) {
+	struct MPIStream * stream = &instance->sendStream;
+
+	if (!stream->active) {
+		printf("sendStreamEnd called without an active stream\n");
+		return false;
+	}
+
+	sendStreamFlush(instance);
+	stream->active = false;
+
+	if (stream->remaining == 0) {
+		return true;
+	}
+
+	printf("sendStreamEnd called with %llu bytes left to write\n", (unsigned long long)stream->remaining);
+
+	// The reader waits for the rest of the bytes until it finds the 
+	// marker in the next slot.
+	waitForPeer(instance, &instance->sendDirection->streamEmpty, &instance->stats->send);
+	streamSlot(instance, stream)->length = MSG_STREAM_ABORTED;
+	postSemaphore(&instance->sendDirection->streamFilled);
+	stream->slot++;
+
+	return false;
+}
+
+// Waits for the next message, which has to be a stream announcement,
+// and gets ready to read the stream. Returns 0 on success and -1 if 
+// the next message isn't a stream. That message is left in place for
+// the next receive.
+MSG_API int recvStreamBegin(struct MPIController * instance, int * code, int * type, uint64_t * totalLength) {
+	struct MPIStream * stream = &instance->recvStream;
+
+	if (stream->active) {
+		printf("recvStreamBegin called before ending the previous stream\n");
+		return -1;
+	}
+
+	if (!instance->transport->sharedMemory) {
+		printf("streams need shared memory\n");
+		return -1;
+	}
+
+	int length;
+	int messageType;
+	const struct MPIStreamHeader * header = (const struct MPIStreamHeader *)recvMessageView(instance, code, &length, &messageType);
+
+	if (header == NULL) {
+		return -1;
+	}
+
+	if (messageType != MSG_TYPE_STREAM) {
+		printf("recvStreamBegin received a message that isn't a stream\n");
+		holdMessage(instance, header, *code, length, messageType);
+		return -1;
+	}
+
+	*type        = header->type;
+	*totalLength = header->totalLength;
+	releaseMessage(instance);
+
+	syncStreamWindow(instance, instance->recvDirection, stream);
+
+	stream->active    = true;
+	stream->remaining = *totalLength;
+	stream->position  = 0;
+	stream->available = 0;
+	stream->aborted   = false;
+
+	return 0;
+}
+
+// Copies up to length bytes of the stream into buffer and returns how
+// many were copied. Only blocks if nothing is available yet. Returns 0
+// once the whole stream has been read, or once the writer has ended it
+// short (recvStreamEnd tells the two apart).
+MSG_API size_t recvStreamRead(struct MPIController * instance, void * buffer, size_t length) {
+	struct MPIStream * stream = &instance->recvStream;
+	char * destination = (char *)buffer;
+	size_t total = 0;
+
+	if (!stream->active) {
+		printf("recvStreamRead called without an active stream\n");
+		return 0;
+	}
+
+	while (length > 0 && (stream->remaining > 0 || stream->available > 0)) {
+		// Only wait for a slot if nothing has been copied yet.
+		if (stream->available == 0) {
+			if (total > 0 && !tryWaitSemaphore(&instance->recvDirection->streamFilled)) {
+				break;
+			} else if (total == 0 && !waitForPeer(instance, &instance->recvDirection->streamFilled, 
+				&instance->stats->recv)) {
+				break;
+			}
+
+			stream->available = streamSlot(instance, stream)->length;
+			stream->position  = 0;
+
+			// Nothing more is coming.
+			if (stream->available == MSG_STREAM_ABORTED) {
+				postSemaphore(&instance->recvDirection->streamEmpty);
+				stream->slot++;
+				stream->available = 0;
+				stream->remaining = 0;
+				stream->aborted   = true;
+				break;
+			}
+		}
+
+		size_t count = stream->available - stream->position;
+		if (count > length) {
+			count = length;
+		}
+
+		char * slotData = (char *)streamSlot(instance, stream) + sizeof(struct MPIStreamSlot);
+
+		uint64_t start = statsClock(instance);
+		if (useStreamingCopy(instance, stream->remaining)) {
+			streamingCopy(destination, slotData + stream->position, count);
+		} else {
+			memcpy(destination, slotData + stream->position, count);
+		}
+		instance->stats->recv.copyNanoseconds += statsClock(instance) - start;
+		instance->stats->recv.bytes += count;
+
+		stream->position  += count;
+		stream->remaining -= count;
+		destination += count;
+		length -= count;
+		total  += count;
+
+		// Hand the slot back to the writer once it's empty.
+		if (stream->position == stream->available) {
+			postSemaphore(&instance->recvDirection->streamEmpty);
+			stream->slot++;
+			stream->available = 0;
+		}
+	}
+
+	return total;
+}
+
+// Finishes reading the stream. Anything that wasn't read is discarded.
+// Returns 0, or -1 if the writer ended the stream before writing all 
+// of it.
+MSG_API int recvStreamEnd(struct MPIController * instance) {
+	struct MPIStream * stream = &instance->recvStream;
+	char discard[4096];
+
+	if (!stream->active) {
+		printf("recvStreamEnd called without an active stream\n");
+		return -1;
+	}
+
+	while (recvStreamRead(instance, discard, sizeof(discard)) > 0);
+
+	stream->active = false;
+	return stream->aborted ? -1 : 0;
+}
+
+// Unmaps everything the instance has mapped and closes its shared 
+// memory, without removing anything.
+MSG_API void unmapInstance(struct MPIController * instance) {
+	stopCapture(instance);
+
+	if (instance->sendMapping.data != NULL) {
+		munmap(instance->sendMapping.data, instance->sendMapping.size);
+	}
+	if (instance->recvMapping.data != NULL) {
+		munmap(instance->recvMapping.data, instance->recvMapping.size);
+	}
+	if (instance->sendStream.window.data != NULL) {
+		munmap(instance->sendStream.window.data, instance->sendStream.window.size);
+	}
+	if (instance->recvStream.window.data != NULL) {
+		munmap(instance->recvStream.window.data, instance->recvStream.window.size);
+	}
+
+	// Timing is only turned on when the statistics segment is mapped.
+	if (instance->timing) {
+		munmap(instance->statsBlock, sizeof(struct MPIStatsBlock));
+	} else {
+		free(instance->statsBlock);
+	}
+
+	if (instance->messageFd != -1) {
+		close(instance->messageFd);
+	}
+	if (instance->notifyFd != -1) {
+		close(instance->notifyFd);
+	}
+
+	munmap(instance->control, instance->controlSize);
+	close(instance->fd);
+}
+
+// Unlinks the shared memory used by the instance and unmaps it.
+MSG_API void shmDestroy(struct MPIController * instance) {
+	shm_unlink(instance->segmentName);
+
+	if (instance->timing) {
+		shm_unlink(instance->statsName);
+	}
+
+	char path[MSG_MAX_NAME];
+	for (int i = 0; i < 2; ++i) {
+		getNotifyPath(path, instance->system_name, i);
+		unlink(path);
+	}
+
+	unmapInstance(instance);
+}
+
+// The shared memory backend, used in both rendezvous and ring mode.
+MSG_API const struct MPITransport * sharedMemoryTransport(void) {
+	static const struct MPITransport transport = {
+		shmAcquireSendBuffer,
+		shmPostSend,
+		shmCanSend,
+		shmSendv,
+		shmSendBatch,
+		shmReceiveView,
+		shmReleaseMessage,
+		shmMessageFd,
+		shmAcceptChild,
+		shmDestroy,
+		unmapInstance,
+		true
+	};
+
+	return &transport;
+}
+
+// Sends the child of a persistent world the MSG_TYPE_DETACH message, 
+// waiting at most MSG_DETACH_TIMEOUT_MS for it to take the previous
+// message and this one (in rendezvous mode) or for room in the ring.
+// Returns FALSE if it didn't in time.
+MSG_API bool sendDetach(struct MPIController * instance) {
+	int64_t timeout = (int64_t)MSG_DETACH_TIMEOUT_MS * 1000000;
+	uint64_t deadline = monotonicNanoseconds() + timeout;
+
+	if (instance->deliveryPending) {
+		if (waitForPeerTimed(instance, &instance->sendDirection->received, &instance->stats->send, timeout) != 0) {
+			return false;
+		}
+		instance->deliveryPending = false;
+	}
+
+	while (!canSend(instance, 0)) {
+		if (monotonicNanoseconds() >= deadline) {
+			return false;
+		}
+		usleep(1000);
+	}
+
+	if (acquireSendBuffer(instance, 0) == NULL) {
+		return false;
+	}
+
+	postSend(instance, 0, MSG_TYPE_DETACH);
+
+	if (!instance->deliveryPending) {
+		return true;
+	}
+
+	instance->deliveryPending = false;
+	return waitForPeerTimed(instance, &instance->sendDirection->received, &instance->stats->send, timeout) == 0;
+}
+
+// Detaches a controller from a persistent world and frees the instance.
+// The child receives a MSG_TYPE_DETACH message and the world is left
+// running for the next controller. In rendezvous mode this waits for
+// the child to pick the message up, but gives up after 
+// MSG_DETACH_TIMEOUT_MS; the world is released either way.
+MSG_API void detachInstance(struct MPIController * instance) {
+	if (instance->childAttached && !sendDetach(instance)) {
+		printf("%s did not take the detach message in time\n", instance->segmentName);
+	}
+
+	int32_t pid = getpid();
+	__atomic_compare_exchange_n(&instance->control->controllerPid, &pid, 0, 
+		false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+
+	unmapInstance(instance);
+	free(instance);
+}
+
+// Unmaps and unlinks the shared memory used by the instance and 
+// frees the instance. Call this in the controller program before
+// it exits. Do not call in the child program, except in the child of
+// a persistent world, which owns the shared memory. In a controller
+// attached to a persistent world this is the same as detachInstance.
+// More than one call might cause a problem.
+MSG_API void destroyInstance(struct MPIController * instance) {
+	if (instance->persistent && instance->is_controller) {
+		detachInstance(instance);
+		return;
+	}
+
+	instance->transport->destroy(instance);
+
+	// Don't leave a zombie behind if mpirun is already done.
+	if (instance->is_controller) {
+		isChildRunning(instance);
+	}
+
+	free(instance);
+}
+
+// Frees the instance from whichever side holds it: a controller and
+// the child of a persistent world destroy it, while the child of any
+// other world only closes it and leaves the shared memory to the 
+// controller that created it.
+MSG_API void closeInstance(struct MPIController * instance) {
+	if (instance->is_controller || instance->persistent) {
+		destroyInstance(instance);
+		return;
+	}
+
+	instance->transport->close(instance);
+	free(instance);
+}
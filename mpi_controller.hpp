@@ -0,0 +1,431 @@
+// Copyright 2018 Adam Robinson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy of 
+// this software and associated documentation files (the "Software"), to deal in the 
+// Software without restriction, including without limitation the rights to use, copy, 
+// modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, 
+// and to permit persons to whom the Software is furnished to do so, subject to the 
+// following conditions:
+
+// The above copyright notice and this permission notice shall be included in all 
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF 
+// CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE 
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+// C++17 interface on top of mpi_controller.h. Messages are sent and
+// received as typed values instead of void pointers and lengths:
+//
+//     mpi_controller::Controller inst = mpi_controller::Controller::create("name", "-n 4 ./child.o");
+//     inst.send(1, std::vector<double>{1.0, 2.0});
+//
+//     std::vector<double> values; // reused for every message
+//     while (inst.recv(values)) { ... }
+//
+// Everything is written straight into shared memory and read straight
+// out of it, and the instance is destroyed when the Controller goes
+// out of scope. The type of every message is checked on receipt.
+
+#ifndef MPI_CONTROLLER_HPP
+#define MPI_CONTROLLER_HPP
+
+#include "mpi_controller.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace mpi_controller {
+
+// A pointer and a number of elements, for sending from and receiving
+// into memory the caller manages.
+template <typename T>
+struct Span {
+	T *    data;
+	size_t size;
+};
+
+template <typename T>
+Span<T> makeSpan(T * data, size_t size) {
+	return Span<T>{data, size};
+}
+
+template <typename T> struct IsSpan : std::false_type {};
+template <typename T> struct IsSpan<Span<T>> : std::true_type {};
+
+// Hash of the name of T as the compiler spells it. Both sides have to
+// be built with the same compiler for these to agree.
+template <typename T>
+constexpr uint32_t typeNameHash() {
+	uint32_t hash = 2166136261u;
+	for (const char * c = __PRETTY_FUNCTION__; *c != '\0'; ++c) {
+		hash = (hash ^ (uint8_t)*c) * 16777619u;
+	}
+	return hash;
+}
+
+// The type every message carries. The built in types get the C 
+// MSG_TYPE_* values so that C code on the other side understands 
+// them; any other type gets a positive value of at least 16 derived
+// from its name. Specialize this to pin a struct to a value of your
+// own, e.g. to talk to C code or to a program built with another 
+// compiler.
+template <typename T, typename = void>
+struct TypeTag {
+	static constexpr int value = 16 + (int)(typeNameHash<T>() % (INT_MAX - 16));
+};
+
+template <> struct TypeTag<int>    { static constexpr int value = MSG_TYPE_INT; };
+template <> struct TypeTag<float>  { static constexpr int value = MSG_TYPE_FLOAT; };
+template <> struct TypeTag<double> { static constexpr int value = MSG_TYPE_DOUBLE; };
+template <> struct TypeTag<char>   { static constexpr int value = MSG_TYPE_STRING; };
+
+// How each kind of value is laid out in a message. Arrays (vectors,
+// spans, strings) are their elements back to back and have the tag of
+// their element type. Tuples are their elements back to back without
+// padding and have a tag of their own.
+template <typename T, typename = void>
+struct Codec;
+
+template <typename T>
+struct Codec<T, std::enable_if_t<std::is_trivially_copyable<T>::value && !IsSpan<T>::value>> {
+	static constexpr int tag = TypeTag<T>::value;
+
+	static size_t size(const T &) { return sizeof(T); }
+	static void write(char * buffer, const T & value) { memcpy(buffer, &value, sizeof(T)); }
+
+	static bool read(const char * buffer, size_t length, T & value) {
+		if (length != sizeof(T)) {
+			return false;
+		}
+		memcpy(&value, buffer, sizeof(T));
+		return true;
+	}
+};
+
+template <typename T>
+struct Codec<std::vector<T>> {
+	static_assert(std::is_trivially_copyable<T>::value, "vector elements have to be trivially copyable");
+	static constexpr int tag = TypeTag<T>::value;
+
+	static size_t size(const std::vector<T> & value) { return value.size() * sizeof(T); }
+	static void write(char * buffer, const std::vector<T> & value) { 
+		memcpy(buffer, value.data(), value.size() * sizeof(T)); 
+	}
+
+	// Keeps the vector's storage, so receiving into the same vector 
+	// again only allocates when a message is larger than any before.
+	static bool read(const char * buffer, size_t length, std::vector<T> & value) {
+		if (length % sizeof(T) != 0) {
+			return false;
+		}
+		value.resize(length / sizeof(T));
+		memcpy(value.data(), buffer, length);
+		return true;
+	}
+};
+
+template <>
+struct Codec<std::string> {
+	static constexpr int tag = MSG_TYPE_STRING;
+
+	static size_t size(const std::string & value) { return value.size(); }
+	static void write(char * buffer, const std::string & value) { memcpy(buffer, value.data(), value.size()); }
+
+	static bool read(const char * buffer, size_t length, std::string & value) {
+		value.assign(buffer, length);
+		return true;
+	}
+};
+
+template <typename T>
+struct Codec<Span<T>> {
+	static_assert(std::is_trivially_copyable<std::remove_const_t<T>>::value, 
+		"span elements have to be trivially copyable");
+	static constexpr int tag = TypeTag<std::remove_const_t<T>>::value;
+
+	static size_t size(const Span<T> & value) { return value.size * sizeof(T); }
+	static void write(char * buffer, const Span<T> & value) { memcpy(buffer, value.data, value.size * sizeof(T)); }
+
+	// Fills the front of the span. Fails if the message doesn't fit.
+	static bool read(const char * buffer, size_t length, Span<T> & value) {
+		if (length % sizeof(T) != 0 || length > value.size * sizeof(T)) {
+			return false;
+		}
+		memcpy(value.data, buffer, length);
+		value.size = length / sizeof(T);
+		return true;
+	}
+};
+
+template <typename... Ts>
+struct Codec<std::tuple<Ts...>> {
+	static_assert((std::is_trivially_copyable<Ts>::value && ...), 
+		"tuple elements have to be trivially copyable");
+	static constexpr int tag = TypeTag<std::tuple<Ts...>>::value;
+	static constexpr size_t packedSize = (sizeof(Ts) + ... + 0);
+
+	static size_t size(const std::tuple<Ts...> &) { return packedSize; }
+
+	static void write(char * buffer, const std::tuple<Ts...> & value) {
+		std::apply([&buffer](const Ts &... element) {
+			((memcpy(buffer, &element, sizeof(Ts)), buffer += sizeof(Ts)), ...);
+		}, value);
+	}
+
+	static bool read(const char * buffer, size_t length, std::tuple<Ts...> & value) {
+		if (length != packedSize) {
+			return false;
+		}
+		std::apply([&buffer](Ts &... element) {
+			((memcpy(&element, buffer, sizeof(Ts)), buffer += sizeof(Ts)), ...);
+		}, value);
+		return true;
+	}
+};
+
+// A message received without copying it, as with recvMessageView. It
+// points into shared memory and is released when it goes out of scope.
+class Message {
+public:
+	Message() : instance(nullptr), data(nullptr), length(0), code(0), type(0) {}
+
+	Message(Message && other) noexcept : Message() { swap(other); }
+
+	Message & operator=(Message && other) noexcept {
+		Message(std::move(other)).swap(*this);
+		return *this;
+	}
+
+	Message(const Message &) = delete;
+	Message & operator=(const Message &) = delete;
+
+	~Message() { release(); }
+
+	// Lets the sender reuse the memory before going out of scope.
+	void release() {
+		if (instance != nullptr) {
+			releaseMessage(instance);
+			instance = nullptr;
+		}
+	}
+
+	explicit operator bool() const { return instance != nullptr; }
+
+	// TRUE if the message holds a value of type T.
+	template <typename T>
+	bool is() const { return type == Codec<T>::tag; }
+
+	// Copies the message into value. Fails if it holds something else.
+	template <typename T>
+	bool get(T & value) const {
+		return instance != nullptr && is<T>() && Codec<T>::read(data, length, value);
+	}
+
+	// The elements of an array message, read in place.
+	template <typename T>
+	Span<const T> elements() const {
+		static_assert(std::is_trivially_copyable<T>::value, "elements have to be trivially copyable");
+		if (instance == nullptr || type != TypeTag<T>::value) {
+			return Span<const T>{nullptr, 0};
+		}
+		return Span<const T>{reinterpret_cast<const T *>(data), length / sizeof(T)};
+	}
+
+	int getCode() const { return code; }
+	int getType() const { return type; }
+	size_t getLength() const { return length; }
+	const void * getData() const { return data; }
+
+private:
+	friend class Controller;
+
+	void swap(Message & other) noexcept {
+		std::swap(instance, other.instance);
+		std::swap(data, other.data);
+		std::swap(length, other.length);
+		std::swap(code, other.code);
+		std::swap(type, other.type);
+	}
+
+	struct MPIController * instance;
+	const char *           data;
+	size_t                 length;
+	int                    code;
+	int                    type;
+};
+
+// Owns an instance and closes it when it goes out of scope; see 
+// closeInstance for what that means on each side.
+class Controller {
+public:
+	Controller() : instance(nullptr), lastCode(0), lastType(0) {}
+	explicit Controller(struct MPIController * instance) : instance(instance), lastCode(0), lastType(0) {}
+
+	Controller(Controller && other) noexcept : Controller() { swap(other); }
+
+	Controller & operator=(Controller && other) noexcept {
+		Controller(std::move(other)).swap(*this);
+		return *this;
+	}
+
+	Controller(const Controller &) = delete;
+	Controller & operator=(const Controller &) = delete;
+
+	~Controller() {
+		if (instance != nullptr) {
+			closeInstance(instance);
+		}
+	}
+
+	// See createControllerInstanceWithOptions. Empty if the world 
+	// couldn't be started.
+	static Controller create(const std::string & name, const char * MPIArguments, 
+		struct MPIControllerOptions * options = nullptr) {
+		return Controller(createControllerInstanceWithOptions(const_cast<char *>(name.c_str()), 
+			const_cast<char *>(MPIArguments), options));
+	}
+
+	// See createChildInstance.
+	static Controller child(const std::string & name) {
+		return Controller(createChildInstance(const_cast<char *>(name.c_str())));
+	}
+
+	// See attachControllerInstance.
+	static Controller attach(const std::string & name, int timeout) {
+		return Controller(attachControllerInstance(const_cast<char *>(name.c_str()), timeout));
+	}
+
+	explicit operator bool() const { return instance != nullptr; }
+	struct MPIController * get() const { return instance; }
+
+	// Gives up ownership of the instance without destroying it.
+	struct MPIController * release() {
+		struct MPIController * result = instance;
+		instance = nullptr;
+		return result;
+	}
+
+	// Sends a value, serializing it straight into shared memory. 
+	// Returns FALSE if there was no room for it (see acquireSendBuffer).
+	template <typename T>
+	bool send(int code, const T & value) {
+		size_t length = Codec<T>::size(value);
+		char * buffer = static_cast<char *>(acquireSendBuffer(instance, (int)length));
+
+		if (buffer == nullptr) {
+			return false;
+		}
+
+		Codec<T>::write(buffer, value);
+		commitSend(instance, code, Codec<T>::tag);
+		return true;
+	}
+
+	// Sends count elements starting at data as one array message.
+	template <typename T>
+	bool send(int code, const T * data, size_t count) {
+		return send(code, Span<const T>{data, count});
+	}
+
+	// Sends a small value through the priority lane, ahead of anything
+	// that is still queued (see sendPriorityMessage). Returns FALSE if
+	// it's longer than MSG_PRIORITY_MESSAGE_SIZE or the peer is gone.
+	template <typename T>
+	bool sendPriority(int code, const T & value) {
+		char buffer[MSG_PRIORITY_MESSAGE_SIZE];
+		size_t length = Codec<T>::size(value);
+
+		if (length > sizeof(buffer)) {
+			printf("priority message of length %zu is longer than %d bytes\n", length, MSG_PRIORITY_MESSAGE_SIZE);
+			return false;
+		}
+
+		Codec<T>::write(buffer, value);
+		return sendPriorityMessage(instance, buffer, code, (int)length, Codec<T>::tag);
+	}
+
+	// Receives the next message into value, waiting up to timeout 
+	// milliseconds (forever if negative). Returns FALSE if nothing 
+	// arrived or the message doesn't hold a T, in which case value is
+	// left alone and the message is put back for receive() to pick up;
+	// lastType tells which it was (and is MSG_TYPE_DETACH when the 
+	// controller of a persistent world went away).
+	template <typename T>
+	bool recv(T & value, int timeout = -1) {
+		Message message = receive(timeout);
+
+		if (!message) {
+			return false;
+		}
+
+		if (!message.get(value)) {
+			printf("received a message of type %d that doesn't match\n", message.type);
+			holdMessage(instance, message.data, message.code, (int)message.length, message.type);
+			message.instance = nullptr;
+			return false;
+		}
+
+		return true;
+	}
+
+	// Same as recv, but only receives into a span and sets count to the
+	// number of elements received.
+	template <typename T>
+	bool recv(T * data, size_t capacity, size_t & count, int timeout = -1) {
+		Span<T> span{data, capacity};
+		bool received = recv(span, timeout);
+		count = received ? span.size : 0;
+		return received;
+	}
+
+	// Receives the next message without copying it. Empty if nothing 
+	// arrived within timeout milliseconds (forever if negative).
+	Message receive(int timeout = -1) {
+		Message message;
+		int code, length, type;
+		const void * view = recvMessageViewTimed(instance, &code, &length, &type, timeout);
+
+		if (view == nullptr) {
+			lastType = 0;
+			return message;
+		}
+
+		lastCode = code;
+		lastType = type;
+
+		message.instance = instance;
+		message.data     = static_cast<const char *>(view);
+		message.length   = length;
+		message.code     = code;
+		message.type     = type;
+		return message;
+	}
+
+	int getLastCode() const { return lastCode; }
+	int getLastType() const { return lastType; }
+
+private:
+	void swap(Controller & other) noexcept {
+		std::swap(instance, other.instance);
+		std::swap(lastCode, other.lastCode);
+		std::swap(lastType, other.lastType);
+	}
+
+	struct MPIController * instance;
+	int lastCode; // Code of the last message received.
+	int lastType; // Type of the last message received, 0 if none.
+};
+
+} // namespace mpi_controller
+
+#endif
@@ -0,0 +1,194 @@
+// Copyright 2018 Adam Robinson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy of 
+// this software and associated documentation files (the "Software"), to deal in the 
+// Software without restriction, including without limitation the rights to use, copy, 
+// modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, 
+// and to permit persons to whom the Software is furnished to do so, subject to the 
+// following conditions:
+
+// The above copyright notice and this permission notice shall be included in all 
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF 
+// CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE 
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Keeps a pool of persistent MPI worlds running, so that controllers
+// can attach to one that has already gone through mpirun and MPI_Init
+// instead of starting their own. Every world is started with
+// MPI_CONTROLLER_NAME set to <pool>_<i> and MPI_CONTROLLER_PERSISTENT
+// set to 1, so its rank 0 should call createChildInstanceFromEnvironment
+// (see the README). Worlds that exit are started again. Controllers get
+// a world with acquirePooledInstance(pool, timeout).
+//
+// Usage: ./mpi_pool.o pool count mpirun arguments...
+//    e.g. ./mpi_pool.o warm 4 -n 4 ./worker.o
+//
+// Stops all worlds and cleans up on SIGINT or SIGTERM. With Open MPI on
+// more than one node, add -x MPI_CONTROLLER_NAME -x MPI_CONTROLLER_PERSISTENT
+// so that the variables reach the remote ranks.
+
+#include "mpi_controller.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+
+// Shortest time between two starts of the same world, in seconds, so
+// that a world that can't start doesn't keep the machine busy.
+#define POOL_RESTART_DELAY 1.0
+
+volatile sig_atomic_t stopping = 0;
+
+void onSignal(int number) {
+	(void)number;
+	stopping = 1;
+}
+
+// Starts world number index of the pool. Returns the PID of its mpirun.
+pid_t startWorld(char * pool, int index, char * arguments) {
+	extern char ** environ;
+
+	char name[MSG_MAX_NAME];
+	char nameVariable[MSG_MAX_NAME + 32];
+	snprintf(name, MSG_MAX_NAME, "%s_%d", pool, index);
+	snprintf(nameVariable, sizeof(nameVariable), "%s=%s", MSG_ENV_NAME, name);
+
+	// Ours go first, so that they win over anything inherited.
+	int count = 0;
+	while (environ[count] != NULL) {
+		count++;
+	}
+
+	char ** environment = malloc(sizeof(char *) * (count + 3));
+	environment[0] = nameVariable;
+	environment[1] = MSG_ENV_PERSISTENT "=1";
+	memcpy(environment + 2, environ, sizeof(char *) * (count + 1));
+
+	pid_t pid = spawnMPIRun(arguments, environment);
+	free(environment);
+
+	printf("started %s (mpirun %d)\n", name, pid);
+	fflush(stdout);
+
+	return pid;
+}
+
+// Removes the shared memory a world leaves behind when it's killed.
+void removeWorld(char * pool, int index) {
+	char name[MSG_MAX_NAME];
+	char segment[MSG_MAX_NAME];
+	snprintf(name, MSG_MAX_NAME, "%s_%d", pool, index);
+
+	if (getControlSegmentName(segment, name)) {
+		shm_unlink(segment);
+	}
+	if (getStatsSegmentName(segment, name)) {
+		shm_unlink(segment);
+	}
+}
+
+int main(int argc, char ** argv) {
+	if (argc < 4) {
+		printf("usage: %s pool count mpirun arguments...\n", argv[0]);
+		return 1;
+	}
+
+	char * pool  = argv[1];
+	int    count = atoi(argv[2]);
+
+	if (count < 1) {
+		printf("count has to be at least 1\n");
+		return 1;
+	}
+
+	// The remaining arguments are passed to mpirun as they are. They 
+	// are split again by spawnMPIRun, so quote the ones with spaces.
+	char arguments[MSG_MAX_ARGUMENTS_LENGTH] = "";
+	for (int i = 3; i < argc; ++i) {
+		bool quote = strchr(argv[i], ' ') != NULL;
+		size_t used = strlen(arguments);
+		snprintf(arguments + used, sizeof(arguments) - used, quote ? "'%s' " : "%s ", argv[i]);
+	}
+
+	char poolName[MSG_MAX_NAME];
+	snprintf(poolName, MSG_MAX_NAME, "/%s_pool", pool);
+	shm_unlink(poolName);
+
+	int fd = shm_open(poolName, O_RDWR | O_CREAT | O_EXCL, 0777);
+
+	if (fd == -1 || ftruncate(fd, sizeof(struct MPIPoolBlock)) == -1) {
+		printf("could not create %s\n", poolName);
+		return 1;
+	}
+
+	struct MPIPoolBlock * block = mmap(NULL, sizeof(struct MPIPoolBlock), PROT_READ | PROT_WRITE, 
+		MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (block == (void *)-1) {
+		printf("mmap failed\n");
+		return 1;
+	}
+
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+
+	pid_t * pids = malloc(sizeof(pid_t) * count);
+	uint64_t * started = malloc(sizeof(uint64_t) * count);
+
+	for (int i = 0; i < count; ++i) {
+		removeWorld(pool, i);
+		pids[i]    = startWorld(pool, i, arguments);
+		started[i] = monotonicNanoseconds();
+	}
+
+	block->version    = MSG_POOL_VERSION;
+	block->worlds     = count;
+	block->managerPid = getpid();
+	__atomic_store_n(&block->magic, MSG_POOL_MAGIC, __ATOMIC_RELEASE);
+
+	while (!stopping) {
+		usleep(100000);
+
+		for (int i = 0; i < count; ++i) {
+			if (pids[i] != -1) {
+				int status;
+				if (waitpid(pids[i], &status, WNOHANG) != pids[i]) {
+					continue;
+				}
+
+				printf("world %s_%d exited with status %d\n", pool, i, 
+					WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+				removeWorld(pool, i);
+				pids[i] = -1;
+			}
+
+			if ((monotonicNanoseconds() - started[i]) / 1e9 >= POOL_RESTART_DELAY) {
+				pids[i]    = startWorld(pool, i, arguments);
+				started[i] = monotonicNanoseconds();
+			}
+		}
+	}
+
+	// New controllers shouldn't find the pool while it shuts down.
+	shm_unlink(poolName);
+
+	for (int i = 0; i < count; ++i) {
+		if (pids[i] != -1) {
+			kill(pids[i], SIGTERM);
+			waitpid(pids[i], NULL, 0);
+		}
+		removeWorld(pool, i);
+	}
+
+	printf("pool %s stopped\n", pool);
+
+	munmap(block, sizeof(struct MPIPoolBlock));
+	free(pids);
+	free(started);
+	return 0;
+}
@@ -0,0 +1,409 @@
+// Copyright 2018 Adam Robinson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy of 
+// this software and associated documentation files (the "Software"), to deal in the 
+// Software without restriction, including without limitation the rights to use, copy, 
+// modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, 
+// and to permit persons to whom the Software is furnished to do so, subject to the 
+// following conditions:
+
+// The above copyright notice and this permission notice shall be included in all 
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF 
+// CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE 
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Plays back the traffic in a capture log (see startCapture) between
+// this program and a forked copy of it, so that a protocol can be
+// tuned without running the job that produced the log. This program
+// plays the controller and the copy plays the child. Each side sends
+// its messages at the time they were captured, scaled by the rate, and
+// receives the other side's in the order they were captured. At the
+// end the replay is compared with the capture: duration, throughput,
+// and the response time of the child, which is the time from a message
+// to the child until the next message back.
+//
+// Usage: ./mpi_replay.o log [options]
+//     -r rate             speed relative to the capture (default 1),
+//                         0 to send everything as fast as possible
+//     -c rendezvous|ring  channel mode (default the captured one; a
+//                         socket log is replayed in ring mode, whose
+//                         sends don't wait for the receiver either)
+//     -w block|spin|spinblock  wait strategy of both sides (default block)
+//     -R rank             replay the log of this rank of a group, which
+//                         was captured to log.r<rank> (see 
+//                         getRankCapturePath)
+
+#include "mpi_controller.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// A capture log, mapped read-only, and the position of every record.
+struct CaptureLog {
+	const struct MPICaptureHeader * header;
+	const struct MPICaptureRecord ** records;
+	uint64_t count;
+	size_t   largest; // Length of the largest message.
+};
+
+// What one side of the replay needs.
+struct ReplaySettings {
+	double rate;
+	int    channelMode;
+	int    waitStrategy;
+};
+
+int compareSamples(const void * a, const void * b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+const char * channelName(int channelMode) {
+	if (channelMode == MSG_CHANNEL_SOCKET) {
+		return "socket";
+	}
+	return channelMode == MSG_CHANNEL_RING ? "ring" : "rendezvous";
+}
+
+int parseWaitStrategy(const char * text) {
+	if (strcmp(text, "spin") == 0) {
+		return MSG_WAIT_SPIN;
+	} else if (strcmp(text, "spinblock") == 0) {
+		return MSG_WAIT_SPIN_THEN_BLOCK;
+	}
+	return MSG_WAIT_BLOCK;
+}
+
+// Maps a capture log and finds its records. Returns FALSE if it isn't 
+// one, or if it's cut short or corrupt.
+bool openCaptureLog(const char * path, struct CaptureLog * log) {
+	int fd = open(path, O_RDONLY);
+
+	if (fd == -1) {
+		printf("could not open %s\n", path);
+		return false;
+	}
+
+	struct stat status;
+
+	if (fstat(fd, &status) == -1 || (size_t)status.st_size < sizeof(struct MPICaptureHeader)) {
+		printf("%s is not a capture log\n", path);
+		close(fd);
+		return false;
+	}
+
+	void * data = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (data == (void *)-1) {
+		printf("mmap failed for %s\n", path);
+		return false;
+	}
+
+	log->header = (const struct MPICaptureHeader *)data;
+
+	if (log->header->magic != MSG_CAPTURE_MAGIC || log->header->version != MSG_CAPTURE_VERSION) {
+		printf("%s is not a capture log of this version\n", path);
+		munmap(data, status.st_size);
+		return false;
+	}
+
+	// Every record has to lie within the length the header gives, and
+	// that within the file.
+	uint64_t length = log->header->length;
+
+	if (length > (uint64_t)status.st_size - sizeof(struct MPICaptureHeader) ||
+		log->header->records > length / sizeof(struct MPICaptureRecord)) {
+		printf("%s is cut short or corrupt\n", path);
+		munmap(data, status.st_size);
+		return false;
+	}
+
+	log->count   = log->header->records;
+	log->records = (const struct MPICaptureRecord **)malloc(log->count * sizeof(struct MPICaptureRecord *));
+	log->largest = 0;
+
+	const char * position = (const char *)data + sizeof(struct MPICaptureHeader);
+	const char * end      = position + length;
+	for (uint64_t i = 0; i < log->count; ++i) {
+		const struct MPICaptureRecord * record = (const struct MPICaptureRecord *)position;
+
+		if ((size_t)(end - position) < sizeof(struct MPICaptureRecord) || record->length < 0 ||
+			((uint64_t)record->length + 7) / 8 * 8 > (size_t)(end - position) - sizeof(struct MPICaptureRecord)) {
+			printf("record %llu of %s is cut short or corrupt\n", (unsigned long long)i, path);
+			free(log->records);
+			munmap(data, status.st_size);
+			return false;
+		}
+
+		log->records[i] = record;
+
+		if ((size_t)record->length > log->largest) {
+			log->largest = record->length;
+		}
+
+		position += sizeof(struct MPICaptureRecord) + ((record->length + 7) & ~7);
+	}
+
+	return true;
+}
+
+// Sleeps until the given monotonicNanoseconds.
+void waitUntil(uint64_t deadline) {
+	struct timespec until;
+	until.tv_sec  = deadline / 1000000000ull;
+	until.tv_nsec = deadline % 1000000000ull;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR);
+}
+
+// Plays one side of the log. Messages going the way this side sends
+// are sent on schedule, the others are received. If times isn't NULL,
+// the time every record was sent or received is stored in it. Returns
+// the number of received messages that didn't match the log.
+uint64_t playLog(struct MPIController * instance, struct CaptureLog * log, struct ReplaySettings * settings,
+	uint64_t start, uint64_t * times) {
+	int sendDirection = instance->is_controller ? MSG_TO_CHILD : MSG_TO_CONTROLLER;
+	uint64_t mismatches = 0;
+
+	for (uint64_t i = 0; i < log->count; ++i) {
+		const struct MPICaptureRecord * record = log->records[i];
+
+		if (record->direction == sendDirection) {
+			if (settings->rate > 0.0) {
+				waitUntil(start + (uint64_t)(record->timestamp / settings->rate));
+			}
+
+			sendMessage(instance, (void *)(record + 1), record->code, record->length, record->type);
+		} else {
+			int code;
+			int length;
+			int type;
+			recvMessageView(instance, &code, &length, &type);
+
+			if (code != record->code || length != record->length || type != record->type) {
+				mismatches++;
+			}
+
+			releaseMessage(instance);
+		}
+
+		if (times != NULL) {
+			times[i] = monotonicNanoseconds() - start;
+		}
+	}
+
+	return mismatches;
+}
+
+// Summary of one run of the log, from the controller's point of view.
+struct ReplaySummary {
+	double   seconds;
+	uint64_t bytes;
+	uint64_t responses;
+	double   responseMean; // In microseconds.
+	double   response50;
+	double   response99;
+	double   responseMax;
+};
+
+// Works out the summary of a run, given the time of each record.
+void summarize(struct CaptureLog * log, const uint64_t * times, struct ReplaySummary * summary) {
+	uint64_t * responses = (uint64_t *)malloc(log->count * sizeof(uint64_t));
+	uint64_t count = 0;
+	uint64_t total = 0;
+	int64_t lastRequest = -1;
+
+	summary->bytes = 0;
+
+	for (uint64_t i = 0; i < log->count; ++i) {
+		summary->bytes += log->records[i]->length;
+
+		if (log->records[i]->direction == MSG_TO_CHILD) {
+			lastRequest = i;
+		} else if (lastRequest >= 0) {
+			uint64_t response = times[i] - times[lastRequest];
+			responses[count++] = response;
+			total += response;
+			lastRequest = -1;
+		}
+	}
+
+	summary->seconds   = log->count > 0 ? (times[log->count - 1] - times[0]) / 1e9 : 0.0;
+	summary->responses = count;
+
+	if (count > 0) {
+		qsort(responses, count, sizeof(uint64_t), compareSamples);
+		summary->responseMean = total / (double)count / 1e3;
+		summary->response50   = responses[count / 2] / 1e3;
+		summary->response99   = responses[(count * 99) / 100] / 1e3;
+		summary->responseMax  = responses[count - 1] / 1e3;
+	} else {
+		summary->responseMean = 0.0;
+		summary->response50   = 0.0;
+		summary->response99   = 0.0;
+		summary->responseMax  = 0.0;
+	}
+
+	free(responses);
+}
+
+void printComparison(const char * label, double recorded, double replayed) {
+	printf("%-22s %14.2f %14.2f\n", label, recorded, replayed);
+}
+
+int main(int argc, char ** argv) {
+	if (argc < 2) {
+		printf("usage: %s log [-r rate] [-c rendezvous|ring] [-w block|spin|spinblock] [-R rank]\n", argv[0]);
+		return 1;
+	}
+
+	struct ReplaySettings settings;
+	settings.rate         = 1.0;
+	settings.channelMode  = -1;
+	settings.waitStrategy = MSG_WAIT_BLOCK;
+
+	int rank = 0;
+
+	for (int i = 2; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "-r") == 0) {
+			settings.rate = atof(argv[i + 1]);
+		} else if (strcmp(argv[i], "-c") == 0) {
+			settings.channelMode = strcmp(argv[i + 1], "ring") == 0 ? MSG_CHANNEL_RING : MSG_CHANNEL_RENDEZVOUS;
+		} else if (strcmp(argv[i], "-w") == 0) {
+			settings.waitStrategy = parseWaitStrategy(argv[i + 1]);
+		} else if (strcmp(argv[i], "-R") == 0) {
+			rank = atoi(argv[i + 1]);
+		} else {
+			printf("unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	char path[PATH_MAX];
+	if (!getRankCapturePath(path, argv[1], rank)) {
+		return 1;
+	}
+
+	struct CaptureLog log;
+	if (!openCaptureLog(path, &log)) {
+		return 1;
+	}
+
+	if (settings.channelMode == -1) {
+		settings.channelMode = log.header->channelMode == MSG_CHANNEL_SOCKET ? MSG_CHANNEL_RING : 
+			log.header->channelMode;
+	}
+
+	printf("%s: %llu messages, captured by the %s in %s mode\n", path, (unsigned long long)log.count,
+		log.header->controller ? "controller" : "child",
+		channelName(log.header->channelMode));
+
+	if (settings.rate > 0.0) {
+		printf("replaying at %.2fx in %s mode\n", settings.rate, channelName(settings.channelMode));
+	} else {
+		printf("replaying as fast as possible in %s mode\n", channelName(settings.channelMode));
+	}
+	fflush(stdout);
+
+	if (log.count == 0) {
+		return 0;
+	}
+
+	// The ring has to hold the largest message.
+	struct MPIControllerOptions options;
+	initControllerOptions(&options);
+	options.channelMode  = settings.channelMode;
+	options.ringCapacity = 16 << 20;
+	while (options.ringCapacity < 2 * (log.largest + sizeof(struct MPIRecord))) {
+		options.ringCapacity *= 2;
+	}
+
+	char name[MSG_MAX_NAME];
+	snprintf(name, sizeof(name), "replay_%d", getpid());
+
+	pid_t peer = fork();
+
+	// Both sides start the clock at the time the controller sends first.
+	if (peer == 0) {
+		struct MPIController * child = createChildInstance(name);
+		if (child == NULL) {
+			exit(1);
+		}
+		setWaitStrategy(child, settings.waitStrategy, 0);
+
+		int code;
+		int length;
+		int type;
+		uint64_t * start = (uint64_t *)recvMessage(child, &code, &length, &type);
+		if (start == NULL || length != sizeof(uint64_t)) {
+			printf("the child did not get the start time\n");
+			exit(1);
+		}
+
+		uint64_t mismatches = playLog(child, &log, &settings, *start, NULL);
+		if (mismatches > 0) {
+			printf("the child received %llu messages that don't match the log\n", (unsigned long long)mismatches);
+		}
+
+		free(start);
+		exit(0);
+	}
+
+	struct MPIController * instance = createControllerInstanceWithOptions(name, NULL, &options);
+	if (instance == NULL) {
+		printf("could not create the instance to replay on\n");
+		kill(peer, SIGKILL);
+		waitpid(peer, NULL, 0);
+		return 1;
+	}
+	setWaitStrategy(instance, settings.waitStrategy, 0);
+
+	uint64_t start = monotonicNanoseconds() + 10000000ull;
+	sendMessage(instance, &start, 0, sizeof(start), MSG_TYPE_INT);
+
+	uint64_t * times = (uint64_t *)malloc(log.count * sizeof(uint64_t));
+	uint64_t mismatches = playLog(instance, &log, &settings, start, times);
+
+	if (mismatches > 0) {
+		printf("the controller received %llu messages that don't match the log\n", (unsigned long long)mismatches);
+	}
+
+	int status;
+	waitpid(peer, &status, 0);
+	destroyInstance(instance);
+
+	// The capture has the time of every record already. Compare with
+	// what the replay should have taken at this rate.
+	uint64_t * captured = (uint64_t *)malloc(log.count * sizeof(uint64_t));
+	for (uint64_t i = 0; i < log.count; ++i) {
+		captured[i] = log.records[i]->timestamp;
+	}
+
+	struct ReplaySummary recorded;
+	struct ReplaySummary replayed;
+	summarize(&log, captured, &recorded);
+	summarize(&log, times, &replayed);
+
+	printf("\n%-22s %14s %14s\n", "", "captured", "replayed");
+	printComparison("duration (s)", recorded.seconds, replayed.seconds);
+	printComparison("messages/s", recorded.seconds > 0.0 ? log.count / recorded.seconds : 0.0,
+		replayed.seconds > 0.0 ? log.count / replayed.seconds : 0.0);
+	printComparison("MB/s", recorded.seconds > 0.0 ? recorded.bytes / recorded.seconds / 1e6 : 0.0,
+		replayed.seconds > 0.0 ? replayed.bytes / replayed.seconds / 1e6 : 0.0);
+	printComparison("response mean (us)", recorded.responseMean, replayed.responseMean);
+	printComparison("response p50 (us)", recorded.response50, replayed.response50);
+	printComparison("response p99 (us)", recorded.response99, replayed.response99);
+	printComparison("response max (us)", recorded.responseMax, replayed.responseMax);
+	printf("%llu responses\n", (unsigned long long)replayed.responses);
+
+	free(times);
+	free(captured);
+	return 0;
+}
@@ -0,0 +1,198 @@
+// Copyright 2018 Adam Robinson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy of 
+// this software and associated documentation files (the "Software"), to deal in the 
+// Software without restriction, including without limitation the rights to use, copy, 
+// modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, 
+// and to permit persons to whom the Software is furnished to do so, subject to the 
+// following conditions:
+
+// The above copyright notice and this permission notice shall be included in all 
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A 
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF 
+// CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE 
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Prints the statistics of a running controller/child pair without
+// disturbing it. The statistics segment is mapped read-only.
+//
+// Usage: ./mpi_stats.o name [interval]
+//            Prints rates every interval seconds (default 1) until
+//            the controller exits.
+//        ./mpi_stats.o name -t
+//            Prints the totals and the histograms once.
+//
+// name is the name passed to createControllerInstance.
+
+#include "mpi_controller.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+
+const char * processNames[2] = { "controller", "child" };
+
+void printRateHeader() {
+	printf("%-10s %-4s %12s %10s %7s %7s %10s %12s %7s %6s %6s\n", "process", "dir", "msgs/s", "MB/s", 
+		"copy %", "wait %", "waits/s", "avg wait us", "remaps", "queue", "max q");
+}
+
+// Prints what happened in one direction between two snapshots taken
+// seconds apart.
+void printRates(const char * process, const char * direction, struct MPIDirectionStats * now, 
+	struct MPIDirectionStats * before, double seconds, bool timing) {
+	uint64_t waits = now->waits - before->waits;
+	double waitNanoseconds = now->waitNanoseconds - before->waitNanoseconds;
+
+	printf("%-10s %-4s %12.0f %10.2f", process, direction, 
+		(now->messages - before->messages) / seconds,
+		(now->bytes - before->bytes) / seconds / 1e6);
+
+	if (timing) {
+		printf(" %7.1f %7.1f", 
+			100.0 * (now->copyNanoseconds - before->copyNanoseconds) / (seconds * 1e9),
+			100.0 * waitNanoseconds / (seconds * 1e9));
+	} else {
+		printf(" %7s %7s", "-", "-");
+	}
+
+	printf(" %10.0f", waits / seconds);
+
+	if (timing && waits > 0) {
+		printf(" %12.2f", waitNanoseconds / waits / 1000.0);
+	} else {
+		printf(" %12s", "-");
+	}
+
+	printf(" %7llu %6llu %6llu\n", (unsigned long long)now->remaps, 
+		(unsigned long long)now->queueDepth, (unsigned long long)now->maxQueueDepth);
+}
+
+// Prints the non-empty buckets of a histogram as [low, high) ranges.
+void printHistogram(const char * title, const uint64_t * histogram, const char * unit) {
+	printf("    %s\n", title);
+
+	for (int i = 0; i < MSG_STATS_BUCKETS; ++i) {
+		if (histogram[i] == 0) {
+			continue;
+		}
+
+		unsigned long long low  = i == 0 ? 0 : 1ull << (i - 1);
+		unsigned long long high = 1ull << i;
+
+		if (i == MSG_STATS_BUCKETS - 1) {
+			printf("        >= %llu %s: %llu\n", low, unit, (unsigned long long)histogram[i]);
+		} else {
+			printf("        %llu - %llu %s: %llu\n", low, high, unit, (unsigned long long)histogram[i]);
+		}
+	}
+}
+
+void printTotals(const char * process, const char * direction, const struct MPIDirectionStats * stats) {
+	printf("%s %s\n", process, direction);
+	printf("    messages: %llu, bytes: %llu\n", (unsigned long long)stats->messages, 
+		(unsigned long long)stats->bytes);
+	printf("    copying: %.3f s, waiting: %.3f s in %llu waits\n", stats->copyNanoseconds / 1e9, 
+		stats->waitNanoseconds / 1e9, (unsigned long long)stats->waits);
+	printf("    remaps: %llu, queue depth: %llu (max %llu)\n", (unsigned long long)stats->remaps,
+		(unsigned long long)stats->queueDepth, (unsigned long long)stats->maxQueueDepth);
+	printHistogram("message sizes", stats->sizeHistogram, "B");
+	printHistogram("wait times", stats->waitHistogram, "ns");
+}
+
+// Prints where the processes run and where the shared memory lives.
+void printPlacement(const struct MPIStatsBlock * stats) {
+	if (stats->memoryNode >= 0) {
+		printf("memory on node %d", stats->memoryNode);
+	} else {
+		printf("memory not bound");
+	}
+	printf("%s%s\n", (stats->placement & MSG_PLACE_PREFAULT) ? ", prefaulted" : "",
+		(stats->placement & MSG_PLACE_HUGE_PAGES) ? ", huge pages" : "");
+
+	for (int p = 0; p < 2; ++p) {
+		const struct MPIProcessStats * process = &stats->process[p];
+		if (process->pid == 0) {
+			continue;
+		}
+
+		printf("%-10s pid %d on CPU %d, node %d, ", processNames[p], process->pid, process->cpu, process->node);
+		if (process->pinned >= 0) {
+			printf("pinned\n");
+		} else {
+			printf("allowed on %d CPUs\n", process->cpus);
+		}
+	}
+	printf("\n");
+}
+
+int main(int argc, char ** argv) {
+	if (argc < 2) {
+		printf("usage: %s name [interval | -t]\n", argv[0]);
+		return 1;
+	}
+
+	const struct MPIStatsBlock * stats = openStats(argv[1]);
+
+	if (stats == NULL) {
+		printf("no statistics found for %s\n", argv[1]);
+		return 1;
+	}
+
+	printPlacement(stats);
+
+	if (argc > 2 && strcmp(argv[2], "-t") == 0) {
+		for (int p = 0; p < 2; ++p) {
+			if (stats->process[p].pid == 0) {
+				continue;
+			}
+			printTotals(processNames[p], "send", &stats->process[p].send);
+			printTotals(processNames[p], "recv", &stats->process[p].recv);
+		}
+		return 0;
+	}
+
+	double interval = argc > 2 ? atof(argv[2]) : 1.0;
+	if (interval <= 0.0) {
+		interval = 1.0;
+	}
+
+	struct MPIProcessStats previous[2];
+	memcpy(previous, stats->process, sizeof(previous));
+	uint64_t previousTime = monotonicNanoseconds();
+
+	while (true) {
+		usleep((useconds_t)(interval * 1e6));
+
+		// The segment stays mapped after the controller unlinks it, so
+		// look at the process instead.
+		if (kill(stats->process[MSG_STATS_CONTROLLER].pid, 0) == -1 && errno == ESRCH) {
+			printf("controller exited\n");
+			break;
+		}
+
+		struct MPIProcessStats current[2];
+		memcpy(current, stats->process, sizeof(current));
+		uint64_t currentTime = monotonicNanoseconds();
+		double seconds = (currentTime - previousTime) / 1e9;
+
+		printRateHeader();
+		for (int p = 0; p < 2; ++p) {
+			if (current[p].pid == 0) {
+				continue;
+			}
+			printRates(processNames[p], "send", &current[p].send, &previous[p].send, seconds, current[p].timing);
+			printRates(processNames[p], "recv", &current[p].recv, &previous[p].recv, seconds, current[p].timing);
+		}
+		printf("\n");
+		fflush(stdout);
+
+		memcpy(previous, current, sizeof(previous));
+		previousTime = currentTime;
+	}
+
+	return 0;
+}
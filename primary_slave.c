@@ -42,14 +42,14 @@ int main(int argc, char ** argv) {
 		// We need to receive messages in a loop so that the controller
 		// can run it's benchmark.
 
+		// The messages aren't used for anything, so there's no
+		// reason to copy them out of shared memory.
 		int code;
 		int length;
 		int type;
-		char * message;
 		for (int i = 0; i < MSG_COUNT; ++i) {
-			message = recvMessage(inst, &code, &length, &type);
-			free(message); // We will use up a lot of memory if we don't
-			               // deallocate this.
+			recvMessageView(inst, &code, &length, &type);
+			releaseMessage(inst);
 		}
 		
 		printf("Child finished receiving messages.\n");